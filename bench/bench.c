@@ -0,0 +1,463 @@
+/**
+ * @file bench.c
+ * @brief Carving synthetic images to time the library, and comparing the
+ *        times with a baseline
+ *
+ * Every case is carved once from a cold cache with a new context, and then
+ * reps times with the same context after a carve that isn't timed. The
+ * images are made from a fixed seed, so every run carves the same pixels.
+ * The results are written as JSON, and with --baseline the warm times are
+ * compared with those in an earlier run's JSON. With --counters, the stats
+ * of the fastest warm carve take in the hardware counters too.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <log.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <car.h>
+
+#include "car_internal.h"
+#include "tsc.h"
+
+// more than the last level cache of any machine we run on
+#define EVICT_BYTES ((size_t)64 << 20)
+
+typedef struct {
+  const char *name;
+  size_t width;
+  size_t height;
+  size_t out_width;
+  size_t out_height;
+  bool quick;  // carved with --quick too
+} bench_case;
+
+static const bench_case CASES[] = {
+  { "640x480-narrow",    640,  480,  480,  480, true  },
+  { "640x480-widen",     640,  480,  800,  480, true  },
+  { "1920x1080-few",    1920, 1080, 1900, 1080, true  },
+  { "1920x1080-narrow", 1920, 1080, 1440, 1080, false },
+  { "1920x1080-lower",  1920, 1080, 1920,  960, false },
+  { "400x2400-tall",     400, 2400,  300, 2400, false },
+  { "3840x2160-few",    3840, 2160, 3456, 2160, false },
+};
+
+static const char *STAGES[] = {
+  "grey", "transpose", "conv", "convp", "pathsum", "minpath", "rmpath", "insert", "malloc",
+};
+
+typedef struct {
+  size_t reps;
+  size_t threads;
+  bool quick;
+  bool counters;
+  const char *out;
+  const char *baseline;
+  double threshold;
+} bench_args;
+
+typedef struct {
+  double cold_s;
+  double warm_min_s;
+  double warm_median_s;
+  double cycles;                     // counter cycles of the fastest warm carve
+  uint64_t stages[sizeof(STAGES) / sizeof(STAGES[0])];  // least of each stage
+  car_stats stats;                   // of the fastest warm carve
+} bench_result;
+
+static int parse_args(int argc, const char *argv[], bench_args *args);
+static void make_image(rgb_image *img, size_t width, size_t height, uint32_t seed);
+static int run_case(const bench_case *bc, const bench_args *args, bench_result *res);
+static void stage_stats(const car_stats *stats, const car_stage_stats **stages);
+static void evict_cache(void);
+static double now(void);
+static int compare_double(const void *a, const void *b);
+static void write_json(FILE *fp, const bench_args *args, const bench_result *results);
+static char *read_file(const char *path);
+static int compare_baseline(const char *text, const bench_args *args,
+                            const bench_result *results);
+
+int main(int argc, const char *argv[]) {
+  bench_args args;
+  if (parse_args(argc, argv, &args) != 0) {
+    fprintf(stderr, "usage: %s [--quick] [--counters] [--reps N] [--threads N] [--out FILE]"
+                    " [--baseline FILE] [--threshold PERCENT]\n", argv[0]);
+    return 1;
+  }
+
+  // the library logs every carve, which would be most of the time here
+  log_set_level(LOG_WARN);
+
+  const size_t ncases = sizeof(CASES) / sizeof(CASES[0]);
+  bench_result *results = calloc(ncases, sizeof(*results));
+  if (!results) {
+    log_fatal("malloc failed");
+    return 1;
+  }
+
+  for (size_t k = 0; k < ncases; k++) {
+    if (args.quick && !CASES[k].quick) {
+      continue;
+    }
+    if (run_case(&CASES[k], &args, &results[k]) != 0) {
+      free(results);
+      return 1;
+    }
+    fprintf(stderr, "%-18s cold %8.4fs  warm min %8.4fs  median %8.4fs  %7.1f cycles/px\n",
+            CASES[k].name, results[k].cold_s, results[k].warm_min_s,
+            results[k].warm_median_s,
+            results[k].cycles / (double)(CASES[k].width * CASES[k].height));
+  }
+
+  FILE *fp = args.out ? fopen(args.out, "w") : stdout;
+  if (!fp) {
+    log_error("Could not open %s", args.out);
+    free(results);
+    return 1;
+  }
+  write_json(fp, &args, results);
+  if (args.out && fclose(fp) != 0) {
+    log_error("Could not write %s", args.out);
+    free(results);
+    return 1;
+  }
+
+  int status = 0;
+  if (args.baseline) {
+    char *text = read_file(args.baseline);
+    status = text ? compare_baseline(text, &args, results) : 1;
+    free(text);
+  }
+
+  free(results);
+  return status;
+}
+
+static int parse_args(int argc, const char *argv[], bench_args *args) {
+  args->reps = 5;
+  args->threads = 1;
+  args->quick = false;
+  args->counters = false;
+  args->out = NULL;
+  args->baseline = NULL;
+  args->threshold = 10.0;
+
+  for (int i = 1; i < argc; i++) {
+    const char *value = i + 1 < argc ? argv[i+1] : NULL;
+    if (strcmp(argv[i], "--quick") == 0) {
+      args->quick = true;
+      args->reps = 3;
+      continue;
+    }
+    if (strcmp(argv[i], "--counters") == 0) {
+      args->counters = true;
+      continue;
+    }
+    if (!value) {
+      return 1;
+    }
+    if (strcmp(argv[i], "--reps") == 0) {
+      args->reps = strtoul(value, NULL, 10);
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      args->threads = strtoul(value, NULL, 10);
+    } else if (strcmp(argv[i], "--out") == 0) {
+      args->out = value;
+    } else if (strcmp(argv[i], "--baseline") == 0) {
+      args->baseline = value;
+    } else if (strcmp(argv[i], "--threshold") == 0) {
+      args->threshold = strtod(value, NULL);
+    } else {
+      return 1;
+    }
+    i++;
+  }
+
+  return args->reps == 0 || args->threshold <= 0.0;
+}
+
+/**
+ * @brief Fill an image with gradients, blocks of flat colour and noise, so
+ *        the seams have both edges to avoid and flat runs to go through.
+ */
+static void make_image(rgb_image *img, size_t width, size_t height, uint32_t seed) {
+  uint32_t x = seed * 2654435761u + 1;
+  for (size_t i = 0; i < height; i++) {
+    for (size_t j = 0; j < width; j++) {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      unsigned base = (unsigned)((i * 255 / height + j * 255 / width) / 2);
+      unsigned block = ((i / 37 + j / 53) % 5 == 0) ? 80 : 0;
+      unsigned noise = x & 15;
+      rgb_pixel *px = &GET_PIXEL(img, i, j);
+      px->red = (pixval)((base + block + noise) & 255);
+      px->green = (pixval)((255 - base + noise) & 255);
+      px->blue = (pixval)((block * 2 + (x >> 8 & 31)) & 255);
+    }
+  }
+}
+
+static int run_case(const bench_case *bc, const bench_args *args, bench_result *res) {
+  car_options opts;
+  car_default_options(&opts);
+  opts.threads = args->threads;
+  opts.counters = args->counters;
+
+  rgb_image in, out;
+  INITIALIZE_IMAGE(&in, bc->width, bc->height);
+  INITIALIZE_IMAGE(&out, bc->out_width, bc->out_height);
+  double *walls = malloc(sizeof(double) * args->reps);
+  if (!in.data || !out.data || !walls) {
+    free(in.data);
+    free(out.data);
+    free(walls);
+    log_fatal("malloc failed");
+    return 1;
+  }
+  make_image(&in, bc->width, bc->height, (uint32_t)(bc->width * 31 + bc->out_width));
+
+  int status = 1;
+  car_context *ctx = NULL;
+
+  // cold: nothing of the image in the cache, and no buffers or threads yet
+  evict_cache();
+  double start = now();
+  ctx = car_context_create();
+  if (!ctx || car_carve(ctx, &in, &out, &opts) != 0) {
+    goto done;
+  }
+  res->cold_s = now() - start;
+
+  // warm: the same context again, after a carve to settle it
+  if (car_carve(ctx, &in, &out, &opts) != 0) {
+    goto done;
+  }
+  res->cycles = 0;
+  for (size_t k = 0; k < sizeof(res->stages) / sizeof(res->stages[0]); k++) {
+    res->stages[k] = UINT64_MAX;
+  }
+  for (size_t r = 0; r < args->reps; r++) {
+    start = now();
+    uint64_t c0 = GET_CYCLE_COUNT();
+    if (car_carve(ctx, &in, &out, &opts) != 0) {
+      goto done;
+    }
+    uint64_t c1 = GET_CYCLE_COUNT();
+    walls[r] = now() - start;
+
+    car_stats stats;
+    const car_stage_stats *stages[sizeof(res->stages) / sizeof(res->stages[0])];
+    car_context_stats(ctx, &stats);
+    if (r == 0 || (double)(c1 - c0) < res->cycles) {
+      res->cycles = (double)(c1 - c0);
+      res->stats = stats;
+    }
+    stage_stats(&stats, stages);
+    for (size_t k = 0; k < sizeof(stages) / sizeof(stages[0]); k++) {
+      if (stages[k]->cycles < res->stages[k]) {
+        res->stages[k] = stages[k]->cycles;
+      }
+    }
+  }
+
+  qsort(walls, args->reps, sizeof(double), compare_double);
+  res->warm_min_s = walls[0];
+  res->warm_median_s = args->reps % 2 ? walls[args->reps / 2]
+                     : (walls[args->reps/2 - 1] + walls[args->reps/2]) / 2;
+  status = 0;
+
+done:
+  if (status != 0) {
+    log_error("Could not carve %s", bc->name);
+  }
+  car_context_destroy(ctx);
+  free(in.data);
+  free(out.data);
+  free(walls);
+  return status;
+}
+
+// in the order of STAGES
+static void stage_stats(const car_stats *stats, const car_stage_stats **stages) {
+  stages[0] = &stats->grey;
+  stages[1] = &stats->transpose;
+  stages[2] = &stats->conv;
+  stages[3] = &stats->convp;
+  stages[4] = &stats->pathsum;
+  stages[5] = &stats->minpath;
+  stages[6] = &stats->rmpath;
+  stages[7] = &stats->insert;
+  stages[8] = &stats->malloc;
+}
+
+/**
+ * @brief Write over a buffer larger than the cache, so that whatever was
+ *        in it has to be read from memory again.
+ */
+static void evict_cache(void) {
+  static volatile uint8_t *buf;
+  static uint8_t pass;
+  if (!buf) {
+    buf = malloc(EVICT_BYTES);
+    if (!buf) {
+      return;
+    }
+  }
+  pass++;
+  for (size_t k = 0; k < EVICT_BYTES; k += 64) {
+    buf[k] = pass;
+  }
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void write_json(FILE *fp, const bench_args *args, const bench_result *results) {
+  const size_t ncases = sizeof(CASES) / sizeof(CASES[0]);
+  const size_t nstages = sizeof(STAGES) / sizeof(STAGES[0]);
+
+  fprintf(fp, "{\n  \"version\": 1,\n  \"tsc_hz\": %.0f,\n", tsc_hz());
+  fprintf(fp, "  \"threads\": %zu,\n  \"reps\": %zu,\n  \"cases\": [", args->threads,
+          args->reps);
+  bool first = true;
+  for (size_t k = 0; k < ncases; k++) {
+    if (args->quick && !CASES[k].quick) {
+      continue;
+    }
+    const bench_case *bc = &CASES[k];
+    const bench_result *res = &results[k];
+    const double pixels = (double)(bc->width * bc->height);
+
+    fprintf(fp, "%s\n    {\n      \"name\": \"%s\",\n", first ? "" : ",", bc->name);
+    fprintf(fp, "      \"width\": %zu, \"height\": %zu, \"out_width\": %zu, \"out_height\": %zu,\n",
+            bc->width, bc->height, bc->out_width, bc->out_height);
+    fprintf(fp, "      \"cold_s\": %.6f,\n      \"warm_min_s\": %.6f,\n"
+                "      \"warm_median_s\": %.6f,\n",
+            res->cold_s, res->warm_min_s, res->warm_median_s);
+    fprintf(fp, "      \"cycles_per_pixel\": {\n        \"total\": %.2f", res->cycles / pixels);
+    for (size_t s = 0; s < nstages; s++) {
+      fprintf(fp, ",\n        \"%s\": %.2f", STAGES[s], (double)res->stages[s] / pixels);
+    }
+    fprintf(fp, "\n      },\n");
+
+    // what the fastest warm carve's stages moved, and with counters, what
+    // they cost the cpu
+    const car_stats *st = &res->stats;
+    const car_stage_stats *stages[sizeof(STAGES) / sizeof(STAGES[0])];
+    stage_stats(st, stages);
+    fprintf(fp, "      \"stages\": {");
+    for (size_t s = 0; s < nstages; s++) {
+      const car_stage_stats *stage = stages[s];
+      double seconds = (double)stage->cycles / st->tsc_hz;
+      double bytes = (double)(stage->bytes_read + stage->bytes_written);
+      fprintf(fp, "%s\n        \"%s\": { \"calls\": %llu, \"bytes_read\": %llu,"
+                  " \"bytes_written\": %llu, \"gb_per_s\": %.2f",
+              s ? "," : "", STAGES[s], (unsigned long long)stage->calls,
+              (unsigned long long)stage->bytes_read, (unsigned long long)stage->bytes_written,
+              seconds > 0 ? bytes / seconds / 1e9 : 0.0);
+      if (st->counters) {
+        fprintf(fp, ", \"instructions\": %llu, \"llc_misses\": %llu,"
+                    " \"branch_misses\": %llu",
+                (unsigned long long)stage->instructions,
+                (unsigned long long)stage->llc_misses,
+                (unsigned long long)stage->branch_misses);
+      }
+      fprintf(fp, " }");
+    }
+    fprintf(fp, "\n      },\n");
+    fprintf(fp, "      \"counters\": %s,\n", st->counters ? "true" : "false");
+    fprintf(fp, "      \"seams_removed\": %zu, \"seams_inserted\": %zu, \"passes\": %zu,\n",
+            st->seams_removed, st->seams_inserted, st->passes);
+    fprintf(fp, "      \"partial_pathsums\": %zu, \"cone_mean_width\": %.2f,"
+                " \"cone_widest\": %zu\n    }",
+            st->partial_pathsums,
+            st->cone_rows ? (double)st->cone_values / (double)st->cone_rows : 0.0,
+            st->cone_widest);
+    first = false;
+  }
+  fprintf(fp, "\n  ]\n}\n");
+}
+
+static char *read_file(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    log_error("Could not open %s", path);
+    return NULL;
+  }
+  size_t size = 0, capacity = 4096;
+  char *text = malloc(capacity);
+  while (text) {
+    size += fread(&text[size], 1, capacity - size - 1, fp);
+    if (size + 1 < capacity) {
+      break;
+    }
+    capacity *= 2;
+    char *grown = realloc(text, capacity);
+    if (!grown) {
+      free(text);
+    }
+    text = grown;
+  }
+  fclose(fp);
+  if (!text) {
+    log_fatal("malloc failed");
+    return NULL;
+  }
+  text[size] = '\0';
+  return text;
+}
+
+/**
+ * @brief Compare the warm times with a baseline written by this bench.
+ *
+ * The JSON is only ever what write_json wrote, so each case's time is found
+ * by its name rather than by parsing the whole file. Cases the baseline
+ * doesn't have are skipped.
+ *
+ * @return 0 if no case got slower by more than the threshold
+ */
+static int compare_baseline(const char *text, const bench_args *args,
+                            const bench_result *results) {
+  const size_t ncases = sizeof(CASES) / sizeof(CASES[0]);
+  int status = 0;
+
+  for (size_t k = 0; k < ncases; k++) {
+    if (args->quick && !CASES[k].quick) {
+      continue;
+    }
+    char key[128];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", CASES[k].name);
+    const char *entry = strstr(text, key);
+    const char *time = entry ? strstr(entry, "\"warm_min_s\":") : NULL;
+    double before = time ? strtod(time + strlen("\"warm_min_s\":"), NULL) : 0.0;
+    if (before <= 0.0) {
+      fprintf(stderr, "%-18s not in the baseline\n", CASES[k].name);
+      continue;
+    }
+
+    double change = (results[k].warm_min_s / before - 1.0) * 100.0;
+    bool regressed = change > args->threshold;
+    fprintf(stderr, "%-18s %8.4fs -> %8.4fs  %+6.1f%%%s\n", CASES[k].name, before,
+            results[k].warm_min_s, change, regressed ? "  REGRESSED" : "");
+    if (regressed) {
+      status = 1;
+    }
+  }
+
+  return status;
+}
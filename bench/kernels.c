@@ -0,0 +1,1044 @@
+/**
+ * @file kernels.c
+ * @brief Checking the vector kernels against scalar references, and timing
+ *        each of them on its own
+ *
+ * Every check runs at each SIMD level the cpu has, on random inputs of
+ * random widths down to the narrowest the kernels take, with random row
+ * padding and buf_start offsets so that the rows start at every alignment.
+ * The references are plain loops over what each kernel is documented to
+ * compute, breaking ties the same way, so the results have to match
+ * exactly. Everything in the buffers outside the images has to be left
+ * alone, and the rows given to an energy span end right before a page that
+ * can't be read, so a span reading past its end faults.
+ *
+ * The partial recomputes are checked the same way, after every one of a
+ * run of random seams is removed, against the references of the image
+ * with the seams compacted out.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "car_internal.h"
+#include "energy.h"
+#include "gaps.h"
+#include "pathsum.h"
+#include "simd.h"
+#include "threadpool.h"
+#include "tsc.h"
+
+// what the buffers are filled with outside the images, more than any
+// energy and not a direction
+#define CANARY 0xee
+
+// longest span given to an energy kernel
+#define MAX_SPAN 4096
+
+// threads for the checks that split rows between them
+#define POOL_THREADS 4
+
+// most seams removed one after another by a partial recompute check
+#define MAX_PARTIAL_SEAMS 12
+
+// size of the images the kernels are timed on, short enough for 16 bit
+// path sums, and how many times each is run
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 512
+#define BENCH_REPS 10
+
+_Static_assert(BENCH_HEIGHT <= PATHSUM16_MAX_HEIGHT, "bench image too tall for 16 bits");
+
+/*
+ * A buffer for an image of elt byte values, in the same layout as every
+ * image type of the library.
+ */
+typedef struct {
+  void *data;
+  size_t elt;
+  size_t width;
+  size_t height;
+  size_t buf_width;
+  size_t buf_start;
+} plane;
+
+#define PLANE_AS(type, p) \
+  ((type){ (p)->data, (p)->width, (p)->height, (p)->buf_width, (p)->height, (p)->buf_start })
+
+// a buffer whose last byte is right before a page that can't be read
+typedef struct {
+  uint8_t *map;
+  size_t size;
+  size_t page;
+} guarded;
+
+typedef struct {
+  size_t rounds;
+  uint64_t seed;
+  bool bench;
+} kernel_args;
+
+typedef enum {
+  KERNEL_ENERGY,
+  KERNEL_PATHSUM,
+  KERNEL_FORWARD,
+  KERNEL_MINSEAM,
+} kernel_kind;
+
+typedef struct {
+  const char *name;
+  kernel_kind kind;
+  car_energy energy;
+  bool wide;
+  bool dirs;
+} kernel_bench;
+
+static const kernel_bench BENCHES[] = {
+  { "energy sobel",      KERNEL_ENERGY,  CAR_ENERGY_SOBEL,    false, false },
+  { "energy gradient",   KERNEL_ENERGY,  CAR_ENERGY_GRADIENT, false, false },
+  { "energy scharr",     KERNEL_ENERGY,  CAR_ENERGY_SCHARR,   false, false },
+  { "pathsum 16",        KERNEL_PATHSUM, CAR_ENERGY_SOBEL,    false, false },
+  { "pathsum 16 dirs",   KERNEL_PATHSUM, CAR_ENERGY_SOBEL,    false, true  },
+  { "pathsum 32",        KERNEL_PATHSUM, CAR_ENERGY_SOBEL,    true,  false },
+  { "pathsum 32 dirs",   KERNEL_PATHSUM, CAR_ENERGY_SOBEL,    true,  true  },
+  { "forward 16",        KERNEL_FORWARD, CAR_ENERGY_SOBEL,    false, true  },
+  { "forward 32",        KERNEL_FORWARD, CAR_ENERGY_SOBEL,    true,  true  },
+  { "minseam 16",        KERNEL_MINSEAM, CAR_ENERGY_SOBEL,    false, false },
+  { "minseam 16 dirs",   KERNEL_MINSEAM, CAR_ENERGY_SOBEL,    false, true  },
+  { "minseam 32",        KERNEL_MINSEAM, CAR_ENERGY_SOBEL,    true,  false },
+  { "minseam 32 dirs",   KERNEL_MINSEAM, CAR_ENERGY_SOBEL,    true,  true  },
+};
+
+static const car_energy ENERGIES[] = {
+  CAR_ENERGY_SOBEL, CAR_ENERGY_GRADIENT, CAR_ENERGY_SCHARR,
+};
+
+static uint64_t rng;
+
+// for the scratch space of the kernels that take an arena
+static arena scratch;
+
+// the check or bench in progress, for when a kernel faults
+static char running[64] = "setup";
+
+static int parse_args(int argc, const char *argv[], kernel_args *args);
+static void on_fault(int sig);
+static size_t check_spans(const energy_func *fn, const kernel_args *args, guarded *rows);
+static size_t check_energymap(const energy_func *fn, const kernel_args *args, threadpool *pool);
+static size_t check_pathsum(bool forward, bool wide, bool dirs, const kernel_args *args,
+                            threadpool *pool);
+static size_t check_partial(const energy_func *fn, bool wide, const kernel_args *args,
+                            threadpool *pool);
+static bool partial_matches(const energy_func *fn, const gray_image *gray,
+                            const gray_image *bias, const energymap *energies,
+                            const pathsum_map *ps, const seam_gaps *gaps, size_t seam);
+static void reference_energymap(const energy_func *fn, const gray_image *in,
+                                const gray_image *bias, enval *out);
+static void reference_pathsum(const energymap *in, const gray_image *gray, uint32_t *sums,
+                              uint8_t *dirs);
+static void reference_minseam(const uint32_t *sums, const uint8_t *dirs, size_t width,
+                              size_t height, size_t *seam);
+static uint32_t pathsum_at(const pathsum_map *ps, size_t i, size_t j);
+static enval bias_energy(enval energy, pixval bias);
+static void run_benches(void);
+static double bench_one(const kernel_bench *kb, const plane *gray, const plane *energies,
+                        pathsum_map *ps, size_t *seam);
+static int plane_alloc(plane *p, size_t width, size_t height, size_t elt, bool pad);
+static void plane_fill(plane *p, bool flat, uint32_t most);
+static bool plane_intact(const plane *p, size_t skip_rows);
+static void plane_compact(plane *p, const seam_gaps *gaps);
+static int guarded_init(guarded *g, size_t size);
+static uint8_t *guarded_tail(const guarded *g, size_t n);
+static void guarded_free(guarded *g);
+static uint64_t next_random(void);
+static size_t random_below(size_t n);
+static size_t random_width(size_t least);
+static void random_seam(size_t width, size_t height, size_t *seam);
+
+int main(int argc, const char *argv[]) {
+  kernel_args args;
+  if (parse_args(argc, argv, &args) != 0) {
+    fprintf(stderr, "usage: %s [--rounds N] [--seed N] [--no-bench]\n", argv[0]);
+    return 1;
+  }
+
+  // what passed is printed before whatever faults
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  signal(SIGSEGV, on_fault);
+  signal(SIGBUS, on_fault);
+
+  arena_init(&scratch);
+  threadpool *pool = threadpool_create(POOL_THREADS);
+  guarded rows[4];
+  size_t nrows = 0;
+  for (; nrows < 4 && guarded_init(&rows[nrows], MAX_SPAN + 2) == 0; nrows++);
+  if (!pool || nrows < 4) {
+    fprintf(stderr, "Could not set up the checks\n");
+    threadpool_destroy(pool);
+    while (nrows > 0) guarded_free(&rows[--nrows]);
+    return 1;
+  }
+
+  const simd_level widest = simd_get_level();
+  size_t failures = 0;
+
+  for (int level = SIMD_SSE; level <= (int)widest; level++) {
+    simd_set_level((simd_level)level);
+    printf("%s\n", simd_level_name((simd_level)level));
+    rng = args.seed;
+
+    size_t failed = 0;
+    for (size_t k = 0; k < sizeof(ENERGIES) / sizeof(ENERGIES[0]); k++) {
+      const energy_func *fn = energy_func_get(ENERGIES[k]);
+      failed += check_spans(fn, &args, rows);
+      failed += check_energymap(fn, &args, pool);
+    }
+    for (int forward = 0; forward < 2; forward++) {
+      for (int wide = 0; wide < 2; wide++) {
+        for (int dirs = forward; dirs < 2; dirs++) {
+          failed += check_pathsum(forward, wide, dirs, &args, pool);
+        }
+      }
+    }
+    for (size_t k = 0; k <= sizeof(ENERGIES) / sizeof(ENERGIES[0]); k++) {
+      // and forward energy after the energy functions
+      const energy_func *fn = k < sizeof(ENERGIES) / sizeof(ENERGIES[0])
+                              ? energy_func_get(ENERGIES[k]) : NULL;
+      for (int wide = 0; wide < 2; wide++) {
+        failed += check_partial(fn, wide, &args, pool);
+      }
+    }
+    printf("  %s\n", failed ? "MISMATCHED" : "all kernels match the references");
+    failures += failed;
+
+    if (args.bench) {
+      run_benches();
+    }
+  }
+  simd_set_level(widest);
+
+  threadpool_destroy(pool);
+  arena_free(&scratch);
+  for (size_t k = 0; k < 4; k++) {
+    guarded_free(&rows[k]);
+  }
+  return failures ? 1 : 0;
+}
+
+static int parse_args(int argc, const char *argv[], kernel_args *args) {
+  args->rounds = 200;
+  args->seed = 0x9e3779b97f4a7c15u;
+  args->bench = true;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--no-bench") == 0) {
+      args->bench = false;
+    } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+      args->rounds = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      args->seed = strtoull(argv[++i], NULL, 0);
+    } else {
+      return 1;
+    }
+  }
+
+  // xorshift never leaves zero
+  return args->rounds == 0 || args->seed == 0;
+}
+
+static void on_fault(int sig) {
+  (void)sig;
+  char msg[sizeof(running) + 16] = "  fault in ";
+  size_t len = strlen(msg);
+  for (const char *c = running; *c; c++) {
+    msg[len++] = *c;
+  }
+  msg[len++] = '\n';
+  ssize_t written = write(STDOUT_FILENO, msg, len);
+  (void)written;
+  _exit(2);
+}
+
+/**
+ * @brief Check an energy function's span against its pixel function.
+ *
+ * The span only has to do the first few pixels it returns, but mustn't
+ * write past n or read past column n+1 of its rows.
+ *
+ * @param rows four guarded buffers, for the three rows and the biases
+ * @return the number of spans that didn't match
+ */
+static size_t check_spans(const energy_func *fn, const kernel_args *args, guarded *rows) {
+  enval res[MAX_SPAN + 64];
+  snprintf(running, sizeof(running), "%s span", fn->name);
+
+  for (size_t round = 0; round < args->rounds; round++) {
+    size_t n = round % 4 == 0 ? random_below(24) : random_below(MAX_SPAN / 8);
+    bool flat = random_below(4) == 0;
+    pixval *upper = guarded_tail(&rows[0], n + 2);
+    pixval *mid = guarded_tail(&rows[1], n + 2);
+    pixval *lower = guarded_tail(&rows[2], n + 2);
+    pixval *bias = random_below(2) ? guarded_tail(&rows[3], n) : NULL;
+    for (size_t k = 0; k < n + 2; k++) {
+      upper[k] = (pixval)(flat ? next_random() & 1 : next_random());
+      mid[k] = (pixval)(flat ? next_random() & 1 : next_random());
+      lower[k] = (pixval)(flat ? next_random() & 1 : next_random());
+    }
+    for (size_t k = 0; bias && k < n; k++) {
+      bias[k] = (pixval)next_random();
+    }
+    memset(res, CANARY, sizeof(res));
+
+    size_t done = fn->span(upper, mid, lower, bias, res, n);
+
+    if (done > n) {
+      printf("  %s span: did %zu of %zu pixels\n", fn->name, done, n);
+      return 1;
+    }
+    for (size_t k = 0; k < done; k++) {
+      enval want = fn->pixel(&upper[k], &mid[k], &lower[k]);
+      if (bias) {
+        want = bias_energy(want, bias[k]);
+      }
+      if (res[k] != want) {
+        printf("  %s span: n %zu%s, pixel %zu is %u, not %u\n", fn->name, n,
+               bias ? " with bias" : "", k, res[k], want);
+        return 1;
+      }
+    }
+    for (size_t k = n; k < sizeof(res); k++) {
+      if (res[k] != CANARY) {
+        printf("  %s span: n %zu, wrote past the end at %zu\n", fn->name, n, k);
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Check compute_energymap, whose rows are a span in the middle and
+ *        conv_pixel at the edges, against fn->pixel at every pixel.
+ */
+static size_t check_energymap(const energy_func *fn, const kernel_args *args,
+                              threadpool *pool) {
+  snprintf(running, sizeof(running), "%s energy map", fn->name);
+  for (size_t round = 0; round < args->rounds; round++) {
+    const size_t ww = random_width(4);
+    const size_t hh = 4 + random_below(round % 8 == 0 ? 200 : 24);
+    const bool with_bias = random_below(2);
+
+    plane pin, pout, pbias = { 0 };
+    enval *want = malloc(ww * hh);
+    if (plane_alloc(&pin, ww, hh, 1, true) != 0 || plane_alloc(&pout, ww, hh, 1, true) != 0
+        || (with_bias && plane_alloc(&pbias, ww, hh, 1, true) != 0) || !want) {
+      fprintf(stderr, "malloc failed\n");
+      exit(1);
+    }
+    plane_fill(&pin, random_below(4) == 0, 255);
+    plane_fill(&pbias, false, 255);
+
+    gray_image in = PLANE_AS(gray_image, &pin);
+    gray_image bias = PLANE_AS(gray_image, &pbias);
+    energymap out = PLANE_AS(energymap, &pout);
+    compute_energymap(&in, &out, fn, with_bias ? &bias : NULL,
+                      random_below(2) ? pool : NULL, &scratch);
+    reference_energymap(fn, &in, with_bias ? &bias : NULL, want);
+
+    size_t bad = SIZE_MAX;
+    for (size_t i = 0; i < hh && bad == SIZE_MAX; i++) {
+      for (size_t j = 0; j < ww; j++) {
+        if (GET_PIXEL(&out, i, j) != want[i*ww + j]) {
+          printf("  %s energy map: %zux%zu%s, pixel (%zu, %zu) is %u, not %u\n", fn->name,
+                 ww, hh, with_bias ? " with bias" : "", i, j, GET_PIXEL(&out, i, j),
+                 want[i*ww + j]);
+          bad = i;
+          break;
+        }
+      }
+    }
+    bool intact = plane_intact(&pout, 0);
+    if (!intact) {
+      printf("  %s energy map: %zux%zu, wrote outside the image\n", fn->name, ww, hh);
+    }
+
+    free(pin.data);
+    free(pout.data);
+    free(pbias.data);
+    free(want);
+    if (bad != SIZE_MAX || !intact) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Check compute_pathsum or compute_pathsum_forward, and find_minseam
+ *        on the path sums, against the reference.
+ */
+static size_t check_pathsum(bool forward, bool wide, bool dirs, const kernel_args *args,
+                            threadpool *pool) {
+  snprintf(running, sizeof(running), "%s %d%s", forward ? "forward" : "pathsum",
+           wide ? 32 : 16, dirs ? " dirs" : "");
+  const char *name = running;
+
+  for (size_t round = 0; round < args->rounds; round++) {
+    // some wide enough to be split into tiles between the threads
+    const size_t ww = round % 16 == 0 ? 512 + random_below(1500) : random_width(2);
+    const size_t hh = 1 + random_below(round % 8 == 0 ? PATHSUM16_MAX_HEIGHT : 40);
+    const bool flat = random_below(3) == 0;
+
+    plane pin, psums, pdirs = { 0 };
+    uint32_t *want = malloc(sizeof(uint32_t) * ww * hh);
+    uint8_t *want_dirs = malloc(ww * hh);
+    size_t *seam = malloc(sizeof(size_t) * hh * 2);
+    if (plane_alloc(&pin, ww, hh, 1, true) != 0
+        || plane_alloc(&psums, ww, hh, wide ? sizeof(uint32_t) : sizeof(uint16_t), true) != 0
+        || (dirs && plane_alloc(&pdirs, ww, hh, 1, true) != 0)
+        || !want || !want_dirs || !seam) {
+      fprintf(stderr, "malloc failed\n");
+      exit(1);
+    }
+    // ties are what tell the directions apart, so flat inputs have lots
+    plane_fill(&pin, flat, forward ? 255 : MAX_ENERGY);
+
+    gray_image gray = PLANE_AS(gray_image, &pin);
+    energymap energies = PLANE_AS(energymap, &pin);
+    pathsum_map ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.narrow = PLANE_AS(pathsum16, &psums);
+    ps.wide = PLANE_AS(pathsum32, &psums);
+    ps.dirs = PLANE_AS(pathsum_dirs, &pdirs);
+    if (wide) {
+      ps.narrow.data = NULL;
+    } else {
+      ps.wide.data = NULL;
+    }
+    if (!dirs) {
+      // keeps the geometry the other two have
+      ps.dirs = (pathsum_dirs) {
+        NULL, ww, hh, psums.buf_width, hh, psums.buf_start,
+      };
+    }
+
+    threadpool *p = random_below(2) ? pool : NULL;
+    if (forward) {
+      compute_pathsum_forward(&gray, &ps, p);
+    } else {
+      compute_pathsum(&energies, &ps, p);
+    }
+    reference_pathsum(forward ? NULL : &energies, forward ? &gray : NULL, want, want_dirs);
+
+    bool ok = true;
+    for (size_t i = 0; i < hh && ok; i++) {
+      for (size_t j = 0; j < ww && ok; j++) {
+        uint32_t got = pathsum_at(&ps, i, j);
+        if (got != want[i*ww + j]) {
+          printf("  %s: %zux%zu, path sum (%zu, %zu) is %u, not %u\n", name, ww, hh, i, j,
+                 got, want[i*ww + j]);
+          ok = false;
+        } else if (dirs && i > 0 && GET_PIXEL(&ps.dirs, i, j) != want_dirs[i*ww + j]) {
+          printf("  %s: %zux%zu, direction (%zu, %zu) is %u, not %u\n", name, ww, hh, i, j,
+                 GET_PIXEL(&ps.dirs, i, j), want_dirs[i*ww + j]);
+          ok = false;
+        }
+      }
+    }
+    // the first row has no directions, so whatever was there is left
+    if (ok && (!plane_intact(&psums, 0) || (dirs && !plane_intact(&pdirs, 1)))) {
+      printf("  %s: %zux%zu, wrote outside the path sums\n", name, ww, hh);
+      ok = false;
+    }
+
+    if (ok) {
+      find_minseam(&ps, seam, NULL);
+      reference_minseam(want, want_dirs, ww, hh, &seam[hh]);
+      for (size_t i = 0; i < hh; i++) {
+        if (seam[i] != seam[hh + i]) {
+          printf("  %s: %zux%zu, seam is at %zu in row %zu, not %zu\n", name, ww, hh,
+                 seam[i], i, seam[hh + i]);
+          ok = false;
+          break;
+        }
+      }
+    }
+
+    free(pin.data);
+    free(psums.data);
+    free(pdirs.data);
+    free(want);
+    free(want_dirs);
+    free(seam);
+    if (!ok) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Check compute_energymap_partial and compute_pathsum_partial, or
+ *        compute_pathsum_forward_partial with fn NULL, after each of a run
+ *        of random seams is removed.
+ *
+ * Some rounds leave the seams in the buffers as gaps, and only compact them
+ * out once a few have built up, as a carve with a compact interval does.
+ */
+static size_t check_partial(const energy_func *fn, bool wide, const kernel_args *args,
+                            threadpool *pool) {
+  snprintf(running, sizeof(running), "partial %s %d", fn ? fn->name : "forward",
+           wide ? 32 : 16);
+
+  for (size_t round = 0; round < args->rounds; round++) {
+    // some big enough for the recompute to spread out to the threads
+    const bool big = round % 32 == 0;
+    const size_t ww = big ? 512 + random_below(1000) : random_width(CAR_MIN_SIZE + 1);
+    const size_t hh = CAR_MIN_SIZE + random_below(big ? 400 : round % 8 == 0 ? 100 : 24);
+    const size_t most = ww - CAR_MIN_SIZE < MAX_PARTIAL_SEAMS ? ww - CAR_MIN_SIZE
+                                                               : MAX_PARTIAL_SEAMS;
+    const size_t nseams = 1 + random_below(most);
+    const size_t capacity = random_below(2) ? 2 + random_below(6) : 1;
+    const bool with_bias = fn && random_below(2);
+    const bool dirs = !fn || random_below(2);
+    threadpool *p = random_below(2) ? pool : NULL;
+    // the cheapest seams are the ones a carve takes, and the recompute
+    // spreads out furthest below them
+    const bool cheapest = big || random_below(2);
+
+    plane pgray, pbias = { 0 }, pen = { 0 }, psums, pdirs = { 0 };
+    size_t *removed = malloc(sizeof(size_t) * hh * 2);
+    size_t *mem = &removed[hh];
+    void *saved = malloc(sizeof(uint32_t) * ww);
+    arena_mark mark;
+    arena_get_mark(&scratch, &mark);
+    seam_gaps gaps;
+    if (plane_alloc(&pgray, ww, hh, 1, true) != 0
+        || (with_bias && plane_alloc(&pbias, ww, hh, 1, true) != 0)
+        || (fn && plane_alloc(&pen, ww, hh, 1, true) != 0)
+        || plane_alloc(&psums, ww, hh, wide ? sizeof(uint32_t) : sizeof(uint16_t), true) != 0
+        || (dirs && plane_alloc(&pdirs, ww, hh, 1, true) != 0)
+        || !removed || !saved || gaps_init(&gaps, hh, capacity, &scratch) != 0) {
+      fprintf(stderr, "malloc failed\n");
+      exit(1);
+    }
+    plane_fill(&pgray, random_below(4) == 0, 255);
+    plane_fill(&pbias, false, 255);
+    if (big) {
+      // ramps, with the same energy everywhere, but for a strip down the
+      // image without any inside it. The cheapest path sums all follow the
+      // strip, so taking it out changes them in a cone that widens by a
+      // column a row, until the threads split it
+      const size_t strip = random_below(ww - 2);
+      uint8_t *bytes = pgray.data;
+      for (size_t i = 0; i < hh; i++) {
+        uint8_t *row = &bytes[i * pgray.buf_width + pgray.buf_start];
+        for (size_t j = 0; j < ww; j++) {
+          row[j] = (uint8_t)(85 * (j % 4));
+        }
+        memset(&row[strip], 128, 3);
+      }
+    }
+
+    pathsum_map ps;
+    bool ok = true;
+    for (size_t k = 0; k <= nseams && ok; k++) {
+      if (k > 0) {
+        // take the seam out of every buffer, as a gap until they fill up
+        if (cheapest) {
+          find_minseam(&ps, removed, &gaps);
+        } else {
+          random_seam(pgray.width, hh, removed);
+        }
+        for (size_t i = 0; i < hh; i++) {
+          mem[i] = gaps_col(&gaps, i, removed[i]);
+        }
+        gaps_insert(&gaps, mem);
+        plane *planes[] = { &pgray, &pbias, &pen, &psums, &pdirs };
+        for (size_t m = 0; m < sizeof(planes) / sizeof(planes[0]); m++) {
+          planes[m]->width--;
+          if (gaps.count == gaps.capacity && planes[m]->data) {
+            plane_compact(planes[m], &gaps);
+          }
+        }
+        if (gaps.count == gaps.capacity) {
+          gaps.count = 0;
+        }
+      }
+
+      gray_image gray = PLANE_AS(gray_image, &pgray);
+      gray_image bias = PLANE_AS(gray_image, &pbias);
+      energymap energies = PLANE_AS(energymap, &pen);
+      memset(&ps, 0, sizeof(ps));
+      ps.narrow = PLANE_AS(pathsum16, &psums);
+      ps.wide = PLANE_AS(pathsum32, &psums);
+      ps.dirs = PLANE_AS(pathsum_dirs, &pdirs);
+      ps.saved = saved;
+      if (wide) {
+        ps.narrow.data = NULL;
+      } else {
+        ps.wide.data = NULL;
+      }
+      if (!dirs) {
+        ps.dirs = (pathsum_dirs) {
+          NULL, gray.width, hh, psums.buf_width, hh, psums.buf_start,
+        };
+      }
+
+      pathsum_cone cone;
+      if (k == 0 && fn) {
+        compute_energymap(&gray, &energies, fn, with_bias ? &bias : NULL, p, &scratch);
+        compute_pathsum(&energies, &ps, p);
+      } else if (k == 0) {
+        compute_pathsum_forward(&gray, &ps, p);
+      } else if (fn) {
+        compute_energymap_partial(&gray, &energies, fn, with_bias ? &bias : NULL, removed,
+                                  &gaps);
+        compute_pathsum_partial(&energies, &ps, removed, &gaps, p, &cone);
+      } else {
+        compute_pathsum_forward_partial(&gray, &ps, removed, &gaps, p, &cone);
+      }
+
+      ok = partial_matches(fn, &gray, with_bias ? &bias : NULL, &energies, &ps, &gaps, k);
+    }
+
+    arena_release(&scratch, mark);
+    free(pgray.data);
+    free(pbias.data);
+    free(pen.data);
+    free(psums.data);
+    free(pdirs.data);
+    free(removed);
+    free(saved);
+    if (!ok) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Whether the energies, path sums and directions, read through the
+ *        gaps, are the references of the image with the gaps taken out.
+ * @param seam how many seams have been removed, for the messages
+ */
+static bool partial_matches(const energy_func *fn, const gray_image *gray,
+                            const gray_image *bias, const energymap *energies,
+                            const pathsum_map *ps, const seam_gaps *gaps, size_t seam) {
+  const size_t ww = gray->width;
+  const size_t hh = gray->height;
+
+  pixval *dense = malloc(ww * hh * 2);
+  enval *want_en = malloc(ww * hh);
+  uint32_t *want = malloc(sizeof(uint32_t) * ww * hh);
+  uint8_t *want_dirs = malloc(ww * hh);
+  size_t *cols = malloc(sizeof(size_t) * ww * hh);
+  if (!dense || !want_en || !want || !want_dirs || !cols) {
+    fprintf(stderr, "malloc failed\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < hh; i++) {
+    gaps_span(gaps, i, 0, ww, &cols[i*ww]);
+    for (size_t j = 0; j < ww; j++) {
+      dense[i*ww + j] = GET_PIXEL(gray, i, cols[i*ww + j]);
+      dense[(hh+i)*ww + j] = bias ? GET_PIXEL(bias, i, cols[i*ww + j]) : 0;
+    }
+  }
+  const gray_image dense_gray = { dense, ww, hh, ww, hh, 0 };
+  const gray_image dense_bias = { &dense[hh*ww], ww, hh, ww, hh, 0 };
+  const energymap dense_en = { want_en, ww, hh, ww, hh, 0 };
+  if (fn) {
+    reference_energymap(fn, &dense_gray, bias ? &dense_bias : NULL, want_en);
+  }
+  reference_pathsum(fn ? &dense_en : NULL, fn ? NULL : &dense_gray, want, want_dirs);
+
+  bool ok = true;
+  for (size_t i = 0; i < hh && ok; i++) {
+    for (size_t j = 0; j < ww && ok; j++) {
+      const size_t col = cols[i*ww + j];
+      uint32_t got = pathsum_at(ps, i, col);
+      if (fn && GET_PIXEL(energies, i, col) != want_en[i*ww + j]) {
+        printf("  %s: %zux%zu, after seam %zu, energy (%zu, %zu) is %u, not %u\n", running,
+               ww, hh, seam, i, j, GET_PIXEL(energies, i, col), want_en[i*ww + j]);
+        ok = false;
+      } else if (got != want[i*ww + j]) {
+        printf("  %s: %zux%zu, after seam %zu, path sum (%zu, %zu) is %u, not %u\n",
+               running, ww, hh, seam, i, j, got, want[i*ww + j]);
+        ok = false;
+      } else if (ps->dirs.data && i > 0 && GET_PIXEL(&ps->dirs, i, col) != want_dirs[i*ww + j]) {
+        printf("  %s: %zux%zu, after seam %zu, direction (%zu, %zu) is %u, not %u\n",
+               running, ww, hh, seam, i, j, GET_PIXEL(&ps->dirs, i, col),
+               want_dirs[i*ww + j]);
+        ok = false;
+      }
+    }
+  }
+
+  free(dense);
+  free(want_en);
+  free(want);
+  free(want_dirs);
+  free(cols);
+  return ok;
+}
+
+/**
+ * @brief The energy map as conv_pixel does it, pixel by pixel, with the
+ *        same windows at the edges.
+ */
+static void reference_energymap(const energy_func *fn, const gray_image *in,
+                                const gray_image *bias, enval *out) {
+  const size_t ww = in->width;
+  const size_t hh = in->height;
+
+  for (size_t i = 0; i < hh; i++) {
+    size_t i0 = i < 1 ? 0 : i > hh-2 ? hh-4 : i-1;
+    for (size_t j = 0; j < ww; j++) {
+      size_t j0 = j < 1 ? 0 : j > ww-2 ? ww-4 : j-1;
+      enval energy = fn->pixel(&GET_PIXEL(in, i0, j0), &GET_PIXEL(in, i0+1, j0),
+                               &GET_PIXEL(in, i0+2, j0));
+      out[i*ww + j] = bias ? bias_energy(energy, GET_PIXEL(bias, i, j)) : energy;
+    }
+  }
+}
+
+/**
+ * @brief Least path sums and their directions, of in, or of the forward
+ *        energies of gray with in NULL.
+ *
+ * Ties go straight up first, then to the left, as they do in the kernels.
+ */
+static void reference_pathsum(const energymap *in, const gray_image *gray, uint32_t *sums,
+                              uint8_t *dirs) {
+  const size_t ww = in ? in->width : gray->width;
+  const size_t hh = in ? in->height : gray->height;
+
+  for (size_t i = 0; i < hh; i++) {
+    for (size_t j = 0; j < ww; j++) {
+      uint32_t cl = 0, cu = 0, cr = 0;
+      if (gray) {
+        int l = GET_PIXEL(gray, i, j > 0 ? j-1 : j);
+        int r = GET_PIXEL(gray, i, j < ww-1 ? j+1 : j);
+        int u = i > 0 ? GET_PIXEL(gray, i-1, j) : 0;
+        uint32_t sides = (uint32_t)abs(r - l);
+        cl = (sides + (uint32_t)abs(u - l)) >> 2;
+        cu = sides >> 2;
+        cr = (sides + (uint32_t)abs(u - r)) >> 2;
+      } else {
+        cl = cu = cr = GET_PIXEL(in, i, j);
+      }
+
+      if (i == 0) {
+        sums[j] = cu;
+        dirs[j] = 1;
+        continue;
+      }
+
+      const uint32_t *above = &sums[(i-1)*ww];
+      uint32_t vl = j > 0 ? above[j-1] + cl : UINT32_MAX;
+      uint32_t vc = above[j] + cu;
+      uint32_t vr = j < ww-1 ? above[j+1] + cr : UINT32_MAX;
+      uint8_t dir = vc <= vl && vc <= vr ? 1 : vl <= vr ? 0 : 2;
+      sums[i*ww + j] = dir == 1 ? vc : dir == 0 ? vl : vr;
+      dirs[i*ww + j] = dir;
+    }
+  }
+}
+
+/**
+ * @brief The seam ending at the first of the least path sums of the last
+ *        row, followed up its directions.
+ */
+static void reference_minseam(const uint32_t *sums, const uint8_t *dirs, size_t width,
+                              size_t height, size_t *seam) {
+  const uint32_t *last = &sums[(height-1)*width];
+  size_t col = 0;
+  for (size_t j = 1; j < width; j++) {
+    if (last[j] < last[col]) {
+      col = j;
+    }
+  }
+
+  seam[height-1] = col;
+  for (size_t i = height-1; i > 0; i--) {
+    seam[i-1] = seam[i] + dirs[i*width + seam[i]] - 1;
+  }
+}
+
+static uint32_t pathsum_at(const pathsum_map *ps, size_t i, size_t j) {
+  return ps->narrow.data ? GET_PIXEL(&ps->narrow, i, j) : GET_PIXEL(&ps->wide, i, j);
+}
+
+static enval bias_energy(enval energy, pixval bias) {
+  int biased = (int)energy + (int)bias - BIAS_ZERO;
+  if (biased < 0) biased = 0;
+  if (biased > MAX_ENERGY) biased = MAX_ENERGY;
+  return (enval)biased;
+}
+
+/**
+ * @brief Time every kernel at the current SIMD level on one thread, and
+ *        print the bytes of its inputs and outputs it gets through a cycle.
+ */
+static void run_benches(void) {
+  plane gray, energies, sums, dirs;
+  size_t *seam = malloc(sizeof(size_t) * BENCH_HEIGHT);
+  if (plane_alloc(&gray, BENCH_WIDTH, BENCH_HEIGHT, 1, false) != 0
+      || plane_alloc(&energies, BENCH_WIDTH, BENCH_HEIGHT, 1, false) != 0
+      || plane_alloc(&sums, BENCH_WIDTH, BENCH_HEIGHT, sizeof(uint32_t), false) != 0
+      || plane_alloc(&dirs, BENCH_WIDTH, BENCH_HEIGHT, 1, false) != 0 || !seam) {
+    fprintf(stderr, "malloc failed\n");
+    exit(1);
+  }
+  plane_fill(&gray, false, 255);
+  plane_fill(&energies, false, MAX_ENERGY);
+
+  pathsum_map ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.narrow = PLANE_AS(pathsum16, &sums);
+  ps.wide = PLANE_AS(pathsum32, &sums);
+  ps.dirs = PLANE_AS(pathsum_dirs, &dirs);
+  uint8_t *dirs_data = ps.dirs.data;
+
+  printf("  %-18s %12s %12s   (cycles of the counter, at %.2f GHz)\n", "", "bytes/cycle",
+         "cycles/px", tsc_hz() / 1e9);
+  for (size_t k = 0; k < sizeof(BENCHES) / sizeof(BENCHES[0]); k++) {
+    const kernel_bench *kb = &BENCHES[k];
+    snprintf(running, sizeof(running), "bench of %s", kb->name);
+    ps.narrow.data = kb->wide ? NULL : sums.data;
+    ps.wide.data = kb->wide ? sums.data : NULL;
+    ps.dirs.data = kb->dirs ? dirs_data : NULL;
+
+    // a path sum to find seams in
+    if (kb->kind == KERNEL_MINSEAM) {
+      energymap in = PLANE_AS(energymap, &energies);
+      compute_pathsum(&in, &ps, NULL);
+    }
+
+    double cycles = bench_one(kb, &gray, &energies, &ps, seam);
+
+    const double pixels = (double)BENCH_WIDTH * BENCH_HEIGHT;
+    const double sum_bytes = kb->wide ? sizeof(uint32_t) : sizeof(uint16_t);
+    double bytes = 0;
+    switch (kb->kind) {
+      case KERNEL_ENERGY:
+        bytes = 2 * pixels;
+        break;
+      case KERNEL_PATHSUM:
+      case KERNEL_FORWARD:
+        bytes = pixels * (1 + sum_bytes + (kb->dirs ? 1 : 0));
+        break;
+      case KERNEL_MINSEAM:
+        // the last row, then a direction or three path sums a row
+        bytes = BENCH_WIDTH * sum_bytes + (BENCH_HEIGHT-1) * (kb->dirs ? 1 : 3*sum_bytes);
+        break;
+      default:
+        break;
+    }
+    printf("  %-18s %12.2f %12.3f\n", kb->name, bytes / cycles, cycles / pixels);
+  }
+
+  free(gray.data);
+  free(energies.data);
+  free(sums.data);
+  free(dirs.data);
+  free(seam);
+}
+
+/**
+ * @brief The fewest counter cycles a kernel took in BENCH_REPS runs.
+ */
+static double bench_one(const kernel_bench *kb, const plane *gray, const plane *energies,
+                        pathsum_map *ps, size_t *seam) {
+  gray_image g = PLANE_AS(gray_image, gray);
+  energymap e = PLANE_AS(energymap, energies);
+  energymap out = PLANE_AS(energymap, energies);
+  const energy_func *fn = energy_func_get(kb->energy);
+
+  uint64_t best = UINT64_MAX;
+  for (size_t r = 0; r < BENCH_REPS; r++) {
+    uint64_t start = GET_CYCLE_COUNT();
+    switch (kb->kind) {
+      case KERNEL_ENERGY:  compute_energymap(&g, &out, fn, NULL, NULL, &scratch); break;
+      case KERNEL_PATHSUM: compute_pathsum(&e, ps, NULL);                         break;
+      case KERNEL_FORWARD: compute_pathsum_forward(&g, ps, NULL);                 break;
+      case KERNEL_MINSEAM: find_minseam(ps, seam, NULL);                          break;
+      default:                                                                    break;
+    }
+    uint64_t end = GET_CYCLE_COUNT();
+    if (end - start < best) {
+      best = end - start;
+    }
+  }
+
+  return (double)best;
+}
+
+/**
+ * @brief Allocate an image buffer full of CANARY.
+ * @param pad whether to pick a random row padding and buf_start, or have
+ *            neither
+ * @return 0, or 1 if there isn't the memory
+ */
+static int plane_alloc(plane *p, size_t width, size_t height, size_t elt, bool pad) {
+  p->elt = elt;
+  p->width = width;
+  p->height = height;
+  p->buf_width = width + (pad && random_below(4) ? random_below(70) : 0);
+  p->buf_start = pad ? random_below(p->buf_width) : 0;
+
+  size_t bytes = elt * (p->buf_start + p->buf_width * height);
+  p->data = malloc(bytes);
+  if (!p->data) {
+    return 1;
+  }
+  memset(p->data, CANARY, bytes);
+  return 0;
+}
+
+/**
+ * @brief Fill an image with random values up to most, or with only 0 and 1
+ *        if it's to be flat. A plane that was never allocated is left alone.
+ */
+static void plane_fill(plane *p, bool flat, uint32_t most) {
+  uint8_t *bytes = p->data;
+  for (size_t i = 0; bytes && i < p->height; i++) {
+    for (size_t j = 0; j < p->width; j++) {
+      uint32_t value = (uint32_t)(flat ? next_random() & 1 : next_random() % (most + 1));
+      size_t at = p->elt * (i * p->buf_width + j + p->buf_start);
+      for (size_t b = 0; b < p->elt; b++) {
+        bytes[at + b] = (uint8_t)(value >> (8*b));
+      }
+    }
+  }
+}
+
+/**
+ * @brief Whether everything in a plane's buffer outside the image, and in
+ *        its first skip_rows rows, is still CANARY.
+ */
+static bool plane_intact(const plane *p, size_t skip_rows) {
+  const uint8_t *bytes = p->data;
+  const size_t values = p->buf_start + p->buf_width * p->height;
+
+  for (size_t v = 0; v < values; v++) {
+    size_t row = v >= p->buf_start ? (v - p->buf_start) / p->buf_width : 0;
+    size_t col = v >= p->buf_start ? (v - p->buf_start) % p->buf_width : p->width;
+    if (col < p->width && row >= skip_rows) {
+      continue;
+    }
+    for (size_t b = 0; b < p->elt; b++) {
+      if (bytes[v * p->elt + b] != CANARY) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Take the gaps out of a plane's rows, whose width is already the
+ *        width without them.
+ */
+static void plane_compact(plane *p, const seam_gaps *gaps) {
+  uint8_t *bytes = p->data;
+  for (size_t i = 0; i < p->height; i++) {
+    const size_t *row_gaps = GAPS_ROW(gaps, i);
+    uint8_t *row = &bytes[p->elt * (i * p->buf_width + p->buf_start)];
+    size_t kept = 0;
+    for (size_t m = 0, k = 0; m < p->width + gaps->count; m++) {
+      if (k < gaps->count && row_gaps[k] == m) {
+        k++;
+        continue;
+      }
+      memmove(&row[p->elt * kept++], &row[p->elt * m], p->elt);
+    }
+  }
+}
+
+static int guarded_init(guarded *g, size_t size) {
+  g->page = (size_t)sysconf(_SC_PAGESIZE);
+  g->size = (size + g->page - 1) / g->page * g->page;
+  void *map = mmap(NULL, g->size + g->page, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return 1;
+  }
+  g->map = map;
+  if (mprotect(g->map + g->size, g->page, PROT_NONE) != 0) {
+    munmap(g->map, g->size + g->page);
+    return 1;
+  }
+  return 0;
+}
+
+// the last n bytes before the guard page
+static uint8_t *guarded_tail(const guarded *g, size_t n) {
+  return g->map + g->size - n;
+}
+
+static void guarded_free(guarded *g) {
+  munmap(g->map, g->size + g->page);
+}
+
+static uint64_t next_random(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static size_t random_below(size_t n) {
+  return n ? (size_t)(next_random() % n) : 0;
+}
+
+/**
+ * @brief A random width of at least least, mostly narrow, where the edges
+ *        and the ends of the vectors are most of the row.
+ */
+static size_t random_width(size_t least) {
+  switch (random_below(4)) {
+    case 0:  return least + random_below(8);
+    case 1:  return least + random_below(70);
+    case 2:  return least + random_below(300);
+    default: return least + random_below(1100);
+  }
+}
+
+/**
+ * @brief A random seam, which moves at most a column a row, starting near an
+ *        edge half the time, since that's where the windows are off centre.
+ */
+static void random_seam(size_t width, size_t height, size_t *seam) {
+  const size_t near = width < 8 ? width : 8;
+  size_t col;
+  switch (random_below(4)) {
+    case 0:  col = random_below(near);             break;
+    case 1:  col = width - 1 - random_below(near); break;
+    default: col = random_below(width);            break;
+  }
+
+  for (size_t i = 0; i < height; i++) {
+    seam[i] = col;
+    size_t step = random_below(3);
+    if (step == 0 && col > 0) {
+      col--;
+    } else if (step == 2 && col < width - 1) {
+      col++;
+    }
+  }
+}
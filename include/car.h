@@ -6,11 +6,16 @@
 #ifndef _CAR_H_
 #define _CAR_H_
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 typedef uint8_t pixval;
 
+// the fewest pixels an image carved or stretched can have either way, since
+// the energy kernels' windows at the edges of the image need that many
+#define CAR_MIN_SIZE 4
+
 typedef struct {
   pixval red;
   pixval green;
@@ -26,6 +31,291 @@ typedef struct {
   size_t buf_start;
 } rgb_image;
 
+/**
+ * How the energy of a pixel, what a seam through it costs, is measured.
+ */
+typedef enum {
+  CAR_ENERGY_SOBEL,     /**< 3x3 sobel gradient, the default */
+  CAR_ENERGY_GRADIENT,  /**< differences with the pixels to the right and
+                             below, cheapest and noisiest */
+  CAR_ENERGY_SCHARR,    /**< 3x3 scharr gradient, which weighs every
+                             direction of edge more evenly than sobel */
+} car_energy;
+
+typedef struct {
+  size_t threads;       /**< threads to carve with, 0 for one per cpu */
+  size_t mt_threshold;  /**< images with fewer pixels are carved on one thread */
+  size_t batch_seams;   /**< seams removed per pathsum pass, 1 is exact and
+                             larger is faster but only approximately optimal */
+  size_t compact_interval; /**< most seams that are only marked as removed
+                                before the buffers are compacted, 1 compacts
+                                after every seam, only used one seam per pass */
+  bool trace_dirs;      /**< record which way every path sum came from, so
+                             seams are traced a byte per row instead of
+                             comparing path sums */
+  size_t pyramid_band;  /**< on large images, find the seams on a smaller copy
+                             first, and then each seam at full size only this
+                             many columns either side of its smaller one; 0
+                             searches the whole image for every seam */
+  bool forward_energy;  /**< cost seams by the edges their removal leaves
+                             behind rather than the edges they go through,
+                             which keeps straight lines across the seams
+                             from breaking up */
+  car_energy energy;    /**< energy function, unused with forward_energy */
+  const int8_t *bias;   /**< NULL, or a bias for every pixel of the input,
+                             in->width of them per row, added to its energy:
+                             positive to keep the pixel, negative to carve it
+                             first. Energies run from 0 to 126, so a bias of
+                             126 makes a pixel as costly as the strongest
+                             edge and -126 makes it free. Unused with
+                             forward_energy */
+  bool counters;        /**< also count the instructions, last level cache
+                             misses and branch mispredictions of each stage
+                             for car_context_stats, if the kernel lets
+                             perf_event_open count them. Only the carving
+                             thread is counted, and reading the counters
+                             costs a system call per stage */
+} car_options;
+
+/**
+ * What one stage of a carve cost, added up over every time it ran.
+ *
+ * The bytes are those of the buffers the stage worked through, counted from
+ * the rows and columns it was given, so they're what the stage has to move
+ * at the least rather than a measurement. Over the cycles, they give the
+ * bandwidth the stage needed, and llc_misses * 64 is how much of that came
+ * from memory.
+ */
+typedef struct {
+  uint64_t cycles;         /**< of the time stamp counter, see car_stats.tsc_hz */
+  uint64_t calls;          /**< times the stage ran */
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t instructions;   /**< retired, 0 without counters */
+  uint64_t llc_misses;     /**< last level cache misses, 0 without counters */
+  uint64_t branch_misses;  /**< mispredicted branches, 0 without counters */
+} car_stage_stats;
+
+/**
+ * What the last carve of a context did, and where its time went.
+ */
+typedef struct {
+  car_stage_stats grey;       /**< splitting the input up and joining the result */
+  car_stage_stats transpose;  /**< turning the image around for horizontal seams */
+  car_stage_stats conv;       /**< whole energy maps */
+  car_stage_stats convp;      /**< energies redone around removed seams */
+  car_stage_stats pathsum;    /**< path sums, whole and partial */
+  car_stage_stats minpath;    /**< finding seams in the path sums */
+  car_stage_stats rmpath;     /**< removing seams from the buffers */
+  car_stage_stats insert;     /**< widening the buffers with seams */
+  car_stage_stats malloc;     /**< setting up buffers and threads */
+  double tsc_hz;              /**< time stamp counter ticks a second */
+  bool counters;              /**< whether the hardware counts were taken */
+  size_t seams_removed;       /**< from the image, and from the copies seams
+                                   to insert or pyramid seams are found in */
+  size_t seams_inserted;
+  size_t passes;              /**< times seams were looked for */
+  size_t partial_pathsums;    /**< passes that only redid the path sums under
+                                   the last seam */
+  uint64_t cone_values;       /**< path sums those redid */
+  uint64_t cone_rows;         /**< rows they redid them in, so cone_values /
+                                   cone_rows is the mean width of a cone */
+  size_t cone_widest;         /**< widest row of any one of them */
+} car_stats;
+
+/**
+ * Everything a carve keeps besides its images: the options, the threads
+ * and the stats. A context carves one image at a time, but separate
+ * contexts can carve at the same time on different threads.
+ */
+typedef struct car_context car_context;
+
+/**
+ * @brief Fill in the default carving options.
+ */
+void car_default_options(car_options *opts);
+
+/**
+ * @brief Make a context to carve with.
+ * @return the context, or NULL if there isn't the memory
+ */
+car_context *car_context_create(void);
+
+void car_context_destroy(car_context *ctx);
+
+/**
+ * @brief The stats of the last carve or rank of a context, zero before the
+ *        first one.
+ */
+void car_context_stats(const car_context *ctx, car_stats *stats);
+
+/**
+ * @brief Carve or stretch an image to the size of out.
+ *
+ * The context's threads are kept for its next carve, so a caller carving
+ * many images should keep the context around rather than use seam_carve.
+ *
+ * Both images have to be at least CAR_MIN_SIZE pixels wide and high, and
+ * more than that either way they're stretched, since the seams to insert
+ * are found by carving a copy.
+ *
+ * @param ctx the context to carve with, which no other carve is using
+ * @param in the image to resize
+ * @param out where to put the result, its width and height are the target
+ * @param opts how to carve
+ * @return 0 on success, or 1 if the images are too small or there isn't
+ *         the memory
+ */
+int car_carve(car_context *ctx, const rgb_image *in, rgb_image *out,
+              const car_options *opts);
+
+/**
+ * @brief car_carve with a context of its own.
+ */
+int seam_carve(const rgb_image *in, rgb_image *out, const car_options *opts);
+
+/**
+ * @brief seam_carve with the default options.
+ */
 int seam_carve_baseline(const rgb_image *in, rgb_image *out);
 
+/**
+ * Which seam removed each pixel of an image, from a carve down to some
+ * narrowest width. Each seam is found in the image the ones before it left,
+ * so the image at any width in between is just the pixels the first few
+ * seams didn't remove, and car_retarget picks them out without carving.
+ */
+typedef struct {
+  uint32_t *data;   /**< for every pixel, width per row, the number of the
+                         seam that removed it, or seams if none did */
+  size_t width;
+  size_t height;
+  size_t seams;     /**< seams carved, width - seams is the narrowest width */
+} car_ranks;
+
+/**
+ * @brief Carve the width of an image down to min_width, recording which
+ *        seam removed each pixel.
+ *
+ * The widths car_retarget gives match car_carve with the same options when
+ * batch_seams is 1 and pyramid_band is 0. Otherwise the seams are still
+ * removed in order, but which ones are found depends on how many are.
+ *
+ * @param ctx the context to carve with, which no other carve is using
+ * @param in the image to carve, at least CAR_MIN_SIZE pixels high
+ * @param min_width the narrowest width that will be asked for, at least
+ *                  CAR_MIN_SIZE
+ * @param ranks receives the ranks, its data must hold in->width by
+ *              in->height of them
+ * @param opts how to carve
+ * @return 0 on success
+ */
+int car_rank(car_context *ctx, const rgb_image *in, size_t min_width, car_ranks *ranks,
+             const car_options *opts);
+
+/**
+ * @brief Narrow an image to the width of out with the ranks car_rank found
+ *        for it, in one pass over the image.
+ * @param in the image the ranks were found for
+ * @param out where to put the result, its width is the target, which can't
+ *            be less than ranks->width - ranks->seams, and its height is in's
+ * @return 0 on success
+ */
+int car_retarget(const car_ranks *ranks, const rgb_image *in, rgb_image *out);
+
+/**
+ * Ranks saved to a file, mapped read-only so that every process serving
+ * from the same file shares its pages.
+ *
+ * The file holds each seam as a column in the image the seams before it
+ * left, in the first row, and then a step of -1, 0 or +1 columns for every
+ * row after that, 2 bits each. The steps of every seam for a row are
+ * together, so the first few seams of a row are read without the rest.
+ */
+typedef struct car_seam_file car_seam_file;
+
+/**
+ * @brief Save ranks to a seam file at path, replacing any file there.
+ *
+ * Only ranks whose seams each move at most one column a row in the image
+ * the seams before them left can be saved, which car_rank's always do when
+ * batch_seams is 1.
+ *
+ * @return 0 on success
+ */
+int car_ranks_save(const car_ranks *ranks, const char *path);
+
+/**
+ * @brief Map a seam file that car_ranks_save wrote.
+ * @return the file, or NULL if it couldn't be mapped or isn't a seam file
+ *         of this version
+ */
+car_seam_file *car_seam_file_open(const char *path);
+
+void car_seam_file_close(car_seam_file *file);
+
+/**
+ * @brief The size of the image a seam file's seams were found in, and how
+ *        many there are.
+ */
+void car_seam_file_size(const car_seam_file *file, size_t *width, size_t *height,
+                        size_t *seams);
+
+/**
+ * @brief car_retarget with the ranks in a seam file, read straight from the
+ *        mapping, and only as many seams of each row as are removed.
+ * @return 0 on success
+ */
+int car_seam_file_retarget(const car_seam_file *file, const rgb_image *in, rgb_image *out);
+
+/**
+ * Worker threads that carve many images at once, each image on one thread
+ * with a context of its own. Jobs are spread over the workers by how much
+ * carving they take rather than how many there are, and idle workers take
+ * jobs from busy ones, so a large image doesn't hold up the small ones
+ * queued after it.
+ */
+typedef struct car_queue car_queue;
+
+/**
+ * A carve submitted to a queue, until it's been waited for.
+ */
+typedef struct car_job car_job;
+
+/**
+ * @brief Start the workers of a queue.
+ * @param nworkers how many images to carve at once, 0 for one per cpu
+ * @return the queue, or NULL if it couldn't be started
+ */
+car_queue *car_queue_create(size_t nworkers);
+
+/**
+ * @brief Stop the workers of a queue. Every job must have been waited for.
+ */
+void car_queue_destroy(car_queue *queue);
+
+/**
+ * @brief Queue a carve of in to the size of out.
+ *
+ * The images, and opts->bias if there is one, must stay valid until the job
+ * has been waited for. The job carves on its worker's thread alone unless
+ * opts->threads asks for more.
+ *
+ * @param opts how to carve, copied into the job
+ * @return the job, or NULL if there isn't the memory
+ */
+car_job *car_queue_submit(car_queue *queue, const rgb_image *in, rgb_image *out,
+                          const car_options *opts);
+
+/**
+ * @brief Whether a job has finished, without waiting for it.
+ */
+bool car_job_poll(const car_job *job);
+
+/**
+ * @brief Wait for a job to finish and free it.
+ * @return the job's car_carve result, 0 on success
+ */
+int car_job_wait(car_job *job);
+
 #endif /* _CAR_H_ */
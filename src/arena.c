@@ -0,0 +1,154 @@
+/**
+ * @file arena.c
+ * @brief Scratch memory that is kept from one carve to the next
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+struct arena_block {
+  arena_block *next;
+  size_t size;
+  uint8_t *data;
+};
+
+// every allocation starts on its own cache line
+static const size_t ALIGN = 64;
+
+// the first block is at least this big
+static const size_t MIN_BLOCK = 1 << 20;
+
+static arena_block *block_create(size_t size);
+static void blocks_free(arena_block *block);
+static int next_block(arena *a, size_t size);
+static size_t bytes_before(const arena *a, const arena_block *block);
+static size_t align_up(size_t n);
+
+void arena_init(arena *a) {
+  assert(a);
+  *a = (arena) { 0 };
+}
+
+void arena_free(arena *a) {
+  blocks_free(a->first);
+  arena_init(a);
+}
+
+void *arena_alloc(arena *a, size_t size) {
+  assert(a);
+
+  size_t start = align_up(a->used);
+  if (!a->cur || start + size > a->cur->size) {
+    if (next_block(a, size) != 0) {
+      return NULL;
+    }
+    start = 0;
+  }
+
+  a->used = start + size;
+  size_t in_use = bytes_before(a, a->cur) + a->used;
+  if (in_use > a->peak) {
+    a->peak = in_use;
+  }
+
+  return a->cur->data + start;
+}
+
+void arena_get_mark(const arena *a, arena_mark *mark) {
+  mark->block = a->cur;
+  mark->used = a->used;
+}
+
+void arena_release(arena *a, arena_mark mark) {
+  a->cur = mark.block;
+  a->used = mark.used;
+}
+
+void arena_reset(arena *a) {
+  // everything since the last reset fits in one block of the peak size,
+  // since the blocks were filled in order
+  if (a->first && a->first->next && a->peak > a->first->size) {
+    arena_block *merged = block_create(a->peak);
+    if (merged) {
+      blocks_free(a->first);
+      a->first = merged;
+    }
+  }
+
+  a->cur = NULL;
+  a->used = 0;
+  a->peak = 0;
+}
+
+/**
+ * @brief Move on to the block after the current one, big enough for size.
+ *
+ * A block left over from a release is reused if it's big enough, otherwise
+ * it and the ones after it are dropped to make way for a bigger one.
+ *
+ * @return 0, or 1 if there isn't the memory
+ */
+static int next_block(arena *a, size_t size) {
+  arena_block **link = a->cur ? &a->cur->next : &a->first;
+
+  if (*link && (*link)->size < size) {
+    blocks_free(*link);
+    *link = NULL;
+  }
+
+  if (!*link) {
+    size_t want = a->cur ? 2 * a->cur->size : MIN_BLOCK;
+    *link = block_create(want > size ? want : size);
+    if (!*link) {
+      return 1;
+    }
+  }
+
+  a->cur = *link;
+  a->used = 0;
+  return 0;
+}
+
+/**
+ * @brief Total size of the blocks before a block.
+ */
+static size_t bytes_before(const arena *a, const arena_block *block) {
+  size_t total = 0;
+  for (const arena_block *b = a->first; b != block; b = b->next) {
+    total += b->size;
+  }
+  return total;
+}
+
+static arena_block *block_create(size_t size) {
+  arena_block *block = malloc(sizeof(*block));
+  if (!block) {
+    return NULL;
+  }
+
+  block->size = align_up(size);
+  block->data = aligned_alloc(ALIGN, block->size);
+  block->next = NULL;
+  if (!block->data) {
+    free(block);
+    return NULL;
+  }
+
+  return block;
+}
+
+static void blocks_free(arena_block *block) {
+  while (block) {
+    arena_block *next = block->next;
+    free(block->data);
+    free(block);
+    block = next;
+  }
+}
+
+static size_t align_up(size_t n) {
+  return (n + ALIGN - 1) & ~(ALIGN - 1);
+}
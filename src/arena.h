@@ -0,0 +1,74 @@
+/**
+ * @file arena.h
+ * @brief Scratch memory that is kept from one carve to the next
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+typedef struct arena_block arena_block;
+
+/**
+ * Allocations are handed out of a list of blocks in order and are never
+ * freed one at a time. Instead the arena is rolled back to a mark, or reset
+ * to empty, and the blocks are kept for the next allocations. When a block
+ * runs out, the next one is at least twice its size, and a reset merges the
+ * blocks into one big enough for everything that was allocated since the
+ * last reset, so a run of similar carves settles into a single block whose
+ * pages have all been touched already.
+ */
+typedef struct {
+  arena_block *first;
+  arena_block *cur;   // the block being allocated from, NULL before the first
+  size_t used;        // bytes of cur already handed out
+  size_t peak;        // most bytes in use since the last reset
+} arena;
+
+// where an arena was up to, to roll it back to later
+typedef struct {
+  arena_block *block;
+  size_t used;
+} arena_mark;
+
+// set up a struct shaped like an image with its data in an arena
+#define ARENA_IMAGE(img, _width, _height, _arena) \
+  do {                             \
+    (img)->width = (_width);       \
+    (img)->height = (_height);     \
+    (img)->buf_width = (_width);   \
+    (img)->buf_height = (_height); \
+    (img)->buf_start = 0;          \
+    (img)->data = arena_alloc((_arena), sizeof(*((img)->data)) * (_width)*(_height)); \
+  } while (0)
+
+void arena_init(arena *a);
+
+/**
+ * @brief Free all of an arena's memory.
+ */
+void arena_free(arena *a);
+
+/**
+ * @brief Allocate from an arena, aligned to a cache line.
+ * @return the memory, or NULL if there isn't the memory
+ */
+void *arena_alloc(arena *a, size_t size);
+
+/**
+ * @brief Remember where an arena is up to.
+ */
+void arena_get_mark(const arena *a, arena_mark *mark);
+
+/**
+ * @brief Give back everything allocated since a mark was taken.
+ */
+void arena_release(arena *a, arena_mark mark);
+
+/**
+ * @brief Give back everything, keeping the memory for next time.
+ */
+void arena_reset(arena *a);
+
+#endif /* _ARENA_H_ */
@@ -0,0 +1,547 @@
+/**
+ * @file batch.c
+ * @brief Carve many images in one process
+ *
+ * Every image goes through three stages: decoding, carving and encoding.
+ * Each stage runs on threads of its own, and hands images to the next one
+ * through a bounded queue, so reading and writing files overlaps with
+ * carving. When a stage falls behind, the queue in front of it fills up and
+ * holds the earlier stages back, rather than letting decoded images pile
+ * up in memory.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <dirent.h>
+#include <log.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <wand/magick_wand.h>
+
+#include <car.h>
+
+#include "batch.h"
+#include "car_internal.h"
+
+// images that can wait between two stages
+static const size_t QUEUE_DEPTH = 4;
+
+// narrowest image the batch will make
+static const long long MIN_WIDTH = 10;
+
+// one image on its way through the stages
+typedef struct {
+  const char *in_path;
+  char *out_path;
+  MagickWand *mw;
+  rgb_image in;
+  rgb_image out;
+} batch_image;
+
+// a bounded queue of images between two stages
+typedef struct {
+  batch_image **items;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  size_t producers;  // threads still putting images in
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} image_queue;
+
+typedef enum {
+  RULE_SEAMS,    // remove this many columns, or insert if negative
+  RULE_PERCENT,  // make the image this percent of its width
+  RULE_WIDTH,    // make the image this wide
+} rule_kind;
+
+typedef struct {
+  rule_kind kind;
+  long long value;
+} width_rule;
+
+typedef struct {
+  char **paths;
+  size_t npaths;
+  const char *outdir;
+  width_rule rule;
+  car_options opts;
+
+  atomic_size_t next;  // next path to decode
+  atomic_size_t failures;
+
+  image_queue decoded;
+  image_queue carved;
+} batch_state;
+
+static void *decode_main(void *arg);
+static void *carve_main(void *arg);
+static void *encode_main(void *arg);
+static size_t start_threads(pthread_t *threads, size_t *nthreads, size_t n,
+                            void *(*fn)(void *), batch_state *batch, const char *stage);
+static batch_image *decode_image(const batch_state *batch, const char *path);
+static void image_free(batch_image *img);
+static int parse_rule(const char *str, width_rule *rule);
+static int target_width(const width_rule *rule, size_t width, size_t *target);
+static int list_paths(const char *path, char ***paths, size_t *npaths);
+static int list_dir(const char *path, char ***paths, size_t *npaths);
+static int list_file(const char *path, char ***paths, size_t *npaths);
+static int add_path(char ***paths, size_t *npaths, size_t *capacity, char *path);
+static int compare_paths(const void *a, const void *b);
+static char *output_path(const char *outdir, const char *in_path);
+static int queue_init(image_queue *q, size_t capacity, size_t producers);
+static void queue_destroy(image_queue *q);
+static void queue_put(image_queue *q, batch_image *img);
+static batch_image *queue_get(image_queue *q);
+static void queue_close(image_queue *q);
+
+int batch_main(int argc, const char *argv[]) {
+  if (argc < 4) {
+    printf("Usage: %s [in] [outdir] [width] [codec threads=1]\n", argv[0]);
+    printf("  in: A directory of images, or a file listing one image path per line\n");
+    printf("  outdir: Directory to write the results to, under the same file names\n");
+    printf("  width: How to resize each image: 200 removes 200 vertical seams, ");
+    printf("-200 inserts 200, 80%% makes it 80%% as wide, =640 makes it 640 wide\n");
+    printf("  codec threads: How many threads decode, and how many encode\n");
+    return 1;
+  }
+
+  batch_state batch = { .outdir = argv[2] };
+  car_default_options(&batch.opts);
+  atomic_init(&batch.next, 0);
+  atomic_init(&batch.failures, 0);
+
+  if (parse_rule(argv[3], &batch.rule) != 0) {
+    log_fatal("Invalid width: %s", argv[3]);
+    return 1;
+  }
+
+  unsigned ncodec = 1;
+  if (argc > 4 && (sscanf(argv[4], "%u", &ncodec) != 1 || ncodec == 0)) {
+    log_fatal("Invalid thread count: %s", argv[4]);
+    return 1;
+  }
+
+  if (list_paths(argv[1], &batch.paths, &batch.npaths) != 0) {
+    return 1;
+  }
+  log_info("Carving %zu images", batch.npaths);
+
+  if (queue_init(&batch.decoded, QUEUE_DEPTH, ncodec) != 0
+      || queue_init(&batch.carved, QUEUE_DEPTH, 1) != 0) {
+    log_fatal("malloc failed");
+    return 1;
+  }
+
+  MagickWandGenesis();
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * (2*ncodec + 1));
+  if (!threads) {
+    log_fatal("malloc failed");
+    return 1;
+  }
+
+  // each stage starts before the one feeding it, so that whatever starts
+  // has something taking its images and can finish. The carve already
+  // spreads over the cpus, so one image is carved at a time
+  size_t nthreads = 0;
+  size_t nencoders = start_threads(threads, &nthreads, ncodec, encode_main, &batch, "encode");
+  size_t ncarvers = nencoders > 0
+                    ? start_threads(threads, &nthreads, 1, carve_main, &batch, "carve") : 0;
+  size_t ndecoders = ncarvers > 0
+                     ? start_threads(threads, &nthreads, ncodec, decode_main, &batch, "decode")
+                     : 0;
+
+  // the producers that didn't start have nothing to put in their queues
+  for (size_t k = ndecoders; k < ncodec; k++) {
+    queue_close(&batch.decoded);
+  }
+  if (ncarvers == 0) {
+    queue_close(&batch.carved);
+  }
+  for (size_t k = 0; k < nthreads; k++) {
+    pthread_join(threads[k], NULL);
+  }
+
+  MagickWandTerminus();
+
+  // without a thread for every stage, no image was even read
+  if (ndecoders == 0) {
+    log_fatal("Could not start the threads");
+    atomic_store(&batch.failures, batch.npaths);
+  }
+  size_t failures = atomic_load(&batch.failures);
+  log_info("Carved %zu of %zu images", batch.npaths - failures, batch.npaths);
+
+  free(threads);
+  queue_destroy(&batch.decoded);
+  queue_destroy(&batch.carved);
+  for (size_t k = 0; k < batch.npaths; k++) {
+    free(batch.paths[k]);
+  }
+  free(batch.paths);
+
+  return failures > 0 ? 1 : 0;
+}
+
+static void *decode_main(void *arg) {
+  batch_state *batch = arg;
+
+  size_t k;
+  while ((k = atomic_fetch_add(&batch->next, 1)) < batch->npaths) {
+    batch_image *img = decode_image(batch, batch->paths[k]);
+    if (!img) {
+      atomic_fetch_add(&batch->failures, 1);
+      continue;
+    }
+    queue_put(&batch->decoded, img);
+  }
+
+  queue_close(&batch->decoded);
+  return NULL;
+}
+
+static void *carve_main(void *arg) {
+  batch_state *batch = arg;
+
+  // one context for every image, so they share the threads and buffers
+  car_context *ctx = car_context_create();
+  if (!ctx) {
+    log_fatal("malloc failed");
+  }
+
+  batch_image *img;
+  while ((img = queue_get(&batch->decoded))) {
+    if (!ctx || car_carve(ctx, &img->in, &img->out, &batch->opts) != 0) {
+      log_error("Could not carve %s", img->in_path);
+      atomic_fetch_add(&batch->failures, 1);
+      image_free(img);
+      continue;
+    }
+    queue_put(&batch->carved, img);
+  }
+
+  car_context_destroy(ctx);
+  queue_close(&batch->carved);
+  return NULL;
+}
+
+static void *encode_main(void *arg) {
+  batch_state *batch = arg;
+
+  batch_image *img;
+  while ((img = queue_get(&batch->carved))) {
+    MagickExtentImage(img->mw, img->out.width, img->out.height, 0, 0);
+    MagickImportImagePixels(img->mw, 0, 0, img->out.width, img->out.height,
+                            "RGB", CharPixel, img->out.data);
+    if (MagickWriteImage(img->mw, img->out_path) != MagickTrue) {
+      log_error("Failed to write output: %s", img->out_path);
+      atomic_fetch_add(&batch->failures, 1);
+    } else {
+      log_info("Wrote %s", img->out_path);
+    }
+    image_free(img);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Start up to n threads running fn, after the nthreads in threads.
+ * @return how many of them started
+ */
+static size_t start_threads(pthread_t *threads, size_t *nthreads, size_t n,
+                            void *(*fn)(void *), batch_state *batch, const char *stage) {
+  for (size_t k = 0; k < n; k++) {
+    if (pthread_create(&threads[*nthreads], NULL, fn, batch) != 0) {
+      log_warn("Could only start %zu of %zu %s threads", k, n, stage);
+      return k;
+    }
+    (*nthreads)++;
+  }
+  return n;
+}
+
+/**
+ * @brief Read an image and allocate everything it needs to be carved.
+ * @return the image, or NULL if it couldn't be read or resized
+ */
+static batch_image *decode_image(const batch_state *batch, const char *path) {
+  batch_image *img = calloc(1, sizeof(*img));
+  if (!img) {
+    log_error("malloc failed");
+    return NULL;
+  }
+  img->in_path = path;
+
+  img->mw = NewMagickWand();
+  if (!img->mw || MagickReadImage(img->mw, path) != MagickTrue) {
+    log_error("Could not open image: %s", path);
+    image_free(img);
+    return NULL;
+  }
+
+  size_t ww = MagickGetImageWidth(img->mw);
+  size_t hh = MagickGetImageHeight(img->mw);
+  size_t out_ww;
+  if (target_width(&batch->rule, ww, &out_ww) != 0) {
+    log_error("Can't resize %s from a width of %zu", path, ww);
+    image_free(img);
+    return NULL;
+  }
+
+  INITIALIZE_IMAGE(&img->in, ww, hh);
+  INITIALIZE_IMAGE(&img->out, out_ww, hh);
+  img->out_path = output_path(batch->outdir, path);
+  if (!img->in.data || !img->out.data || !img->out_path) {
+    log_error("malloc failed");
+    image_free(img);
+    return NULL;
+  }
+
+  MagickExportImagePixels(img->mw, 0, 0, ww, hh, "RGB", CharPixel, img->in.data);
+  return img;
+}
+
+static void image_free(batch_image *img) {
+  if (img->mw) {
+    DestroyMagickWand(img->mw);
+  }
+  free(img->in.data);
+  free(img->out.data);
+  free(img->out_path);
+  free(img);
+}
+
+static int parse_rule(const char *str, width_rule *rule) {
+  char suffix = '\0';
+  if (str[0] == '=') {
+    rule->kind = RULE_WIDTH;
+    return sscanf(str+1, "%lld%c", &rule->value, &suffix) == 1 && rule->value > 0 ? 0 : 1;
+  }
+  if (sscanf(str, "%lld%c", &rule->value, &suffix) == 2 && suffix == '%') {
+    rule->kind = RULE_PERCENT;
+    return rule->value > 0 ? 0 : 1;
+  }
+  rule->kind = RULE_SEAMS;
+  return sscanf(str, "%lld%c", &rule->value, &suffix) == 1 ? 0 : 1;
+}
+
+/**
+ * @brief Width an image should be resized to.
+ * @return 0, or 1 if the result would be too narrow
+ */
+static int target_width(const width_rule *rule, size_t width, size_t *target) {
+  long long ww = (long long)width;
+  long long result;
+  switch (rule->kind) {
+    case RULE_SEAMS:   result = ww - rule->value;        break;
+    case RULE_PERCENT: result = ww * rule->value / 100;  break;
+    case RULE_WIDTH:   result = rule->value;             break;
+    default:           return 1;
+  }
+
+  if (result < MIN_WIDTH) {
+    return 1;
+  }
+  *target = (size_t)result;
+  return 0;
+}
+
+/**
+ * @brief Images to carve, from a directory or a list file.
+ * @return 0, or 1 if there's nothing to carve
+ */
+static int list_paths(const char *path, char ***paths, size_t *npaths) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    log_fatal("Could not open %s", path);
+    return 1;
+  }
+
+  *paths = NULL;
+  *npaths = 0;
+  int failed = S_ISDIR(st.st_mode) ? list_dir(path, paths, npaths)
+                                   : list_file(path, paths, npaths);
+  if (!failed && *npaths == 0) {
+    log_fatal("No images in %s", path);
+    failed = 1;
+  }
+  return failed;
+}
+
+static int list_dir(const char *path, char ***paths, size_t *npaths) {
+  DIR *dir = opendir(path);
+  if (!dir) {
+    log_fatal("Could not open %s", path);
+    return 1;
+  }
+
+  size_t capacity = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    if (ent->d_name[0] == '.') {
+      continue;
+    }
+    char *full = malloc(strlen(path) + strlen(ent->d_name) + 2);
+    if (!full) {
+      closedir(dir);
+      log_fatal("malloc failed");
+      return 1;
+    }
+    sprintf(full, "%s/%s", path, ent->d_name);
+
+    struct stat st;
+    if (stat(full, &st) != 0 || !S_ISREG(st.st_mode)) {
+      free(full);
+      continue;
+    }
+    if (add_path(paths, npaths, &capacity, full) != 0) {
+      closedir(dir);
+      return 1;
+    }
+  }
+  closedir(dir);
+
+  // directories list in no particular order
+  qsort(*paths, *npaths, sizeof(char *), compare_paths);
+  return 0;
+}
+
+static int list_file(const char *path, char ***paths, size_t *npaths) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    log_fatal("Could not open %s", path);
+    return 1;
+  }
+
+  size_t capacity = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &line_size, fp)) >= 0) {
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (len == 0) {
+      continue;
+    }
+    char *copy = strdup(line);
+    if (!copy || add_path(paths, npaths, &capacity, copy) != 0) {
+      free(copy);
+      free(line);
+      fclose(fp);
+      log_fatal("malloc failed");
+      return 1;
+    }
+  }
+
+  free(line);
+  fclose(fp);
+  return 0;
+}
+
+static int add_path(char ***paths, size_t *npaths, size_t *capacity, char *path) {
+  if (*npaths == *capacity) {
+    size_t grown = *capacity ? 2 * *capacity : 64;
+    char **bigger = realloc(*paths, sizeof(char *) * grown);
+    if (!bigger) {
+      free(path);
+      log_fatal("malloc failed");
+      return 1;
+    }
+    *paths = bigger;
+    *capacity = grown;
+  }
+  (*paths)[(*npaths)++] = path;
+  return 0;
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static char *output_path(const char *outdir, const char *in_path) {
+  const char *name = strrchr(in_path, '/');
+  name = name ? name+1 : in_path;
+
+  char *path = malloc(strlen(outdir) + strlen(name) + 2);
+  if (path) {
+    sprintf(path, "%s/%s", outdir, name);
+  }
+  return path;
+}
+
+static int queue_init(image_queue *q, size_t capacity, size_t producers) {
+  q->items = malloc(sizeof(batch_image *) * capacity);
+  q->capacity = capacity;
+  q->head = 0;
+  q->count = 0;
+  q->producers = producers;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  return q->items ? 0 : 1;
+}
+
+static void queue_destroy(image_queue *q) {
+  pthread_cond_destroy(&q->not_full);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_mutex_destroy(&q->lock);
+  free(q->items);
+}
+
+/**
+ * @brief Add an image to a queue, waiting for room if it's full.
+ */
+static void queue_put(image_queue *q, batch_image *img) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->capacity) {
+    pthread_cond_wait(&q->not_full, &q->lock);
+  }
+  q->items[(q->head + q->count) % q->capacity] = img;
+  q->count++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * @brief Take the oldest image from a queue, waiting for one if need be.
+ * @return the image, or NULL once the queue is empty and closed
+ */
+static batch_image *queue_get(image_queue *q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && q->producers > 0) {
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  }
+
+  batch_image *img = NULL;
+  if (q->count > 0) {
+    img = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return img;
+}
+
+/**
+ * @brief Note that one of a queue's producers is done with it.
+ */
+static void queue_close(image_queue *q) {
+  pthread_mutex_lock(&q->lock);
+  assert(q->producers > 0);
+  if (--q->producers == 0) {
+    pthread_cond_broadcast(&q->not_empty);
+  }
+  pthread_mutex_unlock(&q->lock);
+}
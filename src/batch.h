@@ -0,0 +1,17 @@
+/**
+ * @file batch.h
+ * @brief Carve many images in one process
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+/**
+ * @brief Run the batch mode of the command line.
+ * @param argc number of arguments, counting the mode flag as argv[0]
+ * @param argv the arguments after the program name
+ * @return the exit status, 1 if any image failed
+ */
+int batch_main(int argc, const char *argv[]);
+
+#endif /* _BATCH_H_ */
@@ -8,6 +8,7 @@
 
 #include <car.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <x86intrin.h>
 
 typedef struct {
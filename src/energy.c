@@ -11,73 +11,117 @@
 
 #include "car_internal.h"
 #include "energy.h"
+#include "gaps.h"
+#include "simd.h"
+#include "threadpool.h"
 
-typedef struct {
-  enval *data;
-  enval magnitude;
-  size_t width;
-  size_t height;
-  size_t buf_width;
-  size_t buf_height;
-  size_t buf_start;
-} kern2d;
-
-#define KERNEL_X ((kern2d) {  \
-  .data = (enval []) {        \
-    -1, -2, -1,               \
-     0,  0,  0,               \
-     1,  2,  1                \
-  },                          \
-  .magnitude = 8,             \
-  .width = 3,                 \
-  .height = 3,                \
-  .buf_width = 3,             \
-  .buf_height = 3,            \
-  .buf_start = 0              \
-})
-
-#define KERNEL_Y ((kern2d) {  \
-  .data = (enval []) {        \
-    -1,  0,  1,               \
-    -2,  0,  2,               \
-    -1,  0,  1                \
-  },                          \
-  .magnitude = 8,             \
-  .width = 3,                 \
-  .height = 3,                \
-  .buf_width = 3,             \
-  .buf_height = 3,            \
-  .buf_start = 0              \
-})
-
+// the window every energy function looks at around a pixel
 static const size_t KERNEL_WIDTH = 3;
 static const size_t KERNEL_HEIGHT = 3;
 
+static void conv_pixel(const energy_func *fn, const gray_image *in, energymap *out,
+                       const gray_image *bias, size_t i, size_t j);
+static void conv_row_gaps(const energy_func *fn, const gray_image *in, energymap *out,
+                          const gray_image *bias, size_t i, size_t j0, size_t j1,
+                          const seam_gaps *gaps);
+static size_t conv_origin(size_t j, size_t ww);
+static double conv_pixel_vec(const energy_func *fn, const gray_image *in, energymap *out,
+                             const gray_image *bias, size_t i, size_t j, size_t len);
+static enval bias_pixel(enval energy, pixval bias);
+static __m512i bias_epi8_avx512(__m512i energy, __m512i bias);
+static __m256i bias_epi8_avx2(__m256i energy, __m256i bias);
+static __m128i bias_epi8(__m128i energy, __m128i bias);
+static enval sobel_pixel(const pixval *top, const pixval *mid, const pixval *bot);
+static size_t sobel_span(const pixval *upper, const pixval *mid, const pixval *lower,
+                         const pixval *bias, enval *res, size_t n);
+static size_t sobel_span_avx512(const pixval *upper, const pixval *mid, const pixval *lower,
+                                const pixval *bias, enval *res, size_t n);
+static size_t sobel_span_avx2(const pixval *upper, const pixval *mid, const pixval *lower,
+                              const pixval *bias, enval *res, size_t n);
+static size_t sobel_span_sse(const pixval *upper, const pixval *mid, const pixval *lower,
+                             const pixval *bias, enval *res, size_t n);
+static enval gradient_pixel(const pixval *top, const pixval *mid, const pixval *bot);
+static size_t gradient_span(const pixval *upper, const pixval *mid, const pixval *lower,
+                            const pixval *bias, enval *res, size_t n);
+static size_t gradient_span_avx512(const pixval *upper, const pixval *mid, const pixval *lower,
+                                   const pixval *bias, enval *res, size_t n);
+static size_t gradient_span_avx2(const pixval *upper, const pixval *mid, const pixval *lower,
+                                 const pixval *bias, enval *res, size_t n);
+static size_t gradient_span_sse(const pixval *upper, const pixval *mid, const pixval *lower,
+                                const pixval *bias, enval *res, size_t n);
+static enval scharr_pixel(const pixval *top, const pixval *mid, const pixval *bot);
+static size_t scharr_span(const pixval *upper, const pixval *mid, const pixval *lower,
+                          const pixval *bias, enval *res, size_t n);
+static size_t scharr_span_avx512(const pixval *upper, const pixval *mid, const pixval *lower,
+                                 const pixval *bias, enval *res, size_t n);
+static size_t scharr_span_avx2(const pixval *upper, const pixval *mid, const pixval *lower,
+                               const pixval *bias, enval *res, size_t n);
+static size_t scharr_span_sse(const pixval *upper, const pixval *mid, const pixval *lower,
+                              const pixval *bias, enval *res, size_t n);
+static void compute_energymap_band(void *arg, size_t task);
+
+static const energy_func SOBEL = { "sobel", sobel_pixel, sobel_span };
+static const energy_func GRADIENT = { "gradient", gradient_pixel, gradient_span };
+static const energy_func SCHARR = { "scharr", scharr_pixel, scharr_span };
+
+// rows per task when the energy map is split up between threads
+static const size_t BAND_HEIGHT = 16;
 
-static void conv_pixel(const gray_image *in, energymap *out, size_t i, size_t j);
-static double conv_pixel_vec(const gray_image *in, energymap *out, size_t i, size_t j, size_t len);
-
+typedef struct {
+  const gray_image *in;
+  energymap *out;
+  const energy_func *fn;
+  const gray_image *bias;
+  double *best_cpe;
+} energymap_bands;
+
+// widen pixels to 16 bit lanes, loading only the bytes that are used since
+// the rest could be past the end of the row
 #define LOAD_EIGHT_UNSIGNED_BYTES(data) \
-  (_mm256_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(data))))
+  (_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(data))))
+#define LOAD_16_UNSIGNED_BYTES(data) \
+  (_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(data))))
+#define LOAD_32_UNSIGNED_BYTES(data, mask) \
+  (_mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8((mask), (data))))
+
+const energy_func *energy_func_get(car_energy kind) {
+  switch (kind) {
+    case CAR_ENERGY_SOBEL:    return &SOBEL;
+    case CAR_ENERGY_GRADIENT: return &GRADIENT;
+    case CAR_ENERGY_SCHARR:   return &SCHARR;
+    default:                  return NULL;
+  }
+}
 
-double compute_energymap_partial(const gray_image *in, energymap *out, const size_t *removed) {
+double compute_energymap_partial(const gray_image *in, energymap *out, const energy_func *fn,
+                                 const gray_image *bias, const size_t *removed,
+                                 const seam_gaps *gaps) {
+  assert(fn);
   assert(IS_IMAGE(in));
   assert(IS_IMAGE(out));
   assert(in->width == out->width);
   assert(in->height == out->height);
+  assert(!bias || (bias->width == out->width && bias->height == out->height));
   assert(removed);
 
   size_t hh = in->height;
-  size_t khh = KERNEL_HEIGHT;
-  size_t kww = KERNEL_WIDTH;
-
-  size_t vec_width = 8;
+  size_t ww = in->width;
 
   double best_cpe = INFINITY;
 
   for (size_t i = 0; i < hh; i++) {
-    size_t j0 = removed[i] - (kww/2) - (khh-1)-1;
-    double cpe = conv_pixel_vec(in, out, i, j0, vec_width);
+    // nothing else touches the bias near the seam between compactions, so
+    // it's fetched a few rows ahead
+    if (bias && i + 8 < hh) {
+      __builtin_prefetch(&GET_PIXEL(bias, i+8, removed[i+8]));
+    }
+    size_t j0, j1;
+    energymap_partial_cols(i, hh, ww, removed[i], &j0, &j1);
+    if (gaps && gaps->count > 0) {
+      conv_row_gaps(fn, in, out, bias, i, j0, j1, gaps);
+      continue;
+    }
+    double cpe = conv_pixel_vec(fn, in, out, bias, i, j0, j1-j0);
     if (cpe < best_cpe) {
       best_cpe = cpe;
     }
@@ -86,19 +130,76 @@ double compute_energymap_partial(const gray_image *in, energymap *out, const siz
   return best_cpe;
 }
 
-double compute_energymap(const gray_image *in, energymap *out) {
+void energymap_partial_cols(size_t i, size_t hh, size_t ww, size_t removed, size_t *j0,
+                            size_t *j1) {
+  // how far either side of the seam the kernels of this row and the rows
+  // next to it could have seen the removed pixels
+  const size_t reach = ENERGY_PARTIAL_REACH;
+  assert(reach == (KERNEL_WIDTH/2) + (KERNEL_HEIGHT-1) + 1);
+
+  *j0 = removed > reach ? removed - reach : 0;
+  *j1 = removed + reach < ww ? removed + reach : ww;
+
+  // the last row's window is the three rows above it, and the first row's
+  // reaches two rows down, so their corners see the seam further out
+  if (i == 0 || i == hh-1) {
+    if (removed < ENERGY_CORNER_REACH) {
+      *j0 = 0;
+    }
+    if (removed + ENERGY_CORNER_REACH >= ww) {
+      *j1 = ww;
+    }
+  }
+}
+
+double compute_energymap(const gray_image *in, energymap *out, const energy_func *fn,
+                         const gray_image *bias, threadpool *pool, arena *a) {
+  assert(fn);
   assert(IS_IMAGE(in));
   assert(IS_IMAGE(out));
   assert(in->width == out->width);
   assert(in->height == out->height);
+  assert(!bias || (bias->width == out->width && bias->height == out->height));
 
   size_t hh = in->height;
-  size_t ww = in->width;
+  size_t nbands = (hh + BAND_HEIGHT - 1) / BAND_HEIGHT;
+
+  // the cpe is only a diagnostic, so carry on without it if need be
+  arena_mark mark;
+  arena_get_mark(a, &mark);
+  double *band_cpe = arena_alloc(a, sizeof(double) * nbands);
+
+  // rows are independent of each other, so split them into bands
+  energymap_bands bands = {
+    .in = in,
+    .out = out,
+    .fn = fn,
+    .bias = bias,
+    .best_cpe = band_cpe,
+  };
+  threadpool_run(pool, nbands, compute_energymap_band, &bands);
 
   double best_cpe = INFINITY;
+  for (size_t k = 0; band_cpe && k < nbands; k++) {
+    if (band_cpe[k] < best_cpe) {
+      best_cpe = band_cpe[k];
+    }
+  }
+  arena_release(a, mark);
 
-  for (size_t i = 0; i < hh; i++) {
-    double cpe = conv_pixel_vec(in, out, i, 0, ww);
+  return best_cpe;
+}
+
+double compute_energymap_rows(const gray_image *in, energymap *out, const energy_func *fn,
+                              const gray_image *bias, size_t i0, size_t i1) {
+  assert(fn);
+  assert(i0 <= i1 && i1 <= in->height);
+
+  size_t ww = in->width;
+  double best_cpe = INFINITY;
+
+  for (size_t i = i0; i < i1; i++) {
+    double cpe = conv_pixel_vec(fn, in, out, bias, i, 0, ww);
     if (cpe < best_cpe) {
       best_cpe = cpe;
     }
@@ -107,48 +208,107 @@ double compute_energymap(const gray_image *in, energymap *out) {
   return best_cpe;
 }
 
-static void conv_pixel(const gray_image *in, energymap *out, size_t i, size_t j) {
+static void compute_energymap_band(void *arg, size_t task) {
+  const energymap_bands *bands = arg;
+  const gray_image *in = bands->in;
+  energymap *out = bands->out;
+
+  size_t i0 = task * BAND_HEIGHT;
+  size_t i1 = i0 + BAND_HEIGHT < in->height ? i0 + BAND_HEIGHT : in->height;
+
+  double best_cpe = compute_energymap_rows(in, out, bands->fn, bands->bias, i0, i1);
+
+  if (bands->best_cpe) {
+    bands->best_cpe[task] = best_cpe;
+  }
+}
+
+static void conv_pixel(const energy_func *fn, const gray_image *in, energymap *out,
+                       const gray_image *bias, size_t i, size_t j) {
+  size_t hh = in->height;
+  size_t ww = in->width;
+  size_t khh = KERNEL_HEIGHT;
+
+  size_t i0;
+  if      (i < khh/2)      i0 = 0;
+  else if (i > hh-khh/2-1) i0 = hh-khh-1;
+  else                     i0 = i-khh/2;
+
+  size_t j0 = conv_origin(j, ww);
+
+  enval energy = fn->pixel(&GET_PIXEL(in, i0+0, j0), &GET_PIXEL(in, i0+1, j0),
+                           &GET_PIXEL(in, i0+2, j0));
+  if (bias) {
+    energy = bias_pixel(energy, GET_PIXEL(bias, i, j));
+  }
+  GET_PIXEL(out, i, j) = energy;
+}
+
+/**
+ * @brief Leftmost column of the kernel window for column j.
+ */
+static size_t conv_origin(size_t j, size_t ww) {
+  size_t kww = KERNEL_WIDTH;
+
+  if      (j < kww/2)      return 0;
+  else if (j > ww-kww/2-1) return ww-kww-1;
+  else                     return j-kww/2;
+}
+
+/**
+ * @brief conv_pixel for the columns [j0, j1) of a row with gaps in it.
+ *
+ * The pixels under the kernels are gathered through the gaps into a small
+ * dense window first, so each row only has to walk its gaps once.
+ */
+static void conv_row_gaps(const energy_func *fn, const gray_image *in, energymap *out,
+                          const gray_image *bias, size_t i, size_t j0, size_t j1,
+                          const seam_gaps *gaps) {
   size_t hh = in->height;
   size_t ww = in->width;
   size_t khh = KERNEL_HEIGHT;
   size_t kww = KERNEL_WIDTH;
 
+  // the partial recompute never asks for more than this
+  enum { MAX_SPAN = 16 };
+  assert(j1 > j0 && j1 - j0 <= MAX_SPAN - kww - 1);
+
   size_t i0;
   if      (i < khh/2)      i0 = 0;
   else if (i > hh-khh/2-1) i0 = hh-khh-1;
   else                     i0 = i-khh/2;
 
-  size_t j0;
-  if      (j < kww/2)      j0 = 0;
-  else if (j > ww-kww/2-1) j0 = ww-kww-1;
-  else                     j0 = j-kww/2;
-
-  enval resultx0 = GET_PIXEL(in, i0+0, j0+0) * GET_PIXEL(&KERNEL_X, 0, 0);
-  enval resulty0 = GET_PIXEL(in, i0+0, j0+0) * GET_PIXEL(&KERNEL_Y, 0, 0);
-  enval resultx1 = GET_PIXEL(in, i0+0, j0+1) * GET_PIXEL(&KERNEL_X, 0, 1);
-  enval resultx2 = GET_PIXEL(in, i0+0, j0+2) * GET_PIXEL(&KERNEL_X, 0, 2);
-  enval resulty2 = GET_PIXEL(in, i0+0, j0+2) * GET_PIXEL(&KERNEL_Y, 0, 2);
-  enval resulty3 = GET_PIXEL(in, i0+1, j0+0) * GET_PIXEL(&KERNEL_Y, 1, 0);
-  enval resulty5 = GET_PIXEL(in, i0+1, j0+2) * GET_PIXEL(&KERNEL_Y, 1, 2);
-  enval resultx6 = GET_PIXEL(in, i0+2, j0+0) * GET_PIXEL(&KERNEL_X, 2, 0);
-  enval resulty6 = GET_PIXEL(in, i0+2, j0+0) * GET_PIXEL(&KERNEL_Y, 2, 0);
-  enval resultx7 = GET_PIXEL(in, i0+2, j0+1) * GET_PIXEL(&KERNEL_X, 2, 1);
-  enval resultx8 = GET_PIXEL(in, i0+2, j0+2) * GET_PIXEL(&KERNEL_X, 2, 2);
-  enval resulty8 = GET_PIXEL(in, i0+2, j0+2) * GET_PIXEL(&KERNEL_Y, 2, 2);
-
-  enval resultx = (resultx0 + resultx1) + (resultx2 + resultx6) + (resultx7 + resultx8);
-  enval resulty = (resulty0 + resulty2) + (resulty3 + resulty5) + (resulty6 + resulty8);
-
-  resultx = abs(resultx);
-  resulty = abs(resulty);
-
-  resultx /= KERNEL_X.magnitude*2;
-  resulty /= KERNEL_Y.magnitude*2;
-
-  GET_PIXEL(out, i, j) = resultx + resulty;
+  // columns of the image covered by all of the kernels
+  size_t w0 = ww;
+  size_t w1 = 0;
+  for (size_t j = j0; j < j1; j++) {
+    size_t origin = conv_origin(j, ww);
+    if (origin < w0) w0 = origin;
+    if (origin + kww > w1) w1 = origin + kww;
+  }
+
+  size_t cols[MAX_SPAN];
+  pixval window[3][MAX_SPAN];
+  for (size_t r = 0; r < khh; r++) {
+    gaps_span(gaps, i0+r, w0, w1-w0, cols);
+    for (size_t c = 0; c < w1-w0; c++) {
+      window[r][c] = GET_PIXEL(in, i0+r, cols[c]);
+    }
+  }
+
+  gaps_span(gaps, i, j0, j1-j0, cols);
+  for (size_t j = j0; j < j1; j++) {
+    size_t origin = conv_origin(j, ww) - w0;
+    enval energy = fn->pixel(&window[0][origin], &window[1][origin], &window[2][origin]);
+    if (bias) {
+      energy = bias_pixel(energy, GET_PIXEL(bias, i, cols[j-j0]));
+    }
+    GET_PIXEL(out, i, cols[j-j0]) = energy;
+  }
 }
 
-static double conv_pixel_vec(const gray_image *in, energymap *out, size_t i, size_t j, size_t len) {
+static double conv_pixel_vec(const energy_func *fn, const gray_image *in, energymap *out,
+                             const gray_image *bias, size_t i, size_t j, size_t len) {
   assert(len > 0);
   assert(IS_IMAGE(in));
   assert(IS_IMAGE(out));
@@ -162,566 +322,535 @@ static double conv_pixel_vec(const gray_image *in, energymap *out, size_t i, siz
   const size_t kww = KERNEL_WIDTH;
   const size_t khh = KERNEL_HEIGHT;
 
-  const size_t vec_width = 8;
-
   const size_t j0 = j;
   const size_t j1 = j0 + len;
 
   // if we're on the top or bottom edge, don't vectorize
   if (i < khh/2 || i > hh-khh/2-1) {
     for (; j < j1; j++) {
-      conv_pixel(in, out, i, j);
+      conv_pixel(fn, in, out, bias, i, j);
     }
 
   } else {
     // do the left edge
     for (; j < j1 && j < kww/2; j++) {
-      conv_pixel(in, out, i, j);
+      conv_pixel(fn, in, out, bias, i, j);
     }
 
-    pixval *upper = &GET_PIXEL(in, i-1, j-1);
-    pixval *mid   = &GET_PIXEL(in, i  , j-1);
-    pixval *lower = &GET_PIXEL(in, i+1, j-1);
+    const pixval *upper = &GET_PIXEL(in, i-1, j-1);
+    const pixval *mid   = &GET_PIXEL(in, i  , j-1);
+    const pixval *lower = &GET_PIXEL(in, i+1, j-1);
+    const pixval *bias_row = bias ? &GET_PIXEL(bias, i, j) : NULL;
     enval *res = &GET_PIXEL(out, i, j);
 
-    uint64_t start = __rdtsc();
-    size_t elts = 0;
+    // every column short of the last has all of its neighbours
+    size_t jn = j1 < ww-kww/2 ? j1 : ww-kww/2;
+    size_t n = j < jn ? jn - j : 0;
 
     // do the middle
-    for (; j+8*vec_width <= j1 && j+8*vec_width < ww-kww/2; j += 8*vec_width) {
-      {
-      // load the image pixel values
-      __m256i pixvals00 = LOAD_EIGHT_UNSIGNED_BYTES(upper+0);
-      __m256i pixvals01 = LOAD_EIGHT_UNSIGNED_BYTES(upper+1);
-      __m256i pixvals02 = LOAD_EIGHT_UNSIGNED_BYTES(upper+2);
-      __m256i pixvals10 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +0);
-      __m256i pixvals12 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +2);
-      __m256i pixvals20 = LOAD_EIGHT_UNSIGNED_BYTES(lower+0);
-      __m256i pixvals21 = LOAD_EIGHT_UNSIGNED_BYTES(lower+1);
-      __m256i pixvals22 = LOAD_EIGHT_UNSIGNED_BYTES(lower+2);
-
-      // increment pointer values for next iteration
-      upper += vec_width;
-      mid   += vec_width;
-      lower += vec_width;
-
-      /* ----------------------------------------------------------------------
-       * The x and y sobel kernel, in 4 adds, 5 subtracts, and 2 shifts
-       * ---------------------------------------------------------------------- */
-
-      // initialize the results with the values they independently use
-      __m256i resultx = _mm256_sub_epi32(pixvals21, pixvals01);         // x = 21-01
-      __m256i resulty = _mm256_sub_epi32(pixvals12, pixvals10);         // y = 12-10
-
-      // use shifts here to do the x2 to reduce pressure on uop port 5
-      resultx = _mm256_slli_epi32(resultx, 1);                          // x *= 2
-      resulty = _mm256_slli_epi32(resulty, 1);                          // y *= 2
-
-      // the top left and bottom right corners are shared, so only add them once
-      __m256i shared_corners = _mm256_sub_epi32(pixvals22, pixvals00);  // sc = 22-00
-
-      // add in the shared corners
-      resultx = _mm256_add_epi32(resultx, shared_corners);              // x += sc
-      resulty = _mm256_add_epi32(resulty, shared_corners);              // y += sc
-
-      // add together the other two corners for each kernel
-      __m256i x_corners = _mm256_sub_epi32(pixvals20, pixvals02);       // xc = 20-02
-      __m256i y_corners = _mm256_sub_epi32(pixvals02, pixvals20);       // yc = 02-20
-
-      // and their own corners
-      resultx = _mm256_add_epi32(resultx, x_corners);                   // x += xc
-      resulty = _mm256_add_epi32(resulty, y_corners);                   // y += yc
-
-      /* ----------------------------------------------------------------------
-       * The sobel kernel has been applied:
-       *   x = (21-01)*2 + (22-00) + (20-02)
-       *   y = (12-10)*2 + (22-00) + (02-20)
-       * ---------------------------------------------------------------------- */
-
-      // take their magnitude
-      resultx = _mm256_abs_epi32(resultx);
-      resulty = _mm256_abs_epi32(resulty);
-
-      // divide by kernel magnitude * 2
-      resultx = _mm256_srai_epi32(resultx, 4);
-      resulty = _mm256_srai_epi32(resulty, 4);
-
-      // sum x and y kernel results
-      __m256i result = _mm256_add_epi32(resultx, resulty);
-
-      // save it
-      _mm256_storeu_si256((__m256i *)res, result);
-      res += vec_width;
-      elts += vec_width;
-      }
-      {
-      // load the image pixel values
-      __m256i pixvals00 = LOAD_EIGHT_UNSIGNED_BYTES(upper+0);
-      __m256i pixvals01 = LOAD_EIGHT_UNSIGNED_BYTES(upper+1);
-      __m256i pixvals02 = LOAD_EIGHT_UNSIGNED_BYTES(upper+2);
-      __m256i pixvals10 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +0);
-      __m256i pixvals12 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +2);
-      __m256i pixvals20 = LOAD_EIGHT_UNSIGNED_BYTES(lower+0);
-      __m256i pixvals21 = LOAD_EIGHT_UNSIGNED_BYTES(lower+1);
-      __m256i pixvals22 = LOAD_EIGHT_UNSIGNED_BYTES(lower+2);
-
-      // increment pointer values for next iteration
-      upper += vec_width;
-      mid   += vec_width;
-      lower += vec_width;
-
-      /* ----------------------------------------------------------------------
-       * The x and y sobel kernel, in 4 adds, 5 subtracts, and 2 shifts
-       * ---------------------------------------------------------------------- */
-
-      // initialize the results with the values they independently use
-      __m256i resultx = _mm256_sub_epi32(pixvals21, pixvals01);         // x = 21-01
-      __m256i resulty = _mm256_sub_epi32(pixvals12, pixvals10);         // y = 12-10
-
-      // use shifts here to do the x2 to reduce pressure on uop port 5
-      resultx = _mm256_slli_epi32(resultx, 1);                          // x *= 2
-      resulty = _mm256_slli_epi32(resulty, 1);                          // y *= 2
-
-      // the top left and bottom right corners are shared, so only add them once
-      __m256i shared_corners = _mm256_sub_epi32(pixvals22, pixvals00);  // sc = 22-00
-
-      // add in the shared corners
-      resultx = _mm256_add_epi32(resultx, shared_corners);              // x += sc
-      resulty = _mm256_add_epi32(resulty, shared_corners);              // y += sc
-
-      // add together the other two corners for each kernel
-      __m256i x_corners = _mm256_sub_epi32(pixvals20, pixvals02);       // xc = 20-02
-      __m256i y_corners = _mm256_sub_epi32(pixvals02, pixvals20);       // yc = 02-20
-
-      // and their own corners
-      resultx = _mm256_add_epi32(resultx, x_corners);                   // x += xc
-      resulty = _mm256_add_epi32(resulty, y_corners);                   // y += yc
-
-      /* ----------------------------------------------------------------------
-       * The sobel kernel has been applied:
-       *   x = (21-01)*2 + (22-00) + (20-02)
-       *   y = (12-10)*2 + (22-00) + (02-20)
-       * ---------------------------------------------------------------------- */
-
-      // take their magnitude
-      resultx = _mm256_abs_epi32(resultx);
-      resulty = _mm256_abs_epi32(resulty);
-
-      // divide by kernel magnitude * 2
-      resultx = _mm256_srai_epi32(resultx, 4);
-      resulty = _mm256_srai_epi32(resulty, 4);
-
-      // sum x and y kernel results
-      __m256i result = _mm256_add_epi32(resultx, resulty);
-
-      // save it
-      _mm256_storeu_si256((__m256i *)res, result);
-      res += vec_width;
-      elts += vec_width;
-      }
-      {
-      // load the image pixel values
-      __m256i pixvals00 = LOAD_EIGHT_UNSIGNED_BYTES(upper+0);
-      __m256i pixvals01 = LOAD_EIGHT_UNSIGNED_BYTES(upper+1);
-      __m256i pixvals02 = LOAD_EIGHT_UNSIGNED_BYTES(upper+2);
-      __m256i pixvals10 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +0);
-      __m256i pixvals12 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +2);
-      __m256i pixvals20 = LOAD_EIGHT_UNSIGNED_BYTES(lower+0);
-      __m256i pixvals21 = LOAD_EIGHT_UNSIGNED_BYTES(lower+1);
-      __m256i pixvals22 = LOAD_EIGHT_UNSIGNED_BYTES(lower+2);
-
-      // increment pointer values for next iteration
-      upper += vec_width;
-      mid   += vec_width;
-      lower += vec_width;
-
-      /* ----------------------------------------------------------------------
-       * The x and y sobel kernel, in 4 adds, 5 subtracts, and 2 shifts
-       * ---------------------------------------------------------------------- */
-
-      // initialize the results with the values they independently use
-      __m256i resultx = _mm256_sub_epi32(pixvals21, pixvals01);         // x = 21-01
-      __m256i resulty = _mm256_sub_epi32(pixvals12, pixvals10);         // y = 12-10
-
-      // use shifts here to do the x2 to reduce pressure on uop port 5
-      resultx = _mm256_slli_epi32(resultx, 1);                          // x *= 2
-      resulty = _mm256_slli_epi32(resulty, 1);                          // y *= 2
-
-      // the top left and bottom right corners are shared, so only add them once
-      __m256i shared_corners = _mm256_sub_epi32(pixvals22, pixvals00);  // sc = 22-00
-
-      // add in the shared corners
-      resultx = _mm256_add_epi32(resultx, shared_corners);              // x += sc
-      resulty = _mm256_add_epi32(resulty, shared_corners);              // y += sc
-
-      // add together the other two corners for each kernel
-      __m256i x_corners = _mm256_sub_epi32(pixvals20, pixvals02);       // xc = 20-02
-      __m256i y_corners = _mm256_sub_epi32(pixvals02, pixvals20);       // yc = 02-20
-
-      // and their own corners
-      resultx = _mm256_add_epi32(resultx, x_corners);                   // x += xc
-      resulty = _mm256_add_epi32(resulty, y_corners);                   // y += yc
-
-      /* ----------------------------------------------------------------------
-       * The sobel kernel has been applied:
-       *   x = (21-01)*2 + (22-00) + (20-02)
-       *   y = (12-10)*2 + (22-00) + (02-20)
-       * ---------------------------------------------------------------------- */
-
-      // take their magnitude
-      resultx = _mm256_abs_epi32(resultx);
-      resulty = _mm256_abs_epi32(resulty);
-
-      // divide by kernel magnitude * 2
-      resultx = _mm256_srai_epi32(resultx, 4);
-      resulty = _mm256_srai_epi32(resulty, 4);
-
-      // sum x and y kernel results
-      __m256i result = _mm256_add_epi32(resultx, resulty);
-
-      // save it
-      _mm256_storeu_si256((__m256i *)res, result);
-      res += vec_width;
-      elts += vec_width;
-      }
-      {
-      // load the image pixel values
-      __m256i pixvals00 = LOAD_EIGHT_UNSIGNED_BYTES(upper+0);
-      __m256i pixvals01 = LOAD_EIGHT_UNSIGNED_BYTES(upper+1);
-      __m256i pixvals02 = LOAD_EIGHT_UNSIGNED_BYTES(upper+2);
-      __m256i pixvals10 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +0);
-      __m256i pixvals12 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +2);
-      __m256i pixvals20 = LOAD_EIGHT_UNSIGNED_BYTES(lower+0);
-      __m256i pixvals21 = LOAD_EIGHT_UNSIGNED_BYTES(lower+1);
-      __m256i pixvals22 = LOAD_EIGHT_UNSIGNED_BYTES(lower+2);
-
-      // increment pointer values for next iteration
-      upper += vec_width;
-      mid   += vec_width;
-      lower += vec_width;
-
-      /* ----------------------------------------------------------------------
-       * The x and y sobel kernel, in 4 adds, 5 subtracts, and 2 shifts
-       * ---------------------------------------------------------------------- */
-
-      // initialize the results with the values they independently use
-      __m256i resultx = _mm256_sub_epi32(pixvals21, pixvals01);         // x = 21-01
-      __m256i resulty = _mm256_sub_epi32(pixvals12, pixvals10);         // y = 12-10
-
-      // use shifts here to do the x2 to reduce pressure on uop port 5
-      resultx = _mm256_slli_epi32(resultx, 1);                          // x *= 2
-      resulty = _mm256_slli_epi32(resulty, 1);                          // y *= 2
-
-      // the top left and bottom right corners are shared, so only add them once
-      __m256i shared_corners = _mm256_sub_epi32(pixvals22, pixvals00);  // sc = 22-00
-
-      // add in the shared corners
-      resultx = _mm256_add_epi32(resultx, shared_corners);              // x += sc
-      resulty = _mm256_add_epi32(resulty, shared_corners);              // y += sc
-
-      // add together the other two corners for each kernel
-      __m256i x_corners = _mm256_sub_epi32(pixvals20, pixvals02);       // xc = 20-02
-      __m256i y_corners = _mm256_sub_epi32(pixvals02, pixvals20);       // yc = 02-20
-
-      // and their own corners
-      resultx = _mm256_add_epi32(resultx, x_corners);                   // x += xc
-      resulty = _mm256_add_epi32(resulty, y_corners);                   // y += yc
-
-      /* ----------------------------------------------------------------------
-       * The sobel kernel has been applied:
-       *   x = (21-01)*2 + (22-00) + (20-02)
-       *   y = (12-10)*2 + (22-00) + (02-20)
-       * ---------------------------------------------------------------------- */
-
-      // take their magnitude
-      resultx = _mm256_abs_epi32(resultx);
-      resulty = _mm256_abs_epi32(resulty);
-
-      // divide by kernel magnitude * 2
-      resultx = _mm256_srai_epi32(resultx, 4);
-      resulty = _mm256_srai_epi32(resulty, 4);
-
-      // sum x and y kernel results
-      __m256i result = _mm256_add_epi32(resultx, resulty);
-
-      // save it
-      _mm256_storeu_si256((__m256i *)res, result);
-      res += vec_width;
-      elts += vec_width;
-      }
-      {
-      // load the image pixel values
-      __m256i pixvals00 = LOAD_EIGHT_UNSIGNED_BYTES(upper+0);
-      __m256i pixvals01 = LOAD_EIGHT_UNSIGNED_BYTES(upper+1);
-      __m256i pixvals02 = LOAD_EIGHT_UNSIGNED_BYTES(upper+2);
-      __m256i pixvals10 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +0);
-      __m256i pixvals12 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +2);
-      __m256i pixvals20 = LOAD_EIGHT_UNSIGNED_BYTES(lower+0);
-      __m256i pixvals21 = LOAD_EIGHT_UNSIGNED_BYTES(lower+1);
-      __m256i pixvals22 = LOAD_EIGHT_UNSIGNED_BYTES(lower+2);
-
-      // increment pointer values for next iteration
-      upper += vec_width;
-      mid   += vec_width;
-      lower += vec_width;
-
-      /* ----------------------------------------------------------------------
-       * The x and y sobel kernel, in 4 adds, 5 subtracts, and 2 shifts
-       * ---------------------------------------------------------------------- */
-
-      // initialize the results with the values they independently use
-      __m256i resultx = _mm256_sub_epi32(pixvals21, pixvals01);         // x = 21-01
-      __m256i resulty = _mm256_sub_epi32(pixvals12, pixvals10);         // y = 12-10
-
-      // use shifts here to do the x2 to reduce pressure on uop port 5
-      resultx = _mm256_slli_epi32(resultx, 1);                          // x *= 2
-      resulty = _mm256_slli_epi32(resulty, 1);                          // y *= 2
-
-      // the top left and bottom right corners are shared, so only add them once
-      __m256i shared_corners = _mm256_sub_epi32(pixvals22, pixvals00);  // sc = 22-00
-
-      // add in the shared corners
-      resultx = _mm256_add_epi32(resultx, shared_corners);              // x += sc
-      resulty = _mm256_add_epi32(resulty, shared_corners);              // y += sc
-
-      // add together the other two corners for each kernel
-      __m256i x_corners = _mm256_sub_epi32(pixvals20, pixvals02);       // xc = 20-02
-      __m256i y_corners = _mm256_sub_epi32(pixvals02, pixvals20);       // yc = 02-20
-
-      // and their own corners
-      resultx = _mm256_add_epi32(resultx, x_corners);                   // x += xc
-      resulty = _mm256_add_epi32(resulty, y_corners);                   // y += yc
-
-      /* ----------------------------------------------------------------------
-       * The sobel kernel has been applied:
-       *   x = (21-01)*2 + (22-00) + (20-02)
-       *   y = (12-10)*2 + (22-00) + (02-20)
-       * ---------------------------------------------------------------------- */
-
-      // take their magnitude
-      resultx = _mm256_abs_epi32(resultx);
-      resulty = _mm256_abs_epi32(resulty);
-
-      // divide by kernel magnitude * 2
-      resultx = _mm256_srai_epi32(resultx, 4);
-      resulty = _mm256_srai_epi32(resulty, 4);
-
-      // sum x and y kernel results
-      __m256i result = _mm256_add_epi32(resultx, resulty);
-
-      // save it
-      _mm256_storeu_si256((__m256i *)res, result);
-      res += vec_width;
-      elts += vec_width;
-      }
-      {
-      // load the image pixel values
-      __m256i pixvals00 = LOAD_EIGHT_UNSIGNED_BYTES(upper+0);
-      __m256i pixvals01 = LOAD_EIGHT_UNSIGNED_BYTES(upper+1);
-      __m256i pixvals02 = LOAD_EIGHT_UNSIGNED_BYTES(upper+2);
-      __m256i pixvals10 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +0);
-      __m256i pixvals12 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +2);
-      __m256i pixvals20 = LOAD_EIGHT_UNSIGNED_BYTES(lower+0);
-      __m256i pixvals21 = LOAD_EIGHT_UNSIGNED_BYTES(lower+1);
-      __m256i pixvals22 = LOAD_EIGHT_UNSIGNED_BYTES(lower+2);
-
-      // increment pointer values for next iteration
-      upper += vec_width;
-      mid   += vec_width;
-      lower += vec_width;
-
-      /* ----------------------------------------------------------------------
-       * The x and y sobel kernel, in 4 adds, 5 subtracts, and 2 shifts
-       * ---------------------------------------------------------------------- */
-
-      // initialize the results with the values they independently use
-      __m256i resultx = _mm256_sub_epi32(pixvals21, pixvals01);         // x = 21-01
-      __m256i resulty = _mm256_sub_epi32(pixvals12, pixvals10);         // y = 12-10
-
-      // use shifts here to do the x2 to reduce pressure on uop port 5
-      resultx = _mm256_slli_epi32(resultx, 1);                          // x *= 2
-      resulty = _mm256_slli_epi32(resulty, 1);                          // y *= 2
-
-      // the top left and bottom right corners are shared, so only add them once
-      __m256i shared_corners = _mm256_sub_epi32(pixvals22, pixvals00);  // sc = 22-00
-
-      // add in the shared corners
-      resultx = _mm256_add_epi32(resultx, shared_corners);              // x += sc
-      resulty = _mm256_add_epi32(resulty, shared_corners);              // y += sc
-
-      // add together the other two corners for each kernel
-      __m256i x_corners = _mm256_sub_epi32(pixvals20, pixvals02);       // xc = 20-02
-      __m256i y_corners = _mm256_sub_epi32(pixvals02, pixvals20);       // yc = 02-20
-
-      // and their own corners
-      resultx = _mm256_add_epi32(resultx, x_corners);                   // x += xc
-      resulty = _mm256_add_epi32(resulty, y_corners);                   // y += yc
-
-      /* ----------------------------------------------------------------------
-       * The sobel kernel has been applied:
-       *   x = (21-01)*2 + (22-00) + (20-02)
-       *   y = (12-10)*2 + (22-00) + (02-20)
-       * ---------------------------------------------------------------------- */
-
-      // take their magnitude
-      resultx = _mm256_abs_epi32(resultx);
-      resulty = _mm256_abs_epi32(resulty);
-
-      // divide by kernel magnitude * 2
-      resultx = _mm256_srai_epi32(resultx, 4);
-      resulty = _mm256_srai_epi32(resulty, 4);
-
-      // sum x and y kernel results
-      __m256i result = _mm256_add_epi32(resultx, resulty);
-
-      // save it
-      _mm256_storeu_si256((__m256i *)res, result);
-      res += vec_width;
-      elts += vec_width;
-      }
-      {
-      // load the image pixel values
-      __m256i pixvals00 = LOAD_EIGHT_UNSIGNED_BYTES(upper+0);
-      __m256i pixvals01 = LOAD_EIGHT_UNSIGNED_BYTES(upper+1);
-      __m256i pixvals02 = LOAD_EIGHT_UNSIGNED_BYTES(upper+2);
-      __m256i pixvals10 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +0);
-      __m256i pixvals12 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +2);
-      __m256i pixvals20 = LOAD_EIGHT_UNSIGNED_BYTES(lower+0);
-      __m256i pixvals21 = LOAD_EIGHT_UNSIGNED_BYTES(lower+1);
-      __m256i pixvals22 = LOAD_EIGHT_UNSIGNED_BYTES(lower+2);
-
-      // increment pointer values for next iteration
-      upper += vec_width;
-      mid   += vec_width;
-      lower += vec_width;
-
-      /* ----------------------------------------------------------------------
-       * The x and y sobel kernel, in 4 adds, 5 subtracts, and 2 shifts
-       * ---------------------------------------------------------------------- */
-
-      // initialize the results with the values they independently use
-      __m256i resultx = _mm256_sub_epi32(pixvals21, pixvals01);         // x = 21-01
-      __m256i resulty = _mm256_sub_epi32(pixvals12, pixvals10);         // y = 12-10
-
-      // use shifts here to do the x2 to reduce pressure on uop port 5
-      resultx = _mm256_slli_epi32(resultx, 1);                          // x *= 2
-      resulty = _mm256_slli_epi32(resulty, 1);                          // y *= 2
-
-      // the top left and bottom right corners are shared, so only add them once
-      __m256i shared_corners = _mm256_sub_epi32(pixvals22, pixvals00);  // sc = 22-00
-
-      // add in the shared corners
-      resultx = _mm256_add_epi32(resultx, shared_corners);              // x += sc
-      resulty = _mm256_add_epi32(resulty, shared_corners);              // y += sc
-
-      // add together the other two corners for each kernel
-      __m256i x_corners = _mm256_sub_epi32(pixvals20, pixvals02);       // xc = 20-02
-      __m256i y_corners = _mm256_sub_epi32(pixvals02, pixvals20);       // yc = 02-20
-
-      // and their own corners
-      resultx = _mm256_add_epi32(resultx, x_corners);                   // x += xc
-      resulty = _mm256_add_epi32(resulty, y_corners);                   // y += yc
-
-      /* ----------------------------------------------------------------------
-       * The sobel kernel has been applied:
-       *   x = (21-01)*2 + (22-00) + (20-02)
-       *   y = (12-10)*2 + (22-00) + (02-20)
-       * ---------------------------------------------------------------------- */
-
-      // take their magnitude
-      resultx = _mm256_abs_epi32(resultx);
-      resulty = _mm256_abs_epi32(resulty);
-
-      // divide by kernel magnitude * 2
-      resultx = _mm256_srai_epi32(resultx, 4);
-      resulty = _mm256_srai_epi32(resulty, 4);
-
-      // sum x and y kernel results
-      __m256i result = _mm256_add_epi32(resultx, resulty);
-
-      // save it
-      _mm256_storeu_si256((__m256i *)res, result);
-      res += vec_width;
-      elts += vec_width;
-      }
-      {
-      // load the image pixel values
-      __m256i pixvals00 = LOAD_EIGHT_UNSIGNED_BYTES(upper+0);
-      __m256i pixvals01 = LOAD_EIGHT_UNSIGNED_BYTES(upper+1);
-      __m256i pixvals02 = LOAD_EIGHT_UNSIGNED_BYTES(upper+2);
-      __m256i pixvals10 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +0);
-      __m256i pixvals12 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +2);
-      __m256i pixvals20 = LOAD_EIGHT_UNSIGNED_BYTES(lower+0);
-      __m256i pixvals21 = LOAD_EIGHT_UNSIGNED_BYTES(lower+1);
-      __m256i pixvals22 = LOAD_EIGHT_UNSIGNED_BYTES(lower+2);
-
-      // increment pointer values for next iteration
-      upper += vec_width;
-      mid   += vec_width;
-      lower += vec_width;
-
-      /* ----------------------------------------------------------------------
-       * The x and y sobel kernel, in 4 adds, 5 subtracts, and 2 shifts
-       * ---------------------------------------------------------------------- */
-
-      // initialize the results with the values they independently use
-      __m256i resultx = _mm256_sub_epi32(pixvals21, pixvals01);         // x = 21-01
-      __m256i resulty = _mm256_sub_epi32(pixvals12, pixvals10);         // y = 12-10
-
-      // use shifts here to do the x2 to reduce pressure on uop port 5
-      resultx = _mm256_slli_epi32(resultx, 1);                          // x *= 2
-      resulty = _mm256_slli_epi32(resulty, 1);                          // y *= 2
-
-      // the top left and bottom right corners are shared, so only add them once
-      __m256i shared_corners = _mm256_sub_epi32(pixvals22, pixvals00);  // sc = 22-00
-
-      // add in the shared corners
-      resultx = _mm256_add_epi32(resultx, shared_corners);              // x += sc
-      resulty = _mm256_add_epi32(resulty, shared_corners);              // y += sc
-
-      // add together the other two corners for each kernel
-      __m256i x_corners = _mm256_sub_epi32(pixvals20, pixvals02);       // xc = 20-02
-      __m256i y_corners = _mm256_sub_epi32(pixvals02, pixvals20);       // yc = 02-20
-
-      // and their own corners
-      resultx = _mm256_add_epi32(resultx, x_corners);                   // x += xc
-      resulty = _mm256_add_epi32(resulty, y_corners);                   // y += yc
-
-      /* ----------------------------------------------------------------------
-       * The sobel kernel has been applied:
-       *   x = (21-01)*2 + (22-00) + (20-02)
-       *   y = (12-10)*2 + (22-00) + (02-20)
-       * ---------------------------------------------------------------------- */
-
-      // take their magnitude
-      resultx = _mm256_abs_epi32(resultx);
-      resulty = _mm256_abs_epi32(resulty);
-
-      // divide by kernel magnitude * 2
-      resultx = _mm256_srai_epi32(resultx, 4);
-      resulty = _mm256_srai_epi32(resulty, 4);
-
-      // sum x and y kernel results
-      __m256i result = _mm256_add_epi32(resultx, resulty);
-
-      // save it
-      _mm256_storeu_si256((__m256i *)res, result);
-      res += vec_width;
-      elts += vec_width;
-      }
-    }
-
+    uint64_t start = __rdtsc();
+    size_t elts = fn->span(upper, mid, lower, bias_row, res, n);
     uint64_t end = __rdtsc();
-    double cpe = ((double)(end-start)*3.8/3.2)/(double)elts;
+    j += elts;
+    // in cycles of the counter, which don't follow the core's clock
+    double cpe = (double)(end-start)/(double)elts;
     if (cpe < best_cpe) {
       best_cpe = cpe;
     }
 
     // do the right edge
     for (; j < j1 && j < ww; j++) {
-      conv_pixel(in, out, i, j);
+      conv_pixel(fn, in, out, bias, i, j);
     }
   }
 
   return best_cpe;
 }
+
+/**
+ * @brief Add a bias to an energy, keeping it between 0 and MAX_ENERGY.
+ */
+static enval bias_pixel(enval energy, pixval bias) {
+  int biased = (int)energy + (int)bias - BIAS_ZERO;
+  if (biased < 0) biased = 0;
+  if (biased > MAX_ENERGY) biased = MAX_ENERGY;
+  return (enval)biased;
+}
+
+/*
+ * Energies are below 128, so they're already signed bytes, and flipping the
+ * top bit of the biases takes off BIAS_ZERO. A signed saturating add then
+ * can't wrap, and the sum only has to be clamped to [0, MAX_ENERGY].
+ */
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i bias_epi8_avx512(__m512i energy, __m512i bias) {
+  __m512i biased = _mm512_adds_epi8(energy, _mm512_xor_si512(bias, _mm512_set1_epi8((char)BIAS_ZERO)));
+  biased = _mm512_max_epi8(biased, _mm512_setzero_si512());
+  return _mm512_min_epi8(biased, _mm512_set1_epi8(MAX_ENERGY));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i bias_epi8_avx2(__m256i energy, __m256i bias) {
+  __m256i biased = _mm256_adds_epi8(energy, _mm256_xor_si256(bias, _mm256_set1_epi8((char)BIAS_ZERO)));
+  biased = _mm256_max_epi8(biased, _mm256_setzero_si256());
+  return _mm256_min_epi8(biased, _mm256_set1_epi8(MAX_ENERGY));
+}
+
+static inline __m128i bias_epi8(__m128i energy, __m128i bias) {
+  __m128i biased = _mm_adds_epi8(energy, _mm_xor_si128(bias, _mm_set1_epi8((char)BIAS_ZERO)));
+  biased = _mm_max_epi8(biased, _mm_setzero_si128());
+  return _mm_min_epi8(biased, _mm_set1_epi8(MAX_ENERGY));
+}
+
+/**
+ * @brief The sobel gradient, the magnitude of each axis over 16.
+ */
+static enval sobel_pixel(const pixval *top, const pixval *mid, const pixval *bot) {
+  int resultx = (bot[1] - top[1])*2 + (bot[2] - top[0]) + (bot[0] - top[2]);
+  int resulty = (mid[2] - mid[0])*2 + (bot[2] - top[0]) + (top[2] - bot[0]);
+
+  return (enval)(abs(resultx)/16 + abs(resulty)/16);
+}
+
+static size_t sobel_span(const pixval *upper, const pixval *mid, const pixval *lower,
+                         const pixval *bias, enval *res, size_t n) {
+  switch (simd_get_level()) {
+    case SIMD_AVX512: return sobel_span_avx512(upper, mid, lower, bias, res, n);
+    case SIMD_AVX2:   return sobel_span_avx2(upper, mid, lower, bias, res, n);
+    case SIMD_SSE:    return sobel_span_sse(upper, mid, lower, bias, res, n);
+    default:          return 0;
+  }
+}
+
+/*
+ * The sums of the sobel kernels are at most 4*255 in magnitude, so all of the
+ * kernels work in 16 bit lanes, and narrow the results to bytes to store them.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static size_t sobel_span_avx512(const pixval *upper, const pixval *mid, const pixval *lower,
+                                const pixval *bias, enval *res, size_t n) {
+  const size_t vec_width = 32;
+
+  for (size_t k = 0; k < n; k += vec_width) {
+    // the last vector is masked rather than left for the scalar code
+    __mmask32 mask = (__mmask32)~0u;
+    if (n - k < vec_width) {
+      mask = (__mmask32)((1u << (n - k)) - 1);
+    }
+
+    __m512i pixvals00 = LOAD_32_UNSIGNED_BYTES(upper+k+0, mask);
+    __m512i pixvals01 = LOAD_32_UNSIGNED_BYTES(upper+k+1, mask);
+    __m512i pixvals02 = LOAD_32_UNSIGNED_BYTES(upper+k+2, mask);
+    __m512i pixvals10 = LOAD_32_UNSIGNED_BYTES(mid  +k+0, mask);
+    __m512i pixvals12 = LOAD_32_UNSIGNED_BYTES(mid  +k+2, mask);
+    __m512i pixvals20 = LOAD_32_UNSIGNED_BYTES(lower+k+0, mask);
+    __m512i pixvals21 = LOAD_32_UNSIGNED_BYTES(lower+k+1, mask);
+    __m512i pixvals22 = LOAD_32_UNSIGNED_BYTES(lower+k+2, mask);
+
+    // same order of operations as the avx2 kernel
+    __m512i resultx = _mm512_slli_epi16(_mm512_sub_epi16(pixvals21, pixvals01), 1);
+    __m512i resulty = _mm512_slli_epi16(_mm512_sub_epi16(pixvals12, pixvals10), 1);
+
+    __m512i shared_corners = _mm512_sub_epi16(pixvals22, pixvals00);
+    resultx = _mm512_add_epi16(resultx, shared_corners);
+    resulty = _mm512_add_epi16(resulty, shared_corners);
+
+    resultx = _mm512_add_epi16(resultx, _mm512_sub_epi16(pixvals20, pixvals02));
+    resulty = _mm512_add_epi16(resulty, _mm512_sub_epi16(pixvals02, pixvals20));
+
+    resultx = _mm512_srai_epi16(_mm512_abs_epi16(resultx), 4);
+    resulty = _mm512_srai_epi16(_mm512_abs_epi16(resulty), 4);
+    __m512i result = _mm512_add_epi16(resultx, resulty);
+
+    // narrow to enval, bias it and save it
+    __m256i energy = _mm512_cvtepi16_epi8(result);
+    if (bias) {
+      energy = bias_epi8_avx2(energy, _mm256_maskz_loadu_epi8(mask, bias+k));
+    }
+    _mm256_mask_storeu_epi8(res+k, mask, energy);
+  }
+
+  return n;
+}
+
+__attribute__((target("avx2")))
+static size_t sobel_span_avx2(const pixval *upper, const pixval *mid, const pixval *lower,
+                              const pixval *bias, enval *res, size_t n) {
+  const size_t vec_width = 16;
+  size_t k = 0;
+
+  for (; k+vec_width <= n; k += vec_width) {
+    // load the image pixel values
+    __m256i pixvals00 = LOAD_16_UNSIGNED_BYTES(upper+k+0);
+    __m256i pixvals01 = LOAD_16_UNSIGNED_BYTES(upper+k+1);
+    __m256i pixvals02 = LOAD_16_UNSIGNED_BYTES(upper+k+2);
+    __m256i pixvals10 = LOAD_16_UNSIGNED_BYTES(mid  +k+0);
+    __m256i pixvals12 = LOAD_16_UNSIGNED_BYTES(mid  +k+2);
+    __m256i pixvals20 = LOAD_16_UNSIGNED_BYTES(lower+k+0);
+    __m256i pixvals21 = LOAD_16_UNSIGNED_BYTES(lower+k+1);
+    __m256i pixvals22 = LOAD_16_UNSIGNED_BYTES(lower+k+2);
+
+    /* ----------------------------------------------------------------------
+     * The x and y sobel kernel, in 4 adds, 5 subtracts, and 2 shifts
+     * ---------------------------------------------------------------------- */
+
+    // initialize the results with the values they independently use
+    __m256i resultx = _mm256_sub_epi16(pixvals21, pixvals01);         // x = 21-01
+    __m256i resulty = _mm256_sub_epi16(pixvals12, pixvals10);         // y = 12-10
+
+    // use shifts here to do the x2 to reduce pressure on uop port 5
+    resultx = _mm256_slli_epi16(resultx, 1);                          // x *= 2
+    resulty = _mm256_slli_epi16(resulty, 1);                          // y *= 2
+
+    // the top left and bottom right corners are shared, so only add them once
+    __m256i shared_corners = _mm256_sub_epi16(pixvals22, pixvals00);  // sc = 22-00
+
+    // add in the shared corners
+    resultx = _mm256_add_epi16(resultx, shared_corners);              // x += sc
+    resulty = _mm256_add_epi16(resulty, shared_corners);              // y += sc
+
+    // add together the other two corners for each kernel
+    __m256i x_corners = _mm256_sub_epi16(pixvals20, pixvals02);       // xc = 20-02
+    __m256i y_corners = _mm256_sub_epi16(pixvals02, pixvals20);       // yc = 02-20
+
+    // and their own corners
+    resultx = _mm256_add_epi16(resultx, x_corners);                   // x += xc
+    resulty = _mm256_add_epi16(resulty, y_corners);                   // y += yc
+
+    /* ----------------------------------------------------------------------
+     * The sobel kernel has been applied:
+     *   x = (21-01)*2 + (22-00) + (20-02)
+     *   y = (12-10)*2 + (22-00) + (02-20)
+     * ---------------------------------------------------------------------- */
+
+    // take their magnitude
+    resultx = _mm256_abs_epi16(resultx);
+    resulty = _mm256_abs_epi16(resulty);
+
+    // divide by kernel magnitude * 2
+    resultx = _mm256_srai_epi16(resultx, 4);
+    resulty = _mm256_srai_epi16(resulty, 4);
+
+    // sum x and y kernel results
+    __m256i result = _mm256_add_epi16(resultx, resulty);
+
+    // narrow to enval, bias it and save it
+    __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(result),
+                                      _mm256_extracti128_si256(result, 1));
+    if (bias) {
+      packed = bias_epi8(packed, _mm_loadu_si128((const __m128i *)(bias+k)));
+    }
+    _mm_storeu_si128((__m128i *)(res+k), packed);
+  }
+
+  // the windows of the partial recompute are often narrower than a vector
+  return k + sobel_span_sse(upper+k, mid+k, lower+k, bias ? bias+k : NULL, res+k, n-k);
+}
+
+static size_t sobel_span_sse(const pixval *upper, const pixval *mid, const pixval *lower,
+                             const pixval *bias, enval *res, size_t n) {
+  const size_t vec_width = 8;
+  size_t k = 0;
+
+  for (; k+vec_width <= n; k += vec_width) {
+    __m128i pixvals00 = LOAD_EIGHT_UNSIGNED_BYTES(upper+k+0);
+    __m128i pixvals01 = LOAD_EIGHT_UNSIGNED_BYTES(upper+k+1);
+    __m128i pixvals02 = LOAD_EIGHT_UNSIGNED_BYTES(upper+k+2);
+    __m128i pixvals10 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +k+0);
+    __m128i pixvals12 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +k+2);
+    __m128i pixvals20 = LOAD_EIGHT_UNSIGNED_BYTES(lower+k+0);
+    __m128i pixvals21 = LOAD_EIGHT_UNSIGNED_BYTES(lower+k+1);
+    __m128i pixvals22 = LOAD_EIGHT_UNSIGNED_BYTES(lower+k+2);
+
+    // same order of operations as the avx2 kernel
+    __m128i resultx = _mm_slli_epi16(_mm_sub_epi16(pixvals21, pixvals01), 1);
+    __m128i resulty = _mm_slli_epi16(_mm_sub_epi16(pixvals12, pixvals10), 1);
+
+    __m128i shared_corners = _mm_sub_epi16(pixvals22, pixvals00);
+    resultx = _mm_add_epi16(resultx, shared_corners);
+    resulty = _mm_add_epi16(resulty, shared_corners);
+
+    resultx = _mm_add_epi16(resultx, _mm_sub_epi16(pixvals20, pixvals02));
+    resulty = _mm_add_epi16(resulty, _mm_sub_epi16(pixvals02, pixvals20));
+
+    resultx = _mm_srai_epi16(_mm_abs_epi16(resultx), 4);
+    resulty = _mm_srai_epi16(_mm_abs_epi16(resulty), 4);
+    __m128i result = _mm_add_epi16(resultx, resulty);
+
+    // narrow to enval, bias it and save it
+    __m128i packed = _mm_packus_epi16(result, result);
+    if (bias) {
+      packed = bias_epi8(packed, _mm_loadl_epi64((const __m128i *)(bias+k)));
+    }
+    _mm_storel_epi64((__m128i *)(res+k), packed);
+  }
+
+  return k;
+}
+
+/**
+ * @brief The differences with the pixels to the right and below, each
+ *        over 4.
+ */
+static enval gradient_pixel(const pixval *top, const pixval *mid, const pixval *bot) {
+  (void)top;
+  return (enval)(abs(mid[2] - mid[1])/4 + abs(bot[1] - mid[1])/4);
+}
+
+static size_t gradient_span(const pixval *upper, const pixval *mid, const pixval *lower,
+                            const pixval *bias, enval *res, size_t n) {
+  switch (simd_get_level()) {
+    case SIMD_AVX512: return gradient_span_avx512(upper, mid, lower, bias, res, n);
+    case SIMD_AVX2:   return gradient_span_avx2(upper, mid, lower, bias, res, n);
+    case SIMD_SSE:    return gradient_span_sse(upper, mid, lower, bias, res, n);
+    default:          return 0;
+  }
+}
+
+/*
+ * The gradient never needs more than a byte, so its kernels stay in 8 bit
+ * lanes and do twice the pixels a vector of the others. The difference of
+ * two bytes is whichever saturating subtract isn't zero, and the bytes are
+ * shifted two at a time with the bits that cross between them masked off.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static size_t gradient_span_avx512(const pixval *upper, const pixval *mid, const pixval *lower,
+                                   const pixval *bias, enval *res, size_t n) {
+  (void)upper;
+  const size_t vec_width = 64;
+  const __m512i low_bits = _mm512_set1_epi8(0x3f);
+
+  for (size_t k = 0; k < n; k += vec_width) {
+    __mmask64 mask = ~(__mmask64)0;
+    if (n - k < vec_width) {
+      mask = ((__mmask64)1 << (n - k)) - 1;
+    }
+
+    __m512i center = _mm512_maskz_loadu_epi8(mask, mid+k+1);
+    __m512i right = _mm512_maskz_loadu_epi8(mask, mid+k+2);
+    __m512i below = _mm512_maskz_loadu_epi8(mask, lower+k+1);
+
+    __m512i dx = _mm512_or_si512(_mm512_subs_epu8(right, center), _mm512_subs_epu8(center, right));
+    __m512i dy = _mm512_or_si512(_mm512_subs_epu8(below, center), _mm512_subs_epu8(center, below));
+    dx = _mm512_and_si512(_mm512_srli_epi16(dx, 2), low_bits);
+    dy = _mm512_and_si512(_mm512_srli_epi16(dy, 2), low_bits);
+
+    __m512i energy = _mm512_add_epi8(dx, dy);
+    if (bias) {
+      energy = bias_epi8_avx512(energy, _mm512_maskz_loadu_epi8(mask, bias+k));
+    }
+    _mm512_mask_storeu_epi8(res+k, mask, energy);
+  }
+
+  return n;
+}
+
+__attribute__((target("avx2")))
+static size_t gradient_span_avx2(const pixval *upper, const pixval *mid, const pixval *lower,
+                                 const pixval *bias, enval *res, size_t n) {
+  const size_t vec_width = 32;
+  const __m256i low_bits = _mm256_set1_epi8(0x3f);
+  size_t k = 0;
+
+  for (; k+vec_width <= n; k += vec_width) {
+    __m256i center = _mm256_loadu_si256((const __m256i *)(mid+k+1));
+    __m256i right = _mm256_loadu_si256((const __m256i *)(mid+k+2));
+    __m256i below = _mm256_loadu_si256((const __m256i *)(lower+k+1));
+
+    __m256i dx = _mm256_or_si256(_mm256_subs_epu8(right, center), _mm256_subs_epu8(center, right));
+    __m256i dy = _mm256_or_si256(_mm256_subs_epu8(below, center), _mm256_subs_epu8(center, below));
+    dx = _mm256_and_si256(_mm256_srli_epi16(dx, 2), low_bits);
+    dy = _mm256_and_si256(_mm256_srli_epi16(dy, 2), low_bits);
+
+    __m256i energy = _mm256_add_epi8(dx, dy);
+    if (bias) {
+      energy = bias_epi8_avx2(energy, _mm256_loadu_si256((const __m256i *)(bias+k)));
+    }
+    _mm256_storeu_si256((__m256i *)(res+k), energy);
+  }
+
+  return k + gradient_span_sse(upper+k, mid+k, lower+k, bias ? bias+k : NULL, res+k, n-k);
+}
+
+static size_t gradient_span_sse(const pixval *upper, const pixval *mid, const pixval *lower,
+                                const pixval *bias, enval *res, size_t n) {
+  (void)upper;
+  const size_t vec_width = 16;
+  const __m128i low_bits = _mm_set1_epi8(0x3f);
+  size_t k = 0;
+
+  for (; k+vec_width <= n; k += vec_width) {
+    __m128i center = _mm_loadu_si128((const __m128i *)(mid+k+1));
+    __m128i right = _mm_loadu_si128((const __m128i *)(mid+k+2));
+    __m128i below = _mm_loadu_si128((const __m128i *)(lower+k+1));
+
+    __m128i dx = _mm_or_si128(_mm_subs_epu8(right, center), _mm_subs_epu8(center, right));
+    __m128i dy = _mm_or_si128(_mm_subs_epu8(below, center), _mm_subs_epu8(center, below));
+    dx = _mm_and_si128(_mm_srli_epi16(dx, 2), low_bits);
+    dy = _mm_and_si128(_mm_srli_epi16(dy, 2), low_bits);
+
+    __m128i energy = _mm_add_epi8(dx, dy);
+    if (bias) {
+      energy = bias_epi8(energy, _mm_loadu_si128((const __m128i *)(bias+k)));
+    }
+    _mm_storeu_si128((__m128i *)(res+k), energy);
+  }
+
+  return k;
+}
+
+/**
+ * @brief The scharr gradient, with weights 3, 10, 3 across each axis, and
+ *        the magnitude of each axis over 64.
+ */
+static enval scharr_pixel(const pixval *top, const pixval *mid, const pixval *bot) {
+  int resultx = (bot[1] - top[1])*10 + ((bot[2] - top[0]) + (bot[0] - top[2]))*3;
+  int resulty = (mid[2] - mid[0])*10 + ((bot[2] - top[0]) + (top[2] - bot[0]))*3;
+
+  return (enval)(abs(resultx)/64 + abs(resulty)/64);
+}
+
+static size_t scharr_span(const pixval *upper, const pixval *mid, const pixval *lower,
+                          const pixval *bias, enval *res, size_t n) {
+  switch (simd_get_level()) {
+    case SIMD_AVX512: return scharr_span_avx512(upper, mid, lower, bias, res, n);
+    case SIMD_AVX2:   return scharr_span_avx2(upper, mid, lower, bias, res, n);
+    case SIMD_SSE:    return scharr_span_sse(upper, mid, lower, bias, res, n);
+    default:          return 0;
+  }
+}
+
+/*
+ * The scharr kernels sum to at most 16*255 in magnitude, which still fits
+ * in 16 bit lanes. They share their corners the same way the sobel kernels
+ * do, and multiply rather than shift for the weights.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static size_t scharr_span_avx512(const pixval *upper, const pixval *mid, const pixval *lower,
+                                 const pixval *bias, enval *res, size_t n) {
+  const size_t vec_width = 32;
+  const __m512i ten = _mm512_set1_epi16(10);
+  const __m512i three = _mm512_set1_epi16(3);
+
+  for (size_t k = 0; k < n; k += vec_width) {
+    __mmask32 mask = (__mmask32)~0u;
+    if (n - k < vec_width) {
+      mask = (__mmask32)((1u << (n - k)) - 1);
+    }
+
+    __m512i pixvals00 = LOAD_32_UNSIGNED_BYTES(upper+k+0, mask);
+    __m512i pixvals01 = LOAD_32_UNSIGNED_BYTES(upper+k+1, mask);
+    __m512i pixvals02 = LOAD_32_UNSIGNED_BYTES(upper+k+2, mask);
+    __m512i pixvals10 = LOAD_32_UNSIGNED_BYTES(mid  +k+0, mask);
+    __m512i pixvals12 = LOAD_32_UNSIGNED_BYTES(mid  +k+2, mask);
+    __m512i pixvals20 = LOAD_32_UNSIGNED_BYTES(lower+k+0, mask);
+    __m512i pixvals21 = LOAD_32_UNSIGNED_BYTES(lower+k+1, mask);
+    __m512i pixvals22 = LOAD_32_UNSIGNED_BYTES(lower+k+2, mask);
+
+    __m512i resultx = _mm512_mullo_epi16(_mm512_sub_epi16(pixvals21, pixvals01), ten);
+    __m512i resulty = _mm512_mullo_epi16(_mm512_sub_epi16(pixvals12, pixvals10), ten);
+
+    __m512i shared_corners = _mm512_sub_epi16(pixvals22, pixvals00);
+    __m512i other_corners = _mm512_sub_epi16(pixvals20, pixvals02);
+    resultx = _mm512_add_epi16(resultx, _mm512_mullo_epi16(
+        _mm512_add_epi16(shared_corners, other_corners), three));
+    resulty = _mm512_add_epi16(resulty, _mm512_mullo_epi16(
+        _mm512_sub_epi16(shared_corners, other_corners), three));
+
+    resultx = _mm512_srai_epi16(_mm512_abs_epi16(resultx), 6);
+    resulty = _mm512_srai_epi16(_mm512_abs_epi16(resulty), 6);
+    __m512i result = _mm512_add_epi16(resultx, resulty);
+
+    __m256i energy = _mm512_cvtepi16_epi8(result);
+    if (bias) {
+      energy = bias_epi8_avx2(energy, _mm256_maskz_loadu_epi8(mask, bias+k));
+    }
+    _mm256_mask_storeu_epi8(res+k, mask, energy);
+  }
+
+  return n;
+}
+
+__attribute__((target("avx2")))
+static size_t scharr_span_avx2(const pixval *upper, const pixval *mid, const pixval *lower,
+                               const pixval *bias, enval *res, size_t n) {
+  const size_t vec_width = 16;
+  const __m256i ten = _mm256_set1_epi16(10);
+  const __m256i three = _mm256_set1_epi16(3);
+  size_t k = 0;
+
+  for (; k+vec_width <= n; k += vec_width) {
+    __m256i pixvals00 = LOAD_16_UNSIGNED_BYTES(upper+k+0);
+    __m256i pixvals01 = LOAD_16_UNSIGNED_BYTES(upper+k+1);
+    __m256i pixvals02 = LOAD_16_UNSIGNED_BYTES(upper+k+2);
+    __m256i pixvals10 = LOAD_16_UNSIGNED_BYTES(mid  +k+0);
+    __m256i pixvals12 = LOAD_16_UNSIGNED_BYTES(mid  +k+2);
+    __m256i pixvals20 = LOAD_16_UNSIGNED_BYTES(lower+k+0);
+    __m256i pixvals21 = LOAD_16_UNSIGNED_BYTES(lower+k+1);
+    __m256i pixvals22 = LOAD_16_UNSIGNED_BYTES(lower+k+2);
+
+    __m256i resultx = _mm256_mullo_epi16(_mm256_sub_epi16(pixvals21, pixvals01), ten);
+    __m256i resulty = _mm256_mullo_epi16(_mm256_sub_epi16(pixvals12, pixvals10), ten);
+
+    __m256i shared_corners = _mm256_sub_epi16(pixvals22, pixvals00);
+    __m256i other_corners = _mm256_sub_epi16(pixvals20, pixvals02);
+    resultx = _mm256_add_epi16(resultx, _mm256_mullo_epi16(
+        _mm256_add_epi16(shared_corners, other_corners), three));
+    resulty = _mm256_add_epi16(resulty, _mm256_mullo_epi16(
+        _mm256_sub_epi16(shared_corners, other_corners), three));
+
+    resultx = _mm256_srai_epi16(_mm256_abs_epi16(resultx), 6);
+    resulty = _mm256_srai_epi16(_mm256_abs_epi16(resulty), 6);
+    __m256i result = _mm256_add_epi16(resultx, resulty);
+
+    __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(result),
+                                      _mm256_extracti128_si256(result, 1));
+    if (bias) {
+      packed = bias_epi8(packed, _mm_loadu_si128((const __m128i *)(bias+k)));
+    }
+    _mm_storeu_si128((__m128i *)(res+k), packed);
+  }
+
+  return k + scharr_span_sse(upper+k, mid+k, lower+k, bias ? bias+k : NULL, res+k, n-k);
+}
+
+static size_t scharr_span_sse(const pixval *upper, const pixval *mid, const pixval *lower,
+                              const pixval *bias, enval *res, size_t n) {
+  const size_t vec_width = 8;
+  const __m128i ten = _mm_set1_epi16(10);
+  const __m128i three = _mm_set1_epi16(3);
+  size_t k = 0;
+
+  for (; k+vec_width <= n; k += vec_width) {
+    __m128i pixvals00 = LOAD_EIGHT_UNSIGNED_BYTES(upper+k+0);
+    __m128i pixvals01 = LOAD_EIGHT_UNSIGNED_BYTES(upper+k+1);
+    __m128i pixvals02 = LOAD_EIGHT_UNSIGNED_BYTES(upper+k+2);
+    __m128i pixvals10 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +k+0);
+    __m128i pixvals12 = LOAD_EIGHT_UNSIGNED_BYTES(mid  +k+2);
+    __m128i pixvals20 = LOAD_EIGHT_UNSIGNED_BYTES(lower+k+0);
+    __m128i pixvals21 = LOAD_EIGHT_UNSIGNED_BYTES(lower+k+1);
+    __m128i pixvals22 = LOAD_EIGHT_UNSIGNED_BYTES(lower+k+2);
+
+    __m128i resultx = _mm_mullo_epi16(_mm_sub_epi16(pixvals21, pixvals01), ten);
+    __m128i resulty = _mm_mullo_epi16(_mm_sub_epi16(pixvals12, pixvals10), ten);
+
+    __m128i shared_corners = _mm_sub_epi16(pixvals22, pixvals00);
+    __m128i other_corners = _mm_sub_epi16(pixvals20, pixvals02);
+    resultx = _mm_add_epi16(resultx, _mm_mullo_epi16(
+        _mm_add_epi16(shared_corners, other_corners), three));
+    resulty = _mm_add_epi16(resulty, _mm_mullo_epi16(
+        _mm_sub_epi16(shared_corners, other_corners), three));
+
+    resultx = _mm_srai_epi16(_mm_abs_epi16(resultx), 6);
+    resulty = _mm_srai_epi16(_mm_abs_epi16(resulty), 6);
+    __m128i result = _mm_add_epi16(resultx, resulty);
+
+    __m128i packed = _mm_packus_epi16(result, result);
+    if (bias) {
+      packed = bias_epi8(packed, _mm_loadl_epi64((const __m128i *)(bias+k)));
+    }
+    _mm_storel_epi64((__m128i *)(res+k), packed);
+  }
+
+  return k;
+}
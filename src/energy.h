@@ -9,7 +9,29 @@
 #include <stddef.h>
 #include <stdint.h>
 
-typedef int32_t enval;
+#include "arena.h"
+#include "car_internal.h"
+#include "gaps.h"
+#include "threadpool.h"
+
+// each axis of the sobel kernel is at most 4*255/16, so energies fit in a byte
+typedef uint8_t enval;
+
+// every energy function keeps to this, two axes of at most 63 each
+#define MAX_ENERGY 126
+
+// biases are kept in a gray_image offset by this, so they go through the
+// same transposes, averages and seam removals as the image does
+#define BIAS_ZERO 128
+
+// how far either side of the removed pixel a row's energies can change,
+// from the windows of the row and the rows next to it seeing the seam
+#define ENERGY_PARTIAL_REACH 4
+
+// the same for the corners of the first and last rows, whose windows are
+// off centre both ways and reach up to three rows from the corner, by when
+// the seam can be three columns further out
+#define ENERGY_CORNER_REACH 6
 
 typedef struct {
   enval *data;
@@ -20,15 +42,76 @@ typedef struct {
   size_t buf_start;
 } energymap;
 
-double compute_energymap(const gray_image *in, energymap *out);
+/**
+ * An energy function, as the two ways it gets applied. Every function
+ * looks at no more than the 3x3 window around a pixel, so the partial
+ * recompute reaches just as far whichever one a carve uses.
+ */
+typedef struct {
+  const char *name;
+  /**
+   * The energy of one pixel, for the edges of the image and for rows with
+   * gaps in them. The rows start at the left column of the pixel's window.
+   */
+  enval (*pixel)(const pixval *top, const pixval *mid, const pixval *bot);
+  /**
+   * The energies of a span of pixels that all have neighbours on every
+   * side, with the widest vectors the cpu has. The rows start one column
+   * left of the span, and nothing past their column n+1 is read. If bias
+   * isn't NULL, the span's biases are added in before the energies are
+   * stored. Returns how many pixels were done, which are always the first
+   * ones.
+   */
+  size_t (*span)(const pixval *upper, const pixval *mid, const pixval *lower,
+                 const pixval *bias, enval *res, size_t n);
+} energy_func;
+
+/**
+ * @brief The callbacks for one of the energy functions of car_options.
+ */
+const energy_func *energy_func_get(car_energy kind);
+
+/**
+ * @brief Compute the energy of every pixel.
+ * @param fn the energy function to use
+ * @param bias added to every energy with saturation, laid out like out and
+ *             offset by BIAS_ZERO, or NULL
+ * @param pool threads to split the rows between, or NULL
+ * @param a arena for the bands' cpes, given back before returning
+ */
+double compute_energymap(const gray_image *in, energymap *out, const energy_func *fn,
+                         const gray_image *bias, threadpool *pool, arena *a);
+
+/**
+ * @brief Compute the energy of the rows [i0, i1) only.
+ *
+ * The rows each need their neighbours above and below, or the three rows
+ * nearest the edge for the first and last rows, to be in place already.
+ */
+double compute_energymap_rows(const gray_image *in, energymap *out, const energy_func *fn,
+                              const gray_image *bias, size_t i0, size_t i1);
+
+/**
+ * @brief The columns [j0, j1) of row i that compute_energymap_partial
+ *        recomputes, every one whose energy the seam's removal can change.
+ * @param hh the height of the image
+ * @param ww the width of the image without the seam
+ * @param removed the seam's column in row i, in the old image's columns
+ */
+void energymap_partial_cols(size_t i, size_t hh, size_t ww, size_t removed, size_t *j0,
+                            size_t *j1);
 
 /**
  * @brief Recompute the energy for pixels that changed between iterations.
  * @param gray_image the image to compute the energy map for
  * @param out energy map from the last iteration, with the last seam removed
+ * @param fn the energy function out was computed with
+ * @param bias the bias out was computed with, or NULL
  * @param removed pixels that were removed in the last iteration
+ * @param gaps seams marked as removed but still in the buffers, or NULL
  */
-double compute_energymap_partial(const gray_image *in, energymap *out,
-                                 const size_t *removed);
+double compute_energymap_partial(const gray_image *in, energymap *out, const energy_func *fn,
+                                 const gray_image *bias, const size_t *removed,
+                                 const seam_gaps *gaps);
 
 #endif /* _ENERGY_H_ */
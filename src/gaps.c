@@ -0,0 +1,62 @@
+/**
+ * @file gaps.c
+ * @brief Seams that have been removed from an image, but not compacted out
+ */
+
+#include <assert.h>
+
+#include "gaps.h"
+
+int gaps_init(seam_gaps *gaps, size_t height, size_t capacity, arena *a) {
+  assert(gaps);
+  assert(height > 0);
+  assert(capacity > 0);
+
+  gaps->cols = arena_alloc(a, sizeof(size_t) * height * capacity);
+  gaps->count = 0;
+  gaps->capacity = capacity;
+  gaps->height = height;
+  return gaps->cols ? 0 : 1;
+}
+
+size_t gaps_col(const seam_gaps *gaps, size_t row, size_t col) {
+  const size_t *cols = GAPS_ROW(gaps, row);
+
+  // every gap at or left of where the column has got to so far pushes it
+  // one further right
+  for (size_t k = 0; k < gaps->count && cols[k] <= col; k++) {
+    col++;
+  }
+  return col;
+}
+
+void gaps_span(const seam_gaps *gaps, size_t row, size_t col, size_t n,
+               size_t *result) {
+  const size_t *cols = GAPS_ROW(gaps, row);
+
+  size_t k = 0;
+  for (; k < gaps->count && cols[k] <= col; k++) {
+    col++;
+  }
+
+  for (size_t m = 0; m < n; m++) {
+    result[m] = col++;
+    for (; k < gaps->count && cols[k] == col; k++) {
+      col++;
+    }
+  }
+}
+
+void gaps_insert(seam_gaps *gaps, const size_t *cols) {
+  assert(gaps->count < gaps->capacity);
+
+  for (size_t i = 0; i < gaps->height; i++) {
+    size_t *row = GAPS_ROW(gaps, i);
+    size_t k = gaps->count;
+    for (; k > 0 && row[k-1] > cols[i]; k--) {
+      row[k] = row[k-1];
+    }
+    row[k] = cols[i];
+  }
+  gaps->count++;
+}
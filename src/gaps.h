@@ -0,0 +1,52 @@
+/**
+ * @file gaps.h
+ * @brief Seams that have been removed from an image, but not compacted out
+ */
+
+#ifndef _GAPS_H_
+#define _GAPS_H_
+
+#include <stddef.h>
+
+#include "arena.h"
+
+/**
+ * Seams marked as removed from a set of working buffers that all share the
+ * same layout. The pixels are left where they are, and every buffer's width
+ * is the width without them, so the buffers are wider in memory than their
+ * width by count columns. Code that reads through the gaps maps each
+ * column it wants to a column in memory with gaps_col.
+ */
+typedef struct {
+  size_t *cols;     // the gaps' columns in memory, capacity per row, sorted
+  size_t count;     // gaps in every row
+  size_t capacity;  // most gaps per row
+  size_t height;
+} seam_gaps;
+
+#define GAPS_ROW(gaps, row) (&(gaps)->cols[(row)*(gaps)->capacity])
+
+/**
+ * @brief Allocate room for up to capacity gaps per row out of an arena.
+ * @return 0 on success
+ */
+int gaps_init(seam_gaps *gaps, size_t height, size_t capacity, arena *a);
+
+/**
+ * @brief Column in memory of a column of a row, skipping over the gaps.
+ */
+size_t gaps_col(const seam_gaps *gaps, size_t row, size_t col);
+
+/**
+ * @brief Columns in memory of n consecutive columns of a row.
+ */
+void gaps_span(const seam_gaps *gaps, size_t row, size_t col, size_t n,
+               size_t *result);
+
+/**
+ * @brief Mark a seam as removed.
+ * @param cols the seam's column in memory in every row, from gaps_col
+ */
+void gaps_insert(seam_gaps *gaps, const size_t *cols);
+
+#endif /* _GAPS_H_ */
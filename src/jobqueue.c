@@ -0,0 +1,386 @@
+/**
+ * @file jobqueue.c
+ * @brief Worker threads that carve many images at once
+ *
+ * Every worker has a deque of jobs and a context of its own, so its buffers
+ * are already the right size for the next image more often than not. A new
+ * job goes to the worker with the least carving ahead of it, counting the
+ * job it's on, and the owner takes its jobs from the front of its deque.
+ * A worker with nothing left steals from the back of the deque with the
+ * most carving in it, so jobs queued behind a large one move elsewhere.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <log.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <car.h>
+
+#include "car_internal.h"
+#include "threadpool.h"
+
+// jobs a deque has room for before it first grows
+static const size_t MIN_DEQUE = 16;
+
+struct car_job {
+  car_queue *queue;
+  const rgb_image *in;
+  rgb_image *out;
+  car_options opts;
+  uint64_t cost;
+  int status;
+  atomic_bool done;
+};
+
+typedef struct {
+  car_queue *queue;
+  pthread_t thread;
+  car_context *ctx;
+
+  // jobs waiting for this worker, oldest at head
+  pthread_mutex_t lock;
+  car_job **jobs;
+  size_t capacity;
+  size_t head;
+  size_t count;
+
+  // cost of the jobs queued here and the one being carved
+  atomic_uint_fast64_t load;
+} queue_worker;
+
+struct car_queue {
+  queue_worker *workers;
+  size_t nworkers;
+
+  // jobs submitted and not yet taken by a worker
+  atomic_size_t pending;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t job_done;
+  // guarded by lock
+  size_t outstanding;  // jobs submitted and not yet waited for
+  bool shutdown;
+};
+
+static void *worker_main(void *arg);
+static car_job *take_job(queue_worker *self);
+static car_job *steal_job(queue_worker *self);
+static void run_job(queue_worker *self, car_job *job);
+static queue_worker *least_loaded(car_queue *queue);
+static uint64_t job_cost(const rgb_image *in, const rgb_image *out);
+static int deque_push(queue_worker *w, car_job *job);
+static car_job *deque_pop_front(queue_worker *w);
+static car_job *deque_pop_back(queue_worker *w);
+static void workers_free(car_queue *queue, size_t nstarted);
+
+car_queue *car_queue_create(size_t nworkers) {
+  if (nworkers == 0) {
+    nworkers = threadpool_default_size();
+  }
+
+  car_queue *queue = calloc(1, sizeof(*queue));
+  if (!queue) {
+    return NULL;
+  }
+  queue->workers = calloc(nworkers, sizeof(*queue->workers));
+  if (!queue->workers) {
+    free(queue);
+    return NULL;
+  }
+  queue->nworkers = nworkers;
+  atomic_init(&queue->pending, 0);
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->work_ready, NULL);
+  pthread_cond_init(&queue->job_done, NULL);
+
+  // every deque is set up before any thread might steal from it
+  for (size_t k = 0; k < nworkers; k++) {
+    queue_worker *w = &queue->workers[k];
+    w->queue = queue;
+    pthread_mutex_init(&w->lock, NULL);
+    atomic_init(&w->load, 0);
+  }
+  for (size_t k = 0; k < nworkers; k++) {
+    queue->workers[k].ctx = car_context_create();
+    if (!queue->workers[k].ctx) {
+      workers_free(queue, 0);
+      return NULL;
+    }
+  }
+
+  for (size_t k = 0; k < nworkers; k++) {
+    if (pthread_create(&queue->workers[k].thread, NULL, worker_main,
+                       &queue->workers[k]) != 0) {
+      log_error("Could only start %zu of %zu workers", k, nworkers);
+      workers_free(queue, k);
+      return NULL;
+    }
+  }
+
+  return queue;
+}
+
+void car_queue_destroy(car_queue *queue) {
+  if (!queue) {
+    return;
+  }
+  assert(queue->outstanding == 0);
+  workers_free(queue, queue->nworkers);
+}
+
+car_job *car_queue_submit(car_queue *queue, const rgb_image *in, rgb_image *out,
+                          const car_options *opts) {
+  assert(queue);
+  assert(IS_IMAGE(in));
+  assert(IS_IMAGE(out));
+  assert(opts);
+
+  car_job *job = malloc(sizeof(*job));
+  if (!job) {
+    log_fatal("malloc failed");
+    return NULL;
+  }
+  job->queue = queue;
+  job->in = in;
+  job->out = out;
+  job->opts = *opts;
+  job->cost = job_cost(in, out);
+  job->status = 0;
+  atomic_init(&job->done, false);
+
+  // the workers are already using every cpu between them
+  if (job->opts.threads == 0) {
+    job->opts.threads = 1;
+  }
+
+  // counted first, so a worker that finds it knows it was there to find
+  atomic_fetch_add(&queue->pending, 1);
+  if (deque_push(least_loaded(queue), job) != 0) {
+    atomic_fetch_sub(&queue->pending, 1);
+    free(job);
+    log_fatal("malloc failed");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  queue->outstanding++;
+  pthread_cond_signal(&queue->work_ready);
+  pthread_mutex_unlock(&queue->lock);
+
+  return job;
+}
+
+bool car_job_poll(const car_job *job) {
+  assert(job);
+  return atomic_load(&job->done);
+}
+
+int car_job_wait(car_job *job) {
+  assert(job);
+  car_queue *queue = job->queue;
+
+  pthread_mutex_lock(&queue->lock);
+  while (!atomic_load(&job->done)) {
+    pthread_cond_wait(&queue->job_done, &queue->lock);
+  }
+  queue->outstanding--;
+  pthread_mutex_unlock(&queue->lock);
+
+  int status = job->status;
+  free(job);
+  return status;
+}
+
+static void *worker_main(void *arg) {
+  queue_worker *self = arg;
+  car_queue *queue = self->queue;
+
+  for (;;) {
+    car_job *job = take_job(self);
+    if (job) {
+      run_job(self, job);
+      continue;
+    }
+
+    // a job counted in pending but not found yet is about to be pushed,
+    // so only sleep once there's none at all
+    pthread_mutex_lock(&queue->lock);
+    while (atomic_load(&queue->pending) == 0 && !queue->shutdown) {
+      pthread_cond_wait(&queue->work_ready, &queue->lock);
+    }
+    bool finished = queue->shutdown && atomic_load(&queue->pending) == 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    if (finished) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief The next job for a worker, its own oldest or else a stolen one.
+ * @return the job, or NULL if no deque had one
+ */
+static car_job *take_job(queue_worker *self) {
+  car_job *job = deque_pop_front(self);
+  if (!job) {
+    job = steal_job(self);
+  }
+  if (job) {
+    atomic_fetch_sub(&self->queue->pending, 1);
+  }
+  return job;
+}
+
+/**
+ * @brief Take the newest job of the most loaded other worker, or failing
+ *        that of any other worker.
+ */
+static car_job *steal_job(queue_worker *self) {
+  car_queue *queue = self->queue;
+
+  queue_worker *busiest = NULL;
+  uint_fast64_t most = 0;
+  for (size_t k = 0; k < queue->nworkers; k++) {
+    queue_worker *w = &queue->workers[k];
+    uint_fast64_t load = atomic_load(&w->load);
+    if (w != self && load > most) {
+      busiest = w;
+      most = load;
+    }
+  }
+
+  car_job *job = busiest ? deque_pop_back(busiest) : NULL;
+  for (size_t k = 0; !job && k < queue->nworkers; k++) {
+    if (&queue->workers[k] != self) {
+      job = deque_pop_back(&queue->workers[k]);
+    }
+  }
+
+  // the job's cost now waits on this worker instead
+  if (job) {
+    atomic_fetch_add(&self->load, job->cost);
+  }
+  return job;
+}
+
+static void run_job(queue_worker *self, car_job *job) {
+  job->status = car_carve(self->ctx, job->in, job->out, &job->opts);
+  atomic_fetch_sub(&self->load, job->cost);
+
+  car_queue *queue = self->queue;
+  pthread_mutex_lock(&queue->lock);
+  atomic_store(&job->done, true);
+  pthread_cond_broadcast(&queue->job_done);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static queue_worker *least_loaded(car_queue *queue) {
+  queue_worker *best = &queue->workers[0];
+  uint_fast64_t least = atomic_load(&best->load);
+  for (size_t k = 1; k < queue->nworkers && least > 0; k++) {
+    uint_fast64_t load = atomic_load(&queue->workers[k].load);
+    if (load < least) {
+      best = &queue->workers[k];
+      least = load;
+    }
+  }
+  return best;
+}
+
+/**
+ * @brief Rough amount of carving in a job, in pixels visited.
+ *
+ * Every seam takes a pass over the image, whichever way it goes, and a job
+ * with no seams still has to be copied.
+ */
+static uint64_t job_cost(const rgb_image *in, const rgb_image *out) {
+  size_t dw = in->width > out->width ? in->width - out->width : out->width - in->width;
+  size_t dh = in->height > out->height ? in->height - out->height : out->height - in->height;
+  return (uint64_t)in->width * in->height * (dw + dh + 1);
+}
+
+static int deque_push(queue_worker *w, car_job *job) {
+  pthread_mutex_lock(&w->lock);
+  if (w->count == w->capacity) {
+    size_t grown = w->capacity ? 2 * w->capacity : MIN_DEQUE;
+    car_job **jobs = malloc(sizeof(*jobs) * grown);
+    if (!jobs) {
+      pthread_mutex_unlock(&w->lock);
+      return 1;
+    }
+    for (size_t k = 0; k < w->count; k++) {
+      jobs[k] = w->jobs[(w->head + k) % w->capacity];
+    }
+    free(w->jobs);
+    w->jobs = jobs;
+    w->capacity = grown;
+    w->head = 0;
+  }
+
+  w->jobs[(w->head + w->count) % w->capacity] = job;
+  w->count++;
+  atomic_fetch_add(&w->load, job->cost);
+  pthread_mutex_unlock(&w->lock);
+  return 0;
+}
+
+static car_job *deque_pop_front(queue_worker *w) {
+  car_job *job = NULL;
+  pthread_mutex_lock(&w->lock);
+  if (w->count > 0) {
+    job = w->jobs[w->head];
+    w->head = (w->head + 1) % w->capacity;
+    w->count--;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return job;
+}
+
+static car_job *deque_pop_back(queue_worker *w) {
+  car_job *job = NULL;
+  pthread_mutex_lock(&w->lock);
+  if (w->count > 0) {
+    w->count--;
+    job = w->jobs[(w->head + w->count) % w->capacity];
+    atomic_fetch_sub(&w->load, job->cost);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return job;
+}
+
+/**
+ * @brief Stop the first nstarted workers and free everything.
+ */
+static void workers_free(car_queue *queue, size_t nstarted) {
+  pthread_mutex_lock(&queue->lock);
+  queue->shutdown = true;
+  pthread_cond_broadcast(&queue->work_ready);
+  pthread_mutex_unlock(&queue->lock);
+
+  for (size_t k = 0; k < nstarted; k++) {
+    pthread_join(queue->workers[k].thread, NULL);
+  }
+
+  for (size_t k = 0; k < queue->nworkers; k++) {
+    queue_worker *w = &queue->workers[k];
+    car_context_destroy(w->ctx);
+    pthread_mutex_destroy(&w->lock);
+    free(w->jobs);
+  }
+
+  pthread_cond_destroy(&queue->job_done);
+  pthread_cond_destroy(&queue->work_ready);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->workers);
+  free(queue);
+}
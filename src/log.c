@@ -20,6 +20,8 @@
  * IN THE SOFTWARE.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -97,7 +99,8 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
 
   /* Get current time */
   time_t t = time(NULL);
-  struct tm *lt = localtime(&t);
+  struct tm tm_buf;
+  struct tm *lt = localtime_r(&t, &tm_buf);
 
   /* Log to stderr */
   if (!L.quiet) {
@@ -7,28 +7,39 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wand/magick_wand.h>
 
 #include <car.h>
 #include <x86intrin.h>
 
+#include "batch.h"
 #include "car_internal.h"
+#include "tsc.h"
 
 int main(int argc, const char *argv[]) {
+  if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+    return batch_main(argc-1, argv+1);
+  }
+
   if (argc < 4) {
-    printf("Usage: %s [in] [out] [width] [reps=1]\n", argv[0]);
+    printf("Usage: %s [in] [out] [width] [reps=1] [height=0]\n", argv[0]);
     printf("  in: Input image path (eg. in.jpg)\n");
     printf("  out: Where to save output image (eg. out.jpg)\n");
-    printf("  width: How many vertical seams to remove (eg. 200)\n");
+    printf("  width: How many vertical seams to remove (eg. 200, or -200 to ");
+    printf("insert 200 seams instead)\n");
     printf("  reps: How many times to do the carve operation (eg. 10, ");
     printf("default 1, use this for benchmarking purposes)\n");
+    printf("  height: How many horizontal seams to remove (eg. 100, default 0, ");
+    printf("negative to insert)\n");
+    printf("Or: %s --batch [in] [outdir] [width] [codec threads=1]\n", argv[0]);
     return 1;
   }
 
   const char *inpath = argv[1];
   const char *outpath = argv[2];
-  size_t to_remove;
-  if (sscanf(argv[3], "%zu", &to_remove) != 1) {
+  long long to_remove;
+  if (sscanf(argv[3], "%lld", &to_remove) != 1) {
     log_fatal("Invalid seam count: %s", argv[3]);
     return 1;
   }
@@ -38,6 +49,12 @@ int main(int argc, const char *argv[]) {
     log_fatal("Invalid repetitions: %s", argv[4]);
   }
 
+  long long to_remove_h = 0;
+  if (argc > 5 && sscanf(argv[5], "%lld", &to_remove_h) != 1) {
+    log_fatal("Invalid seam count: %s", argv[5]);
+    return 1;
+  }
+
   // initialize magickwand
   MagickWandGenesis();
   MagickWand *mw = NewMagickWand();
@@ -55,16 +72,26 @@ int main(int argc, const char *argv[]) {
   size_t ww = MagickGetImageWidth(mw);
   size_t hh = MagickGetImageHeight(mw);
 
-  if (to_remove > ww) {
-    log_fatal("Image width %zu, can't remove %llu seams", ww, to_remove);
+  if (to_remove > (long long)ww) {
+    log_fatal("Image width %zu, can't remove %lld seams", ww, to_remove);
     return 1;
   }
 
-  if (ww-to_remove < 10) {
+  if ((long long)ww-to_remove < 10) {
     log_fatal("Output image width must be at least 10 pixels\n");
     return 1;
   }
 
+  if (to_remove_h > (long long)hh) {
+    log_fatal("Image height %zu, can't remove %lld seams", hh, to_remove_h);
+    return 1;
+  }
+
+  if ((long long)hh-to_remove_h < 10) {
+    log_fatal("Output image height must be at least 10 pixels\n");
+    return 1;
+  }
+
   // allocate the input image
   rgb_image in;
   INITIALIZE_IMAGE(&in, ww, hh);
@@ -75,7 +102,8 @@ int main(int argc, const char *argv[]) {
 
   // allocate the output image
   rgb_image out;
-  INITIALIZE_IMAGE(&out, ww-to_remove, hh);
+  INITIALIZE_IMAGE(&out, (size_t)((long long)ww-to_remove),
+                   (size_t)((long long)hh-to_remove_h));
   if (!out.data) {
     free(in.data);
     log_fatal("malloc failed");
@@ -85,20 +113,29 @@ int main(int argc, const char *argv[]) {
   // read the image
   MagickExportImagePixels(mw, 0, 0, ww, hh, "RGB", CharPixel, in.data);
 
+  // one context for every rep, so later reps reuse the threads and buffers
+  car_context *ctx = car_context_create();
+  if (!ctx) {
+    log_fatal("malloc failed");
+    return 1;
+  }
+  car_options opts;
+  car_default_options(&opts);
+
   for (unsigned i = 0; i < reps; i++) {
     log_info("Running iteration %u of %u", i+1, reps);
     // do the carve
     uint64_t start = __rdtsc();
-    if (seam_carve_baseline(&in, &out) != 0) {
-      log_fatal("seam_carve_baseline failed");
+    if (car_carve(ctx, &in, &out, &opts) != 0) {
+      log_fatal("car_carve failed");
       return 1;
     }
     uint64_t end = __rdtsc();
-    log_info("Completed in %llu cycles (%0.2fs)", end-start, (float)(end-start)/2500000000.0);
+    log_info("Completed in %llu cycles (%0.2fs)", end-start, (double)(end-start)/tsc_hz());
   }
 
   // bring the image back to magickwand
-  MagickCropImage(mw, out.width, out.height, 0, 0);
+  MagickExtentImage(mw, out.width, out.height, 0, 0);
   MagickImportImagePixels(mw, 0, 0, out.width, out.height, "RGB", CharPixel, out.data);
 
   // write it to file
@@ -109,6 +146,7 @@ int main(int argc, const char *argv[]) {
     return 1;
   }
 
+  car_context_destroy(ctx);
   free(in.data);
   free(out.data);
 
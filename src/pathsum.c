@@ -4,119 +4,500 @@
  */
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <x86intrin.h>
 
 #include "car_internal.h"
 #include "energy.h"
+#include "gaps.h"
 #include "pathsum.h"
-
-_Static_assert(sizeof(enval) == sizeof(int32_t), "unexpected enval datatype size");
-
-static void compute_pathsum_row(const energymap *in, energymap *result,
-                                size_t i, size_t j0, size_t n);
-static enval min3(enval a, enval b, enval c);
-static int min3idx(enval a, enval b, enval c);
-static int min2idx(enval a, enval b);
+#include "simd.h"
+#include "threadpool.h"
+
+_Static_assert(sizeof(enval) == sizeof(uint8_t), "unexpected enval datatype size");
+
+// most rows computed per block when the rows are split between threads
+static const size_t BLOCK_HEIGHT = 64;
+// narrowest tile worth handing to a thread
+static const size_t MIN_TILE_WIDTH = 256;
+
+// how many bottom row candidates to try for each seam wanted in a batch
+static const size_t CANDIDATES_PER_SEAM = 4;
+
+// path sum of the columns just outside a band, too big to ever be the least
+// but small enough that the kernels' signed compares still order it right
+static const uint32_t BAND_EDGE = 1u << 30;
+// columns either side of a band row that the kernels may read
+static const size_t BAND_PAD = 64;
+
+typedef struct {
+  uint32_t val;
+  size_t col;
+} seam_candidate;
+
+static size_t compute_pathsum_span_avx512_16(const enval *in, const uint16_t *prev,
+                                             uint16_t *res, uint8_t *dir, size_t n);
+static size_t compute_pathsum_span_avx2_16(const enval *in, const uint16_t *prev,
+                                           uint16_t *res, uint8_t *dir, size_t n);
+static size_t compute_pathsum_span_sse_16(const enval *in, const uint16_t *prev,
+                                          uint16_t *res, uint8_t *dir, size_t n);
+static size_t compute_pathsum_span_avx512_32(const enval *in, const uint32_t *prev,
+                                             uint32_t *res, uint8_t *dir, size_t n);
+static size_t compute_pathsum_span_avx2_32(const enval *in, const uint32_t *prev,
+                                           uint32_t *res, uint8_t *dir, size_t n);
+static size_t compute_pathsum_span_sse_32(const enval *in, const uint32_t *prev,
+                                          uint32_t *res, uint8_t *dir, size_t n);
+static size_t compute_forward_span_avx512_16(const pixval *in, const pixval *up,
+                                             const uint16_t *prev, uint16_t *res,
+                                             uint8_t *dir, size_t n);
+static size_t compute_forward_span_avx2_16(const pixval *in, const pixval *up,
+                                           const uint16_t *prev, uint16_t *res,
+                                           uint8_t *dir, size_t n);
+static size_t compute_forward_span_sse_16(const pixval *in, const pixval *up,
+                                          const uint16_t *prev, uint16_t *res,
+                                          uint8_t *dir, size_t n);
+static size_t compute_forward_span_avx512_32(const pixval *in, const pixval *up,
+                                             const uint32_t *prev, uint32_t *res,
+                                             uint8_t *dir, size_t n);
+static size_t compute_forward_span_avx2_32(const pixval *in, const pixval *up,
+                                           const uint32_t *prev, uint32_t *res,
+                                           uint8_t *dir, size_t n);
+static size_t compute_forward_span_sse_32(const pixval *in, const pixval *up,
+                                          const uint32_t *prev, uint32_t *res,
+                                          uint8_t *dir, size_t n);
+static void forward_costs(pixval l, pixval r, pixval u, uint32_t *cl, uint32_t *cu,
+                          uint32_t *cr);
+static void gather_band_gray(const gray_image *gray, const seam_gaps *gaps, size_t i,
+                             size_t lo, size_t bw, size_t *cols, pixval *out);
+static __m256i dir_codes_avx2_16(__m256i ll, __m256i cc, __m256i rr);
+static __m256i dir_codes_avx2_32(__m256i ll, __m256i cc, __m256i rr);
+static __m128i pack_codes_avx2_32(__m256i codes);
+static __m128i dir_codes_sse_16(__m128i ll, __m128i cc, __m128i rr);
+static __m128i dir_codes_sse_32(__m128i ll, __m128i cc, __m128i rr);
+static size_t argmin_16(const uint16_t *row, size_t n);
+static size_t argmin_32(const uint32_t *row, size_t n);
+static size_t first_change(const void *a, const void *b, size_t n);
+static size_t last_change(const void *a, const void *b, size_t n);
+static void trace_seam(const pathsum_dirs *dirs, size_t *result, const seam_gaps *gaps);
+static int compare_candidates(const void *a, const void *b);
+static uint32_t min3(uint32_t a, uint32_t b, uint32_t c);
+static int min3idx(uint32_t a, uint32_t b, uint32_t c);
+static int min2idx(uint32_t a, uint32_t b);
 static size_t min(size_t a, size_t b);
 static size_t max(size_t a, size_t b);
 
-void compute_pathsum(const energymap *in, energymap *result) {
-  assert(IS_IMAGE(in));
-  assert(IS_IMAGE(result));
-  assert(in->width == result->width);
-  assert(in->height == result->height);
-  
-  size_t ww = in->width;
-  size_t hh = in->height;
+#define PSVAL uint16_t
+#define PSMAP pathsum16
+#define PS(name) name##16
+#include "pathsum_impl.h"
+#undef PS
+#undef PSMAP
+#undef PSVAL
+
+#define PSVAL uint32_t
+#define PSMAP pathsum32
+#define PS(name) name##32
+#include "pathsum_impl.h"
+#undef PS
+#undef PSMAP
+#undef PSVAL
+
+int pathsum_init(pathsum_map *ps, size_t width, size_t height, bool dirs, arena *a) {
+  assert(ps);
+
+  // both keep the geometry, so the buffers can be resized without caring
+  // which one holds the path sums
+  ps->narrow = (pathsum16) {
+    .width = width, .height = height, .buf_width = width, .buf_height = height,
+  };
+  ps->wide = (pathsum32) {
+    .width = width, .height = height, .buf_width = width, .buf_height = height,
+  };
+  ps->dirs = (pathsum_dirs) {
+    .width = width, .height = height, .buf_width = width, .buf_height = height,
+  };
+
+  ps->saved = NULL;
+  if (!a) {
+    return 0;
+  }
+
+  ps->saved = arena_alloc(a, sizeof(uint32_t) * width);
+  if (!ps->saved) {
+    return 1;
+  }
 
-  // push the min val down
-  for (size_t i = 0; i < hh; i++) {
-    compute_pathsum_row(in, result, i, 0, ww);
+  if (dirs) {
+    ps->dirs.data = arena_alloc(a, sizeof(uint8_t) * width * height);
+    if (!ps->dirs.data) {
+      return 1;
+    }
+  }
+
+  if (height <= PATHSUM16_MAX_HEIGHT) {
+    ps->narrow.data = arena_alloc(a, sizeof(uint16_t) * width * height);
+    return ps->narrow.data ? 0 : 1;
   }
+  ps->wide.data = arena_alloc(a, sizeof(uint32_t) * width * height);
+  return ps->wide.data ? 0 : 1;
 }
 
-size_t compute_pathsum_partial(const energymap *in, energymap *result, size_t *removed) {
-  assert(IS_IMAGE(in));
-  assert(IS_IMAGE(result));
-  assert(in->width == result->width);
-  assert(in->height == result->height);
-  assert(removed);
+void compute_pathsum(const energymap *in, pathsum_map *result, threadpool *pool) {
+  pathsum_dirs *dirs = result->dirs.data ? &result->dirs : NULL;
+  if (result->narrow.data) {
+    compute_pathsum16(in, NULL, &result->narrow, dirs, pool);
+  } else {
+    compute_pathsum32(in, NULL, &result->wide, dirs, pool);
+  }
+}
 
-  size_t ww = in->width;
-  size_t hh = in->height;
+void compute_pathsum_partial(const energymap *in, pathsum_map *result, const size_t *removed,
+                             const seam_gaps *gaps, threadpool *pool, pathsum_cone *cone) {
+  pathsum_dirs *dirs = result->dirs.data ? &result->dirs : NULL;
+  if (result->narrow.data) {
+    compute_pathsum_partial16(in, NULL, &result->narrow, dirs, removed, gaps,
+                              result->saved, pool, cone);
+  } else {
+    compute_pathsum_partial32(in, NULL, &result->wide, dirs, removed, gaps,
+                              result->saved, pool, cone);
+  }
+}
 
-  size_t j0 = ww;
-  size_t j1 = 0;
+void compute_pathsum_forward(const gray_image *in, pathsum_map *result, threadpool *pool) {
+  if (result->narrow.data) {
+    compute_pathsum16(NULL, in, &result->narrow, &result->dirs, pool);
+  } else {
+    compute_pathsum32(NULL, in, &result->wide, &result->dirs, pool);
+  }
+}
 
-  size_t total_size = 0;
+void compute_pathsum_forward_partial(const gray_image *in, pathsum_map *result,
+                                     const size_t *removed, const seam_gaps *gaps,
+                                     threadpool *pool, pathsum_cone *cone) {
+  if (result->narrow.data) {
+    compute_pathsum_partial16(NULL, in, &result->narrow, &result->dirs, removed,
+                              gaps, result->saved, pool, cone);
+  } else {
+    compute_pathsum_partial32(NULL, in, &result->wide, &result->dirs, removed, gaps,
+                              result->saved, pool, cone);
+  }
+}
 
-  for (size_t i = 1; i < hh; i++) {
-    j0 = min(j0, removed[i-1] > 0 ? removed[i-1] - 1 : 0);
-    j1 = max(j1, removed[i-1] < ww ? removed[i-1] + 1 : ww);
-    assert(j1 > j0);
-    compute_pathsum_row(in, result, i, j0, j1-j0);
-    total_size += (j1-j0) * sizeof(enval);
-    if (j0 > 0) j0--;
-    if (j1 < ww) j1++;
+void find_minseam(const pathsum_map *pathsum, size_t *result, const seam_gaps *gaps) {
+  const pathsum_dirs *dirs = pathsum->dirs.data ? &pathsum->dirs : NULL;
+  if (pathsum->narrow.data) {
+    find_minseam16(&pathsum->narrow, dirs, result, gaps);
+  } else {
+    find_minseam32(&pathsum->wide, dirs, result, gaps);
   }
+}
 
-  return total_size;
+size_t find_minseams(const pathsum_map *pathsum, size_t nseams, size_t *result,
+                     uint8_t *claimed, arena *a) {
+  const pathsum_dirs *dirs = pathsum->dirs.data ? &pathsum->dirs : NULL;
+  if (pathsum->narrow.data) {
+    return find_minseams16(&pathsum->narrow, dirs, nseams, result, claimed, a);
+  }
+  return find_minseams32(&pathsum->wide, dirs, nseams, result, claimed, a);
 }
 
-static void compute_pathsum_row(const energymap *in, energymap *result,
-                                size_t i, size_t j0, size_t n) {
-  size_t ww = in->width;
+int find_seam_in_band(const energymap *in, const gray_image *gray, const size_t *guide,
+                      size_t band, size_t *result, const seam_gaps *gaps, arena *a) {
+  assert(in ? IS_IMAGE(in) : IS_IMAGE(gray));
+  assert(guide);
+  assert(result);
 
-  size_t j = j0;
+  const size_t ww = in ? in->width : gray->width;
+  const size_t hh = in ? in->height : gray->height;
+  const size_t bw = min(2*band + 1, ww);
+  const size_t row_size = bw + 2*BAND_PAD;
+  const bool has_gaps = gaps && gaps->count > 0;
+
+  arena_mark mark;
+  arena_get_mark(a, &mark);
+  size_t *lo = arena_alloc(a, sizeof(size_t) * hh);
+  uint8_t *dirs = arena_alloc(a, sizeof(uint8_t) * hh * bw);
+  uint32_t *rows = arena_alloc(a, sizeof(uint32_t) * 2 * row_size);
+  enval *gathered = has_gaps && in ? arena_alloc(a, sizeof(enval) * bw) : NULL;
+  size_t *mem_cols = has_gaps || !in ? arena_alloc(a, sizeof(size_t) * (bw+2)) : NULL;
+  // forward energy needs the gray row with a column either side, and the row above
+  pixval *row_gray = in ? NULL : arena_alloc(a, sizeof(pixval) * (bw+2));
+  pixval *up_gray = in ? NULL : arena_alloc(a, sizeof(pixval) * bw);
+  if (!lo || !dirs || !rows || (has_gaps && in && !gathered) || ((has_gaps || !in) && !mem_cols)
+      || (!in && (!row_gray || !up_gray))) {
+    arena_release(a, mark);
+    return 1;
+  }
 
-  // the first row is just a copy
-  if (i == 0) {
-    memcpy(&GET_PIXEL(result, i, j), &GET_PIXEL(in, i, j), sizeof(GET_PIXEL(result, 0, 0))*n);
-    return;
+  // the first column of the band in every row
+  for (size_t i = 0; i < hh; i++) {
+    size_t col = guide[i] > band ? guide[i] - band : 0;
+    col = min(col, ww - bw);
+    if (i > 0) {
+      col = min(col, lo[i-1] + 1);
+      col = max(col + 1, lo[i-1]) - 1;
+    }
+    lo[i] = col;
+  }
+
+  // the padding is never written, so it stays outside the band for good
+  for (size_t k = 0; k < 2*row_size; k++) {
+    rows[k] = BAND_EDGE;
   }
+  uint32_t *prev = rows + BAND_PAD;
+  uint32_t *cur = rows + row_size + BAND_PAD;
+
+  for (size_t i = 0; i < hh; i++) {
+    if (!in) {
+      gather_band_gray(gray, gaps, i, lo[i], bw, mem_cols, row_gray);
+      if (i > 0) {
+        gather_band_gray(gray, gaps, i-1, lo[i], bw, mem_cols, NULL);
+        for (size_t k = 0; k < bw; k++) {
+          up_gray[k] = GET_PIXEL(gray, i-1, mem_cols[k]);
+        }
+      }
+    }
 
-  // do the first value
-  if (j == 0) {
-    enval cc = GET_PIXEL(result, i-1, j+0);
-    enval rr = GET_PIXEL(result, i-1, j+1);
-    enval minval;
-    if (cc <= rr) {
-      minval = cc;
+    const enval *en = in ? &GET_PIXEL(in, i, lo[i]) : NULL;
+    if (in && has_gaps) {
+      gaps_span(gaps, i, lo[i], bw, mem_cols);
+      for (size_t k = 0; k < bw; k++) {
+        gathered[k] = GET_PIXEL(in, i, mem_cols[k]);
+      }
+      en = gathered;
+    }
+
+    if (i == 0) {
+      for (size_t k = 0; k < bw; k++) {
+        uint32_t cl, cu, cr;
+        if (in) {
+          cu = en[k];
+        } else {
+          forward_costs(row_gray[k], row_gray[k+2], row_gray[k+1], &cl, &cu, &cr);
+        }
+        cur[k] = cu;
+      }
     } else {
-      minval = rr;
+      // the row above, lined up with this row's columns
+      const uint32_t *above = lo[i] >= lo[i-1] ? prev + (lo[i] - lo[i-1])
+                                               : prev - (lo[i-1] - lo[i]);
+      if (in) {
+        compute_pathsum_span32(en, above, cur, &dirs[i*bw], bw);
+      } else {
+        compute_forward_span32(row_gray + 1, up_gray, above, cur, &dirs[i*bw], bw);
+      }
+    }
+
+    uint32_t *tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+
+  result[hh-1] = lo[hh-1] + argmin_32(prev, bw);
+  for (size_t i = hh-1; i > 0; i--) {
+    result[i-1] = result[i] + dirs[i*bw + result[i] - lo[i]] - 1;
+  }
+
+  arena_release(a, mark);
+  return 0;
+}
+
+/**
+ * @brief The buffer columns of a band row, and with out set, its gray values
+ *        with a column either side.
+ *
+ * Without out, cols gets just the band's bw columns. With it, out[k+1] is
+ * the gray of band column k, and out[0] and out[bw+1] are the columns just
+ * outside the band, or the band's own end columns at the image's edges,
+ * as forward_pixel takes them.
+ */
+static void gather_band_gray(const gray_image *gray, const seam_gaps *gaps, size_t i,
+                             size_t lo, size_t bw, size_t *cols, pixval *out) {
+  const size_t ww = gray->width;
+  size_t first = out && lo > 0 ? lo-1 : lo;
+  size_t last = out ? min(lo+bw+1, ww) : lo+bw;
+  if (gaps && gaps->count > 0) {
+    gaps_span(gaps, i, first, last-first, cols);
+  } else {
+    for (size_t k = 0; k < last-first; k++) {
+      cols[k] = first + k;
+    }
+  }
+  if (!out) {
+    return;
+  }
+
+  pixval *dst = lo > 0 ? out : out+1;
+  for (size_t k = 0; k < last-first; k++) {
+    dst[k] = GET_PIXEL(gray, i, cols[k]);
+  }
+  if (lo == 0) {
+    out[0] = out[1];
+  }
+  if (lo+bw == ww) {
+    out[bw+1] = out[bw];
+  }
+}
+
+/*
+ * The kernels record directions the same way min3idx picks them, so that
+ * straight up wins any tie, and then the left.
+ *
+ * Unaligned loads are cheap enough that the avx512 kernels just load the
+ * row above three times rather than shuffling one load into three vectors.
+ * Their last vector is masked, so they never leave anything for the scalar
+ * code. The narrower kernels hand what they can't fill a vector with down to
+ * the next narrower one.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static size_t compute_pathsum_span_avx512_16(const enval *in, const uint16_t *prev,
+                                             uint16_t *res, uint8_t *dir, size_t n) {
+  const size_t elts_per_vec = sizeof(__m512i) / sizeof(uint16_t);
+
+  for (size_t j = 0; j < n; j += elts_per_vec) {
+    __mmask32 mask = (__mmask32)~0u;
+    if (n - j < elts_per_vec) {
+      mask = (__mmask32)((1u << (n - j)) - 1);
+    }
+
+    __m512i curvals = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, in+j));
+    __m512i ll = _mm512_maskz_loadu_epi16(mask, prev+j-1);
+    __m512i cc = _mm512_maskz_loadu_epi16(mask, prev+j);
+    __m512i rr = _mm512_maskz_loadu_epi16(mask, prev+j+1);
+
+    __m512i minvals = _mm512_min_epu16(_mm512_min_epu16(ll, cc), rr);
+    _mm512_mask_storeu_epi16(res+j, mask, _mm512_add_epi16(minvals, curvals));
+
+    if (dir) {
+      __mmask32 up = _mm512_cmple_epu16_mask(cc, ll) & _mm512_cmple_epu16_mask(cc, rr);
+      __mmask32 left = _mm512_cmple_epu16_mask(ll, rr) & ~up;
+      __m256i codes = _mm256_set1_epi8(2);
+      codes = _mm256_mask_mov_epi8(codes, left, _mm256_setzero_si256());
+      codes = _mm256_mask_mov_epi8(codes, up, _mm256_set1_epi8(1));
+      _mm256_mask_storeu_epi8(dir+j, mask, codes);
     }
-    GET_PIXEL(result, i, 0) = GET_PIXEL(in, i, j) + minval;
-    j++;
   }
 
-  // do the middle values
+  return n;
+}
+
+__attribute__((target("avx2")))
+static size_t compute_pathsum_span_avx2_16(const enval *in, const uint16_t *prev,
+                                           uint16_t *res, uint8_t *dir, size_t n) {
+  const size_t elts_per_vec = sizeof(__m256i) / sizeof(uint16_t);
+  size_t j = 0;
+
+  for (; j+elts_per_vec <= n; j += elts_per_vec) {
+    __m256i curvals = _mm256_cvtepu8_epi16(_mm_loadu_si128((const void *)(in+j)));
+    __m256i ll = _mm256_loadu_si256((const void *)(prev+j-1));
+    __m256i cc = _mm256_loadu_si256((const void *)(prev+j));
+    __m256i rr = _mm256_loadu_si256((const void *)(prev+j+1));
+
+    __m256i minvals = _mm256_min_epu16(_mm256_min_epu16(ll, cc), rr);
+    _mm256_storeu_si256((void *)(res+j), _mm256_add_epi16(minvals, curvals));
+
+    if (dir) {
+      __m256i codes = dir_codes_avx2_16(ll, cc, rr);
+      __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(codes),
+                                        _mm256_extracti128_si256(codes, 1));
+      _mm_storeu_si128((void *)(dir+j), packed);
+    }
+  }
+
+  return j + compute_pathsum_span_sse_16(in+j, prev+j, res+j, dir ? dir+j : NULL, n-j);
+}
+
+static size_t compute_pathsum_span_sse_16(const enval *in, const uint16_t *prev,
+                                          uint16_t *res, uint8_t *dir, size_t n) {
+  const size_t elts_per_vec = sizeof(__m128i) / sizeof(uint16_t);
+  size_t j = 0;
+
+  for (; j+elts_per_vec <= n; j += elts_per_vec) {
+    __m128i curvals = _mm_cvtepu8_epi16(_mm_loadl_epi64((const void *)(in+j)));
+    __m128i ll = _mm_loadu_si128((const void *)(prev+j-1));
+    __m128i cc = _mm_loadu_si128((const void *)(prev+j));
+    __m128i rr = _mm_loadu_si128((const void *)(prev+j+1));
+
+    __m128i minvals = _mm_min_epu16(_mm_min_epu16(ll, cc), rr);
+    _mm_storeu_si128((void *)(res+j), _mm_add_epi16(minvals, curvals));
+
+    if (dir) {
+      __m128i codes = dir_codes_sse_16(ll, cc, rr);
+      _mm_storel_epi64((void *)(dir+j), _mm_packus_epi16(codes, codes));
+    }
+  }
+
+  return j;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static size_t compute_pathsum_span_avx512_32(const enval *in, const uint32_t *prev,
+                                             uint32_t *res, uint8_t *dir, size_t n) {
+  const size_t elts_per_vec = sizeof(__m512i) / sizeof(uint32_t);
+
+  for (size_t j = 0; j < n; j += elts_per_vec) {
+    __mmask16 mask = (__mmask16)~0u;
+    if (n - j < elts_per_vec) {
+      mask = (__mmask16)((1u << (n - j)) - 1);
+    }
+
+    __m512i curvals = _mm512_cvtepu8_epi32(_mm_maskz_loadu_epi8(mask, in+j));
+    __m512i ll = _mm512_maskz_loadu_epi32(mask, prev+j-1);
+    __m512i cc = _mm512_maskz_loadu_epi32(mask, prev+j);
+    __m512i rr = _mm512_maskz_loadu_epi32(mask, prev+j+1);
+
+    __m512i minvals = _mm512_min_epu32(_mm512_min_epu32(ll, cc), rr);
+    _mm512_mask_storeu_epi32(res+j, mask, _mm512_add_epi32(minvals, curvals));
+
+    if (dir) {
+      __mmask16 up = _mm512_cmple_epu32_mask(cc, ll) & _mm512_cmple_epu32_mask(cc, rr);
+      __mmask16 left = (__mmask16)(_mm512_cmple_epu32_mask(ll, rr) & ~up);
+      __m128i codes = _mm_set1_epi8(2);
+      codes = _mm_mask_mov_epi8(codes, left, _mm_setzero_si128());
+      codes = _mm_mask_mov_epi8(codes, up, _mm_set1_epi8(1));
+      _mm_mask_storeu_epi8(dir+j, mask, codes);
+    }
+  }
+
+  return n;
+}
+
+__attribute__((target("avx2")))
+static size_t compute_pathsum_span_avx2_32(const enval *in, const uint32_t *prev,
+                                           uint32_t *res, uint8_t *dir, size_t n) {
+  size_t j = 0;
+
   size_t unroll = 3;
-  size_t elts_per_vec = sizeof(__m256i) / sizeof(enval);
+  size_t elts_per_vec = sizeof(__m256i) / sizeof(uint32_t);
   assert(elts_per_vec == 8);
 
-  // Left vector for min comparison
-  // nned 3, since shifting last one will spill in to next iteration
-  __m256i ll0 = _mm256_loadu_si256((void *)&GET_PIXEL(result, i-1, j+0*elts_per_vec-1));
-  __m256i ll1 = _mm256_loadu_si256((void *)&GET_PIXEL(result, i-1, j+1*elts_per_vec-1));
-  __m256i ll2 = _mm256_loadu_si256((void *)&GET_PIXEL(result, i-1, j+2*elts_per_vec-1));
-  __m256i ll3 = _mm256_loadu_si256((void *)&GET_PIXEL(result, i-1, j+3*elts_per_vec-1));
-
   // shifting immediates for doing blends and shuffles/permutes
   __m256i shift1 = _mm256_set_epi32(0, 7, 6, 5, 4, 3, 2, 1);
   __m256i shift2 = _mm256_set_epi32(1, 0, 7, 6, 5, 4, 3, 2);
 
-  enval *current = &GET_PIXEL(in, i, j);
-  enval *res = &GET_PIXEL(result, i, j);
-  enval *topleft = &GET_PIXEL(result, i-1, j-1);
-  topleft += elts_per_vec*(unroll+1); // starts at the next iteration's addresses
+  const enval *current = in;
+
+  // each vector of the row above starts a column left of its results, and
+  // a fourth is loaded for the right neighbours of the third, so the loop
+  // stops while all of the fourth is still in the span's neighbours. The
+  // vectors are loaded an iteration ahead, the fourth becoming the first.
+  const size_t reach = elts_per_vec*(unroll+1);
+  __m256i ll0 = _mm256_setzero_si256(), ll1 = ll0, ll2 = ll0, ll3 = ll0;
+  if (reach <= n+1) {
+    ll0 = _mm256_loadu_si256((const void *)(prev+0*elts_per_vec-1));
+    ll1 = _mm256_loadu_si256((const void *)(prev+1*elts_per_vec-1));
+    ll2 = _mm256_loadu_si256((const void *)(prev+2*elts_per_vec-1));
+    ll3 = _mm256_loadu_si256((const void *)(prev+3*elts_per_vec-1));
+  }
 
-  for (; j+elts_per_vec*unroll < ww && j+elts_per_vec*unroll <= j0+n; j += elts_per_vec*unroll) {
+  for (; j+reach <= n+1; j += elts_per_vec*unroll) {
     // current energy values
-    __m256i curvals0 = _mm256_loadu_si256((void *)(current+0*elts_per_vec));
-    __m256i curvals1 = _mm256_loadu_si256((void *)(current+1*elts_per_vec));
-    __m256i curvals2 = _mm256_loadu_si256((void *)(current+2*elts_per_vec));
+    __m256i curvals0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const void *)(current+0*elts_per_vec)));
+    __m256i curvals1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const void *)(current+1*elts_per_vec)));
+    __m256i curvals2 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const void *)(current+2*elts_per_vec)));
 
     // Shift left vector by one element left to get center values
     __m256i cc0 = _mm256_blend_epi32(ll0, ll1, 0x1);
@@ -143,11 +524,23 @@ static void compute_pathsum_row(const energymap *in, energymap *result,
     __m256i minvals1 = _mm256_min_epi32(_mm256_min_epi32(ll1, cc1), rr1);
     __m256i minvals2 = _mm256_min_epi32(_mm256_min_epi32(ll2, cc2), rr2);
 
-    // load the next iteration's top left vectors
+    if (dir) {
+      __m256i codes0 = dir_codes_avx2_32(ll0, cc0, rr0);
+      __m256i codes1 = dir_codes_avx2_32(ll1, cc1, rr1);
+      __m256i codes2 = dir_codes_avx2_32(ll2, cc2, rr2);
+      _mm_storel_epi64((void *)(dir+j+0*elts_per_vec), pack_codes_avx2_32(codes0));
+      _mm_storel_epi64((void *)(dir+j+1*elts_per_vec), pack_codes_avx2_32(codes1));
+      _mm_storel_epi64((void *)(dir+j+2*elts_per_vec), pack_codes_avx2_32(codes2));
+    }
+
+    // load the next iteration's top left vectors, if there is one
+    const uint32_t *topleft = prev+j+elts_per_vec*unroll-1;
     ll0 = ll3;
-    ll1 = _mm256_loadu_si256((void *)(topleft+0*elts_per_vec));
-    ll2 = _mm256_loadu_si256((void *)(topleft+1*elts_per_vec));
-    ll3 = _mm256_loadu_si256((void *)(topleft+2*elts_per_vec));
+    if (j+elts_per_vec*unroll+reach <= n+1) {
+      ll1 = _mm256_loadu_si256((const void *)(topleft+1*elts_per_vec));
+      ll2 = _mm256_loadu_si256((const void *)(topleft+2*elts_per_vec));
+      ll3 = _mm256_loadu_si256((const void *)(topleft+3*elts_per_vec));
+    }
 
     _mm256_storeu_si256((void *)(res+0*elts_per_vec), _mm256_add_epi32(minvals0, curvals0));
     _mm256_storeu_si256((void *)(res+1*elts_per_vec), _mm256_add_epi32(minvals1, curvals1));
@@ -155,81 +548,468 @@ static void compute_pathsum_row(const energymap *in, energymap *result,
 
     current += elts_per_vec*unroll;
     res += elts_per_vec*unroll;
-    topleft += elts_per_vec*unroll;
   }
 
-  // finish up the remaining elements
-  for (; j < ww && j < j0+n; j++) {
-    enval ll, cc, rr;
-    cc = GET_PIXEL(result, i-1, j);
-    if (j > 0) ll = GET_PIXEL(result, i-1, j-1);
-    else ll = cc;
-    if (j < ww-1) rr = GET_PIXEL(result, i-1, j+1);
-    else rr = cc;
-    assert(ll >= 0);
-    assert(rr >= 0);
-    assert(cc >= 0);
-    GET_PIXEL(result, i, j) = GET_PIXEL(in, i, j) + min3(ll, cc, rr);
+  return j + compute_pathsum_span_sse_32(current, prev+j, res, dir ? dir+j : NULL, n-j);
+}
+
+static size_t compute_pathsum_span_sse_32(const enval *in, const uint32_t *prev,
+                                          uint32_t *res, uint8_t *dir, size_t n) {
+  const size_t elts_per_vec = sizeof(__m128i) / sizeof(uint32_t);
+  size_t j = 0;
+
+  for (; j+elts_per_vec <= n; j += elts_per_vec) {
+    __m128i curvals = _mm_cvtepu8_epi32(_mm_loadu_si32(in+j));
+    __m128i ll = _mm_loadu_si128((const void *)(prev+j-1));
+    __m128i cc = _mm_loadu_si128((const void *)(prev+j));
+    __m128i rr = _mm_loadu_si128((const void *)(prev+j+1));
+
+    __m128i minvals = _mm_min_epu32(_mm_min_epu32(ll, cc), rr);
+    _mm_storeu_si128((void *)(res+j), _mm_add_epi32(minvals, curvals));
+
+    if (dir) {
+      __m128i codes = dir_codes_sse_32(ll, cc, rr);
+      codes = _mm_packs_epi32(codes, codes);
+      _mm_storeu_si32(dir+j, _mm_packus_epi16(codes, codes));
+    }
+  }
+
+  return j;
+}
+
+/*
+ * Forward energy charges each step of a seam for the edges it leaves behind
+ * when the pixels either side of it close up, rather than for the pixel it
+ * takes. Every step costs the difference between the pixel's left and right
+ * neighbours, which end up side by side, and a diagonal step also costs the
+ * difference between the pixel above and whichever neighbour ends up under
+ * it. The costs are worked out from the gray rows as the path sums go, and
+ * quartered so a row adds at most MAX_FORWARD_COST.
+ *
+ * Rows with gaps in them come in short spans, so the masked avx512 kernels
+ * are worth having here just for not leaving a tail to the narrower ones.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static size_t compute_forward_span_avx512_16(const pixval *in, const pixval *up,
+                                             const uint16_t *prev, uint16_t *res,
+                                             uint8_t *dir, size_t n) {
+  const size_t elts_per_vec = sizeof(__m512i) / sizeof(uint16_t);
+
+  for (size_t j = 0; j < n; j += elts_per_vec) {
+    __mmask32 mask = (__mmask32)~0u;
+    if (n - j < elts_per_vec) {
+      mask = (__mmask32)((1u << (n - j)) - 1);
+    }
+
+    __m512i ll = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, in+j-1));
+    __m512i rr = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, in+j+1));
+    __m512i uu = _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, up+j));
+
+    __m512i cu = _mm512_abs_epi16(_mm512_sub_epi16(rr, ll));
+    __m512i cl = _mm512_add_epi16(cu, _mm512_abs_epi16(_mm512_sub_epi16(uu, ll)));
+    __m512i cr = _mm512_add_epi16(cu, _mm512_abs_epi16(_mm512_sub_epi16(uu, rr)));
+
+    __m512i vl = _mm512_add_epi16(_mm512_maskz_loadu_epi16(mask, prev+j-1),
+                                  _mm512_srli_epi16(cl, 2));
+    __m512i vc = _mm512_add_epi16(_mm512_maskz_loadu_epi16(mask, prev+j),
+                                  _mm512_srli_epi16(cu, 2));
+    __m512i vr = _mm512_add_epi16(_mm512_maskz_loadu_epi16(mask, prev+j+1),
+                                  _mm512_srli_epi16(cr, 2));
+
+    __m512i minvals = _mm512_min_epu16(_mm512_min_epu16(vl, vc), vr);
+    _mm512_mask_storeu_epi16(res+j, mask, minvals);
+
+    __mmask32 upward = _mm512_cmple_epu16_mask(vc, vl) & _mm512_cmple_epu16_mask(vc, vr);
+    __mmask32 left = _mm512_cmple_epu16_mask(vl, vr) & ~upward;
+    __m256i codes = _mm256_set1_epi8(2);
+    codes = _mm256_mask_mov_epi8(codes, left, _mm256_setzero_si256());
+    codes = _mm256_mask_mov_epi8(codes, upward, _mm256_set1_epi8(1));
+    _mm256_mask_storeu_epi8(dir+j, mask, codes);
+  }
+
+  return n;
+}
+
+__attribute__((target("avx2")))
+static size_t compute_forward_span_avx2_16(const pixval *in, const pixval *up,
+                                           const uint16_t *prev, uint16_t *res,
+                                           uint8_t *dir, size_t n) {
+  const size_t elts_per_vec = sizeof(__m256i) / sizeof(uint16_t);
+  size_t j = 0;
+
+  for (; j+elts_per_vec <= n; j += elts_per_vec) {
+    __m256i ll = _mm256_cvtepu8_epi16(_mm_loadu_si128((const void *)(in+j-1)));
+    __m256i rr = _mm256_cvtepu8_epi16(_mm_loadu_si128((const void *)(in+j+1)));
+    __m256i uu = _mm256_cvtepu8_epi16(_mm_loadu_si128((const void *)(up+j)));
+
+    __m256i cu = _mm256_abs_epi16(_mm256_sub_epi16(rr, ll));
+    __m256i cl = _mm256_add_epi16(cu, _mm256_abs_epi16(_mm256_sub_epi16(uu, ll)));
+    __m256i cr = _mm256_add_epi16(cu, _mm256_abs_epi16(_mm256_sub_epi16(uu, rr)));
+
+    __m256i vl = _mm256_add_epi16(_mm256_loadu_si256((const void *)(prev+j-1)),
+                                  _mm256_srli_epi16(cl, 2));
+    __m256i vc = _mm256_add_epi16(_mm256_loadu_si256((const void *)(prev+j)),
+                                  _mm256_srli_epi16(cu, 2));
+    __m256i vr = _mm256_add_epi16(_mm256_loadu_si256((const void *)(prev+j+1)),
+                                  _mm256_srli_epi16(cr, 2));
+
+    __m256i minvals = _mm256_min_epu16(_mm256_min_epu16(vl, vc), vr);
+    _mm256_storeu_si256((void *)(res+j), minvals);
+
+    __m256i codes = dir_codes_avx2_16(vl, vc, vr);
+    __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(codes),
+                                      _mm256_extracti128_si256(codes, 1));
+    _mm_storeu_si128((void *)(dir+j), packed);
   }
+
+  return j + compute_forward_span_sse_16(in+j, up+j, prev+j, res+j, dir+j, n-j);
 }
 
-void find_minseam(const energymap *pathsum, size_t *result) {
-  assert(IS_IMAGE(pathsum));
-  assert(result);
+static size_t compute_forward_span_sse_16(const pixval *in, const pixval *up,
+                                          const uint16_t *prev, uint16_t *res,
+                                          uint8_t *dir, size_t n) {
+  const size_t elts_per_vec = sizeof(__m128i) / sizeof(uint16_t);
+  size_t j = 0;
 
-  size_t ww = pathsum->width;
-  size_t hh = pathsum->height;
+  for (; j+elts_per_vec <= n; j += elts_per_vec) {
+    __m128i ll = _mm_cvtepu8_epi16(_mm_loadl_epi64((const void *)(in+j-1)));
+    __m128i rr = _mm_cvtepu8_epi16(_mm_loadl_epi64((const void *)(in+j+1)));
+    __m128i uu = _mm_cvtepu8_epi16(_mm_loadl_epi64((const void *)(up+j)));
 
-  enval minval = GET_PIXEL(pathsum, hh-1, 0);
-  size_t minidx = 0;
-  for (size_t j = 0; j < ww; j++) {
-    enval val = GET_PIXEL(pathsum, hh-1, j);
-    if (val < minval) {
-      minval = val;
-      minidx = j;
+    __m128i cu = _mm_abs_epi16(_mm_sub_epi16(rr, ll));
+    __m128i cl = _mm_add_epi16(cu, _mm_abs_epi16(_mm_sub_epi16(uu, ll)));
+    __m128i cr = _mm_add_epi16(cu, _mm_abs_epi16(_mm_sub_epi16(uu, rr)));
+
+    __m128i vl = _mm_add_epi16(_mm_loadu_si128((const void *)(prev+j-1)), _mm_srli_epi16(cl, 2));
+    __m128i vc = _mm_add_epi16(_mm_loadu_si128((const void *)(prev+j)), _mm_srli_epi16(cu, 2));
+    __m128i vr = _mm_add_epi16(_mm_loadu_si128((const void *)(prev+j+1)), _mm_srli_epi16(cr, 2));
+
+    _mm_storeu_si128((void *)(res+j), _mm_min_epu16(_mm_min_epu16(vl, vc), vr));
+
+    __m128i codes = dir_codes_sse_16(vl, vc, vr);
+    _mm_storel_epi64((void *)(dir+j), _mm_packus_epi16(codes, codes));
+  }
+
+  return j;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+static size_t compute_forward_span_avx512_32(const pixval *in, const pixval *up,
+                                             const uint32_t *prev, uint32_t *res,
+                                             uint8_t *dir, size_t n) {
+  const size_t elts_per_vec = sizeof(__m512i) / sizeof(uint32_t);
+
+  for (size_t j = 0; j < n; j += elts_per_vec) {
+    __mmask16 mask = (__mmask16)~0u;
+    if (n - j < elts_per_vec) {
+      mask = (__mmask16)((1u << (n - j)) - 1);
     }
+
+    __m512i ll = _mm512_cvtepu8_epi32(_mm_maskz_loadu_epi8(mask, in+j-1));
+    __m512i rr = _mm512_cvtepu8_epi32(_mm_maskz_loadu_epi8(mask, in+j+1));
+    __m512i uu = _mm512_cvtepu8_epi32(_mm_maskz_loadu_epi8(mask, up+j));
+
+    __m512i cu = _mm512_abs_epi32(_mm512_sub_epi32(rr, ll));
+    __m512i cl = _mm512_add_epi32(cu, _mm512_abs_epi32(_mm512_sub_epi32(uu, ll)));
+    __m512i cr = _mm512_add_epi32(cu, _mm512_abs_epi32(_mm512_sub_epi32(uu, rr)));
+
+    __m512i vl = _mm512_add_epi32(_mm512_maskz_loadu_epi32(mask, prev+j-1),
+                                  _mm512_srli_epi32(cl, 2));
+    __m512i vc = _mm512_add_epi32(_mm512_maskz_loadu_epi32(mask, prev+j),
+                                  _mm512_srli_epi32(cu, 2));
+    __m512i vr = _mm512_add_epi32(_mm512_maskz_loadu_epi32(mask, prev+j+1),
+                                  _mm512_srli_epi32(cr, 2));
+
+    __m512i minvals = _mm512_min_epu32(_mm512_min_epu32(vl, vc), vr);
+    _mm512_mask_storeu_epi32(res+j, mask, minvals);
+
+    __mmask16 upward = _mm512_cmple_epu32_mask(vc, vl) & _mm512_cmple_epu32_mask(vc, vr);
+    __mmask16 left = (__mmask16)(_mm512_cmple_epu32_mask(vl, vr) & ~upward);
+    __m128i codes = _mm_set1_epi8(2);
+    codes = _mm_mask_mov_epi8(codes, left, _mm_setzero_si128());
+    codes = _mm_mask_mov_epi8(codes, upward, _mm_set1_epi8(1));
+    _mm_mask_storeu_epi8(dir+j, mask, codes);
   }
 
-  result[hh-1] = minidx;
+  return n;
+}
 
-  for (size_t i = hh-2; i != SIZE_MAX; i--) {
-    size_t previdx = result[i+1];
-    enval cc = GET_PIXEL(pathsum, i, previdx);
-    int delta;
-    if (previdx == 0) {
-      enval rr = GET_PIXEL(pathsum, i, previdx+1);
-      delta = min2idx(cc, rr);
-    } else if (previdx == ww-1) {
-      enval ll = GET_PIXEL(pathsum, i, previdx-1);
-      delta = -min2idx(cc, ll);
-    } else {
-      enval ll = GET_PIXEL(pathsum, i, previdx-1);
-      enval rr = GET_PIXEL(pathsum, i, previdx+1);
-      delta = min3idx(ll, cc, rr);
+__attribute__((target("avx2")))
+static size_t compute_forward_span_avx2_32(const pixval *in, const pixval *up,
+                                           const uint32_t *prev, uint32_t *res,
+                                           uint8_t *dir, size_t n) {
+  const size_t elts_per_vec = sizeof(__m256i) / sizeof(uint32_t);
+  size_t j = 0;
+
+  for (; j+elts_per_vec <= n; j += elts_per_vec) {
+    __m256i ll = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const void *)(in+j-1)));
+    __m256i rr = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const void *)(in+j+1)));
+    __m256i uu = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const void *)(up+j)));
+
+    __m256i cu = _mm256_abs_epi32(_mm256_sub_epi32(rr, ll));
+    __m256i cl = _mm256_add_epi32(cu, _mm256_abs_epi32(_mm256_sub_epi32(uu, ll)));
+    __m256i cr = _mm256_add_epi32(cu, _mm256_abs_epi32(_mm256_sub_epi32(uu, rr)));
+
+    __m256i vl = _mm256_add_epi32(_mm256_loadu_si256((const void *)(prev+j-1)),
+                                  _mm256_srli_epi32(cl, 2));
+    __m256i vc = _mm256_add_epi32(_mm256_loadu_si256((const void *)(prev+j)),
+                                  _mm256_srli_epi32(cu, 2));
+    __m256i vr = _mm256_add_epi32(_mm256_loadu_si256((const void *)(prev+j+1)),
+                                  _mm256_srli_epi32(cr, 2));
+
+    __m256i minvals = _mm256_min_epu32(_mm256_min_epu32(vl, vc), vr);
+    _mm256_storeu_si256((void *)(res+j), minvals);
+
+    __m256i codes = dir_codes_avx2_32(vl, vc, vr);
+    _mm_storel_epi64((void *)(dir+j), pack_codes_avx2_32(codes));
+  }
+
+  return j + compute_forward_span_sse_32(in+j, up+j, prev+j, res+j, dir+j, n-j);
+}
+
+static size_t compute_forward_span_sse_32(const pixval *in, const pixval *up,
+                                          const uint32_t *prev, uint32_t *res,
+                                          uint8_t *dir, size_t n) {
+  const size_t elts_per_vec = sizeof(__m128i) / sizeof(uint32_t);
+  size_t j = 0;
+
+  for (; j+elts_per_vec <= n; j += elts_per_vec) {
+    __m128i ll = _mm_cvtepu8_epi32(_mm_loadu_si32(in+j-1));
+    __m128i rr = _mm_cvtepu8_epi32(_mm_loadu_si32(in+j+1));
+    __m128i uu = _mm_cvtepu8_epi32(_mm_loadu_si32(up+j));
+
+    __m128i cu = _mm_abs_epi32(_mm_sub_epi32(rr, ll));
+    __m128i cl = _mm_add_epi32(cu, _mm_abs_epi32(_mm_sub_epi32(uu, ll)));
+    __m128i cr = _mm_add_epi32(cu, _mm_abs_epi32(_mm_sub_epi32(uu, rr)));
+
+    __m128i vl = _mm_add_epi32(_mm_loadu_si128((const void *)(prev+j-1)), _mm_srli_epi32(cl, 2));
+    __m128i vc = _mm_add_epi32(_mm_loadu_si128((const void *)(prev+j)), _mm_srli_epi32(cu, 2));
+    __m128i vr = _mm_add_epi32(_mm_loadu_si128((const void *)(prev+j+1)), _mm_srli_epi32(cr, 2));
+
+    _mm_storeu_si128((void *)(res+j), _mm_min_epu32(_mm_min_epu32(vl, vc), vr));
+
+    __m128i codes = dir_codes_sse_32(vl, vc, vr);
+    codes = _mm_packs_epi32(codes, codes);
+    _mm_storeu_si32(dir+j, _mm_packus_epi16(codes, codes));
+  }
+
+  return j;
+}
+
+/**
+ * @brief The forward costs of reaching a pixel from up and to the left,
+ *        straight up and up and to the right.
+ * @param l the pixel to the left, or the pixel itself at the left edge
+ * @param r the pixel to the right, or the pixel itself at the right edge
+ * @param u the pixel above
+ */
+static void forward_costs(pixval l, pixval r, pixval u, uint32_t *cl, uint32_t *cu,
+                          uint32_t *cr) {
+  uint32_t sides = (uint32_t)abs(r - l);
+  *cl = (sides + (uint32_t)abs(u - l)) >> 2;
+  *cu = sides >> 2;
+  *cr = (sides + (uint32_t)abs(u - r)) >> 2;
+}
+
+/*
+ * The direction codes from comparisons of the three path sums above, where
+ * each comparison is -1 where it holds. The code starts at 2 for up and to
+ * the right, and takes 2 off for the left or 1 for straight up.
+ */
+__attribute__((target("avx2")))
+static __m256i dir_codes_avx2_16(__m256i ll, __m256i cc, __m256i rr) {
+  __m256i up = _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_min_epu16(cc, ll), cc),
+                                _mm256_cmpeq_epi16(_mm256_min_epu16(cc, rr), cc));
+  __m256i left = _mm256_andnot_si256(up, _mm256_cmpeq_epi16(_mm256_min_epu16(ll, rr), ll));
+  return _mm256_add_epi16(_mm256_set1_epi16(2),
+                          _mm256_add_epi16(_mm256_add_epi16(left, left), up));
+}
+
+__attribute__((target("avx2")))
+static __m256i dir_codes_avx2_32(__m256i ll, __m256i cc, __m256i rr) {
+  __m256i up = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_min_epu32(cc, ll), cc),
+                                _mm256_cmpeq_epi32(_mm256_min_epu32(cc, rr), cc));
+  __m256i left = _mm256_andnot_si256(up, _mm256_cmpeq_epi32(_mm256_min_epu32(ll, rr), ll));
+  return _mm256_add_epi32(_mm256_set1_epi32(2),
+                          _mm256_add_epi32(_mm256_add_epi32(left, left), up));
+}
+
+// the low 8 bytes of the result hold the eight codes
+__attribute__((target("avx2")))
+static __m128i pack_codes_avx2_32(__m256i codes) {
+  __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(codes),
+                                  _mm256_extracti128_si256(codes, 1));
+  return _mm_packus_epi16(words, words);
+}
+
+static __m128i dir_codes_sse_16(__m128i ll, __m128i cc, __m128i rr) {
+  __m128i up = _mm_and_si128(_mm_cmpeq_epi16(_mm_min_epu16(cc, ll), cc),
+                             _mm_cmpeq_epi16(_mm_min_epu16(cc, rr), cc));
+  __m128i left = _mm_andnot_si128(up, _mm_cmpeq_epi16(_mm_min_epu16(ll, rr), ll));
+  return _mm_add_epi16(_mm_set1_epi16(2), _mm_add_epi16(_mm_add_epi16(left, left), up));
+}
+
+static __m128i dir_codes_sse_32(__m128i ll, __m128i cc, __m128i rr) {
+  __m128i up = _mm_and_si128(_mm_cmpeq_epi32(_mm_min_epu32(cc, ll), cc),
+                             _mm_cmpeq_epi32(_mm_min_epu32(cc, rr), cc));
+  __m128i left = _mm_andnot_si128(up, _mm_cmpeq_epi32(_mm_min_epu32(ll, rr), ll));
+  return _mm_add_epi32(_mm_set1_epi32(2), _mm_add_epi32(_mm_add_epi32(left, left), up));
+}
+
+/*
+ * The first of the smallest path sums in a row. Only one row is searched per
+ * seam, so these stick to sse: the first pass finds the smallest value and
+ * the second finds where it first appears.
+ */
+static size_t argmin_16(const uint16_t *row, size_t n) {
+  assert(n > 0);
+
+  size_t j = 0;
+  uint16_t minval = row[0];
+  if (n >= 8) {
+    __m128i mins = _mm_loadu_si128((const void *)row);
+    for (j = 8; j+8 <= n; j += 8) {
+      mins = _mm_min_epu16(mins, _mm_loadu_si128((const void *)(row+j)));
+    }
+    // phminposuw finds the smallest of the eight
+    minval = (uint16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(mins));
+  }
+  for (; j < n; j++) {
+    if (row[j] < minval) minval = row[j];
+  }
+
+  __m128i target = _mm_set1_epi16((short)minval);
+  for (j = 0; j+8 <= n; j += 8) {
+    __m128i eq = _mm_cmpeq_epi16(_mm_loadu_si128((const void *)(row+j)), target);
+    int bits = _mm_movemask_epi8(eq);
+    if (bits) {
+      return j + (size_t)__builtin_ctz((unsigned)bits) / 2;
     }
-    size_t col = (size_t)((int64_t)(previdx) + delta);
-    assert(col < ww);
-    result[i] = col;
   }
+  for (; row[j] != minval; j++);
+  return j;
 }
 
-static enval min3(enval a, enval b, enval c) {
+static size_t argmin_32(const uint32_t *row, size_t n) {
+  assert(n > 0);
+
+  size_t j = 0;
+  uint32_t minval = row[0];
+  if (n >= 4) {
+    __m128i mins = _mm_loadu_si128((const void *)row);
+    for (j = 4; j+4 <= n; j += 4) {
+      mins = _mm_min_epu32(mins, _mm_loadu_si128((const void *)(row+j)));
+    }
+    mins = _mm_min_epu32(mins, _mm_shuffle_epi32(mins, _MM_SHUFFLE(1, 0, 3, 2)));
+    mins = _mm_min_epu32(mins, _mm_shuffle_epi32(mins, _MM_SHUFFLE(2, 3, 0, 1)));
+    minval = (uint32_t)_mm_cvtsi128_si32(mins);
+  }
+  for (; j < n; j++) {
+    if (row[j] < minval) minval = row[j];
+  }
+
+  __m128i target = _mm_set1_epi32((int)minval);
+  for (j = 0; j+4 <= n; j += 4) {
+    __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const void *)(row+j)), target);
+    int bits = _mm_movemask_epi8(eq);
+    if (bits) {
+      return j + (size_t)__builtin_ctz((unsigned)bits) / 4;
+    }
+  }
+  for (; row[j] != minval; j++);
+  return j;
+}
+
+/**
+ * @brief Follow the recorded directions up from result[height-1].
+ * @param gaps seams marked as removed but still in the buffers, or NULL
+ */
+static void trace_seam(const pathsum_dirs *dirs, size_t *result, const seam_gaps *gaps) {
+  size_t hh = dirs->height;
+
+  if (gaps && gaps->count > 0) {
+    for (size_t i = hh-1; i > 0; i--) {
+      uint8_t code = GET_PIXEL(dirs, i, gaps_col(gaps, i, result[i]));
+      result[i-1] = result[i] + code - 1;
+    }
+    return;
+  }
+
+  for (size_t i = hh-1; i > 0; i--) {
+    result[i-1] = result[i] + GET_PIXEL(dirs, i, result[i]) - 1;
+  }
+}
+
+static int compare_candidates(const void *a, const void *b) {
+  const seam_candidate *ca = a;
+  const seam_candidate *cb = b;
+  if (ca->val != cb->val) return ca->val < cb->val ? -1 : 1;
+  if (ca->col != cb->col) return ca->col < cb->col ? -1 : 1;
+  return 0;
+}
+
+static uint32_t min3(uint32_t a, uint32_t b, uint32_t c) {
   if (b <= a && b <= c) return b;
   if (a <= c) return a;
   return c;
 }
 
-static int min3idx(enval a, enval b, enval c) {
+static int min3idx(uint32_t a, uint32_t b, uint32_t c) {
   if (b <= a && b <= c) return 0;
   if (a <= c) return -1;
   return 1;
 }
 
-static int min2idx(enval a, enval b) {
+static int min2idx(uint32_t a, uint32_t b) {
   if (a <= b) return 0;
   return 1;
 }
 
+/*
+ * The first and last bytes that differ between two runs of n bytes, or n if
+ * none do. Most of a row a partial recompute compares is unchanged, so the
+ * bytes are compared sixteen at a time.
+ */
+static size_t first_change(const void *a, const void *b, size_t n) {
+  const uint8_t *pa = a;
+  const uint8_t *pb = b;
+  size_t k = 0;
+  for (; k+16 <= n; k += 16) {
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const void *)(pa+k)),
+                                _mm_loadu_si128((const void *)(pb+k)));
+    unsigned diff = ~(unsigned)_mm_movemask_epi8(eq) & 0xffffu;
+    if (diff) {
+      return k + (size_t)__builtin_ctz(diff);
+    }
+  }
+  for (; k < n; k++) {
+    if (pa[k] != pb[k]) {
+      return k;
+    }
+  }
+  return n;
+}
+
+static size_t last_change(const void *a, const void *b, size_t n) {
+  const uint8_t *pa = a;
+  const uint8_t *pb = b;
+  size_t k = n;
+  for (; k >= 16; k -= 16) {
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const void *)(pa+k-16)),
+                                _mm_loadu_si128((const void *)(pb+k-16)));
+    unsigned diff = ~(unsigned)_mm_movemask_epi8(eq) & 0xffffu;
+    if (diff) {
+      return k - 16 + (size_t)(31 - __builtin_clz(diff));
+    }
+  }
+  for (; k > 0; k--) {
+    if (pa[k-1] != pb[k-1]) {
+      return k-1;
+    }
+  }
+  return n;
+}
+
 static size_t min(size_t a, size_t b) {
   if (a <= b) return a;
   return b;
@@ -6,13 +6,161 @@
 #ifndef _PATHSUM_H_
 #define _PATHSUM_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arena.h"
 #include "car_internal.h"
 #include "energy.h"
+#include "gaps.h"
+#include "threadpool.h"
+
+// the most a forward energy step costs, a quarter of two differences of bytes
+#define MAX_FORWARD_COST 127
+
+// path sums grow by at most MAX_ENERGY or MAX_FORWARD_COST a row, so they
+// fit in 16 bits for images up to this many rows
+#define PATHSUM16_MAX_HEIGHT (UINT16_MAX / MAX_FORWARD_COST)
+
+_Static_assert(MAX_ENERGY <= MAX_FORWARD_COST, "energies outgrow PATHSUM16_MAX_HEIGHT");
+
+typedef struct {
+  uint16_t *data;
+  size_t width;
+  size_t height;
+  size_t buf_width;
+  size_t buf_height;
+  size_t buf_start;
+} pathsum16;
+
+typedef struct {
+  uint32_t *data;
+  size_t width;
+  size_t height;
+  size_t buf_width;
+  size_t buf_height;
+  size_t buf_start;
+} pathsum32;
+
+// which pixel of the row above each path sum was reached from, as 0, 1 or 2
+// for the one up and to the left, straight up, or up and to the right
+typedef struct {
+  uint8_t *data;
+  size_t width;
+  size_t height;
+  size_t buf_width;
+  size_t buf_height;
+  size_t buf_start;
+} pathsum_dirs;
+
+/*
+ * Path sums of an image, in 16 bits when the image is short enough, which
+ * halves the memory the kernels have to stream through, and in 32 bits
+ * otherwise. Only one of the two has data, but both keep the geometry.
+ * The directions are optional, and let seams be traced a byte per row.
+ */
+typedef struct {
+  pathsum16 narrow;
+  pathsum32 wide;
+  pathsum_dirs dirs;
+  void *saved;  // a row of path sums from before a partial recompute
+} pathsum_map;
+
+// how far a partial recompute spread out from the seam
+typedef struct {
+  size_t values;  // path sums computed, over every row
+  size_t widest;  // most path sums computed in one row
+} pathsum_cone;
 
-void compute_pathsum(const energymap *in, energymap *result);
+/**
+ * @brief Allocate the path sums of a width x height image out of an arena.
+ * @param dirs whether to record directions alongside the path sums
+ * @param a the arena, or NULL to only set up the geometry, for buffers that
+ *          are resized along with the others but never hold path sums
+ * @return 0, or 1 if there isn't the memory
+ */
+int pathsum_init(pathsum_map *ps, size_t width, size_t height, bool dirs, arena *a);
 
-size_t compute_pathsum_partial(const energymap *in, energymap *result, size_t *removed);
+/**
+ * @brief Compute the least path sum to every pixel of an energy map.
+ * @param pool threads to split the work between, or NULL
+ */
+void compute_pathsum(const energymap *in, pathsum_map *result, threadpool *pool);
 
-void find_minseam(const energymap *pathsum, size_t *result);
+/**
+ * @brief Compute the least path sum of forward energy to every pixel.
+ *
+ * The forward energy of a step is the contrast of the new edges it leaves
+ * behind, so it depends on the direction, and the seams can only be traced
+ * with directions. The result has to be set up to record them.
+ */
+void compute_pathsum_forward(const gray_image *in, pathsum_map *result, threadpool *pool);
+
+/**
+ * @brief compute_pathsum_partial for forward energy.
+ */
+void compute_pathsum_forward_partial(const gray_image *in, pathsum_map *result,
+                                     const size_t *removed, const seam_gaps *gaps,
+                                     threadpool *pool, pathsum_cone *cone);
+
+/**
+ * @brief Recompute the path sums that changed after a seam was removed.
+ *
+ * Each row is recomputed next to the seam, where its energies changed, and
+ * under the path sums of the row above that changed, so the recompute only
+ * spreads as far down as the seam's removal actually makes a difference.
+ *
+ * @param removed the seam that was removed, in the old image's columns
+ * @param gaps seams marked as removed but still in the buffers, or NULL
+ * @param pool threads to split the wide rows between, or NULL
+ * @param cone receives how many path sums were computed
+ */
+void compute_pathsum_partial(const energymap *in, pathsum_map *result, const size_t *removed,
+                             const seam_gaps *gaps, threadpool *pool, pathsum_cone *cone);
+
+/**
+ * @brief Find the cheapest seam within a band of columns around a guide.
+ *
+ * Only the band's path sums are computed, so this takes height * band work
+ * rather than height * width, but the seam can't leave the band. The band
+ * follows the guide as closely as it can while moving at most one column a
+ * row, so that every row of it connects with the row above.
+ *
+ * @param in the energies to find the seam in, or NULL for forward energy
+ * @param gray the gray image for forward energy, with in NULL
+ * @param guide the column to centre the band on in every row
+ * @param band how many columns either side of the guide to search
+ * @param result receives the seam's column in every row
+ * @param gaps seams marked as removed but still in the buffers, or NULL
+ * @param a arena for the band's path sums, given back before returning
+ * @return 0, or 1 if there isn't the memory
+ */
+int find_seam_in_band(const energymap *in, const gray_image *gray, const size_t *guide,
+                      size_t band, size_t *result, const seam_gaps *gaps, arena *a);
+
+/**
+ * @brief Find the cheapest seam in a pathsum.
+ * @param result receives the seam's column in every row
+ * @param gaps seams marked as removed but still in the buffers, or NULL
+ */
+void find_minseam(const pathsum_map *pathsum, size_t *result, const seam_gaps *gaps);
+
+/**
+ * @brief Find several seams in one pathsum that don't touch or cross.
+ *
+ * The first seam is the one find_minseam finds. The rest are traced up from
+ * the next cheapest pixels of the bottom row, and dropped if they run into a
+ * seam that was already found, so they're only approximately the next
+ * cheapest seams.
+ *
+ * @param nseams the most seams to find
+ * @param result receives height columns for each seam found, seam by seam
+ * @param claimed width*height flags of scratch space, all clear, and left
+ *                clear on return
+ * @param a arena for the candidate seams, given back before returning
+ * @return the number of seams found, at least 1
+ */
+size_t find_minseams(const pathsum_map *pathsum, size_t nseams, size_t *result,
+                     uint8_t *claimed, arena *a);
 
 #endif /* _PATHSUM_H_ */
@@ -0,0 +1,801 @@
+/**
+ * @file pathsum_impl.h
+ * @brief The pathsum routines for one width of path sum
+ *
+ * pathsum.c includes this once for each width it stores path sums in, with
+ * PSVAL defined as the type of a path sum, PSMAP as the type of a map of
+ * them, and PS(name) giving each routine a name of its own for that width.
+ * It isn't a header in its own right, so it has no include guard.
+ */
+
+static void PS(compute_pathsum_span)(const enval *in, const PSVAL *prev, PSVAL *res,
+                                     uint8_t *dir, size_t n);
+static void PS(compute_forward_span)(const pixval *in, const pixval *up, const PSVAL *prev,
+                                     PSVAL *res, uint8_t *dir, size_t n);
+static size_t PS(compute_pathsum_rows)(const energymap *in, const gray_image *gray,
+                                       PSMAP *result, pathsum_dirs *dirs, size_t i0,
+                                       size_t i1, size_t j0, size_t j1,
+                                       const seam_gaps *gaps, threadpool *pool);
+static void PS(compute_pathsum_row)(const energymap *in, const gray_image *gray,
+                                    PSMAP *result, pathsum_dirs *dirs, size_t i,
+                                    size_t j0, size_t n, const seam_gaps *gaps);
+static void PS(compute_pathsum_row_gaps)(const energymap *in, PSMAP *result,
+                                         pathsum_dirs *dirs, size_t i, size_t j0,
+                                         size_t n, const seam_gaps *gaps);
+static void PS(compute_forward_row)(const gray_image *gray, PSMAP *result,
+                                    pathsum_dirs *dirs, size_t i, size_t j0, size_t n);
+static void PS(compute_forward_row_gaps)(const gray_image *gray, PSMAP *result,
+                                         pathsum_dirs *dirs, size_t i, size_t j0,
+                                         size_t n, const seam_gaps *gaps);
+static void PS(forward_pixel)(pixval l, pixval r, pixval u, const PSVAL *above_l,
+                              PSVAL above_c, const PSVAL *above_r, PSVAL *res, uint8_t *dir);
+static void PS(compute_pathsum_tile)(void *arg, size_t task);
+static void PS(compute_pathsum_gap)(void *arg, size_t task);
+static void PS(find_minseam_gaps)(const PSMAP *pathsum, const pathsum_dirs *dirs,
+                                  size_t *result, const seam_gaps *gaps);
+static bool PS(backtrack_seam)(const PSMAP *pathsum, const pathsum_dirs *dirs,
+                               size_t col, size_t *result, const uint8_t *claimed);
+
+/*
+ * A block of rows split into tiles for threads. Every row depends on the one
+ * above it, so the block is done in two steps. First each tile computes a
+ * trapezoid that narrows by one column on each side per row, which needs
+ * nothing from its neighbours. Then the triangular gaps left between
+ * neighbouring trapezoids are filled in, each from the two trapezoids around
+ * it. Tiles at the edges of the block don't narrow on their outer side.
+ */
+typedef struct {
+  const energymap *in;
+  const gray_image *gray;
+  PSMAP *result;
+  pathsum_dirs *dirs;
+  const seam_gaps *gaps;
+  size_t i0;     // first row of the block
+  size_t i1;     // one past the last row of the block
+  size_t j0;     // first column of the block's first row
+  size_t j1;     // one past the last column of the block's first row
+  size_t tile;   // width of the tiles in the block's first row
+  size_t ntiles;
+} PS(pathsum_block);
+
+/*
+ * The path sums add up either an energy map, or with gray set instead, the
+ * forward energies of the gray image, which need directions to trace.
+ */
+static void PS(compute_pathsum)(const energymap *in, const gray_image *gray, PSMAP *result,
+                                pathsum_dirs *dirs, threadpool *pool) {
+  assert(!in != !gray);
+  assert(!in || (in->width == result->width && in->height == result->height));
+  assert(!gray || (gray->width == result->width && gray->height == result->height));
+  assert(!gray || dirs);
+  assert(IS_IMAGE(result));
+
+  size_t ww = result->width;
+  size_t hh = result->height;
+
+  // push the min val down
+  PS(compute_pathsum_rows)(in, gray, result, dirs, 0, hh, 0, ww, NULL, pool);
+}
+
+static void PS(compute_pathsum_partial)(const energymap *in, const gray_image *gray,
+                                        PSMAP *result, pathsum_dirs *dirs,
+                                        const size_t *removed, const seam_gaps *gaps,
+                                        void *saved, threadpool *pool, pathsum_cone *cone) {
+  assert(!in != !gray);
+  assert(!in || (in->width == result->width && in->height == result->height));
+  assert(!gray || (gray->width == result->width && gray->height == result->height));
+  assert(!gray || dirs);
+  assert(IS_IMAGE(result));
+  assert(removed);
+  assert(saved);
+  assert(cone);
+
+  size_t ww = result->width;
+  size_t hh = result->height;
+
+  // a forward energy also changes where the pixel above has a new neighbour,
+  // one column further out, and in the first row, which has energies too.
+  // Other energies changed wherever compute_energymap_partial redid them
+  const size_t margin = gray ? 2 : 1;
+  const size_t ngaps = gaps ? gaps->count : 0;
+
+  // the columns of the row above whose path sums changed, none if c1 <= c0
+  size_t c0 = 0;
+  size_t c1 = 0;
+
+  cone->values = 0;
+  cone->widest = 0;
+
+  for (size_t i = 0; i < hh; i++) {
+    size_t lo = ww;
+    size_t hi = 0;
+    if (gray && i == 0) {
+      lo = removed[0] > 0 ? removed[0] - 1 : 0;
+      hi = min(lo + 2, ww);
+    }
+    if (!gray) {
+      energymap_partial_cols(i, hh, ww, removed[i], &lo, &hi);
+    }
+    if (i > 0) {
+      lo = min(lo, removed[i-1] >= margin ? removed[i-1] - margin : 0);
+      hi = max(hi, min(removed[i-1] + margin, ww));
+    }
+    if (c1 > c0) {
+      lo = min(lo, c0 > 0 ? c0 - 1 : 0);
+      hi = max(hi, min(c1 + 1, ww));
+    }
+    assert(hi > lo);
+
+    // a wide row is split up between threads, which only works with a range
+    // that widens by one on each side every row, so the changes aren't
+    // tracked any further
+    if (threadpool_size(pool) > 1 && hi-lo >= 2*MIN_TILE_WIDTH) {
+      cone->values += PS(compute_pathsum_rows)(in, gray, result, dirs, i, hh, lo, hi, gaps,
+                                               pool);
+      cone->widest = max(cone->widest, min(hi-lo + 2*(hh-1-i), ww));
+      break;
+    }
+
+    // keep the row as it was, through any gaps in it, to see what changed
+    size_t m0 = ngaps ? gaps_col(gaps, i, lo) : lo;
+    size_t m1 = ngaps ? gaps_col(gaps, i, hi-1) + 1 : hi;
+    const PSVAL *row = &GET_PIXEL(result, i, m0);
+    size_t nbytes = (m1 - m0) * sizeof(PSVAL);
+    memcpy(saved, row, nbytes);
+
+    PS(compute_pathsum_row)(in, gray, result, dirs, i, lo, hi-lo, gaps);
+    cone->values += hi-lo;
+    cone->widest = max(cone->widest, hi-lo);
+
+    size_t first = first_change(saved, row, nbytes);
+    if (first == nbytes) {
+      c0 = c1 = 0;
+      continue;
+    }
+    size_t last = last_change(saved, row, nbytes);
+
+    // a column in memory holds one at most ngaps columns left of it
+    first = m0 + first / sizeof(PSVAL);
+    last = m0 + last / sizeof(PSVAL);
+    c0 = max(lo, first > ngaps ? first - ngaps : 0);
+    c1 = min(hi, last + 1);
+  }
+}
+
+/**
+ * @brief Compute the rows [i0, i1) of a pathsum.
+ *
+ * Row i0 is computed over columns [j0, j1), and each row after it over one
+ * more column on each side, up to the edges of the image.
+ *
+ * @return the number of pathsum values computed
+ */
+static size_t PS(compute_pathsum_rows)(const energymap *in, const gray_image *gray,
+                                       PSMAP *result, pathsum_dirs *dirs, size_t i0,
+                                       size_t i1, size_t j0, size_t j1,
+                                       const seam_gaps *gaps, threadpool *pool) {
+  const size_t ww = result->width;
+  const size_t nthreads = threadpool_size(pool);
+
+  size_t total = 0;
+
+  size_t i = i0;
+  while (i < i1) {
+    size_t k = i - i0;
+    size_t lo = j0 > k ? j0 - k : 0;
+    size_t hi = min(j1 + k, ww);
+
+    size_t ntiles = min(2*nthreads, (hi-lo) / MIN_TILE_WIDTH);
+
+    // too narrow to split up, so just do the row
+    if (nthreads == 1 || ntiles < 2) {
+      PS(compute_pathsum_row)(in, gray, result, dirs, i, lo, hi-lo, gaps);
+      total += hi-lo;
+      i++;
+      continue;
+    }
+
+    size_t tile = (hi-lo) / ntiles;
+    PS(pathsum_block) block = {
+      .in = in,
+      .gray = gray,
+      .result = result,
+      .dirs = dirs,
+      .gaps = gaps,
+      .i0 = i,
+      .i1 = i + min(min(BLOCK_HEIGHT, tile/2), i1-i),
+      .j0 = lo,
+      .j1 = hi,
+      .tile = tile,
+      .ntiles = ntiles,
+    };
+
+    threadpool_run(pool, ntiles, PS(compute_pathsum_tile), &block);
+    threadpool_run(pool, ntiles-1, PS(compute_pathsum_gap), &block);
+
+    for (size_t kk = 0; kk < block.i1 - block.i0; kk++) {
+      total += min(hi + kk, ww) - (lo > kk ? lo - kk : 0);
+    }
+    i = block.i1;
+  }
+
+  return total;
+}
+
+static void PS(compute_pathsum_tile)(void *arg, size_t task) {
+  const PS(pathsum_block) *block = arg;
+  const size_t ww = block->result->width;
+
+  for (size_t i = block->i0; i < block->i1; i++) {
+    size_t k = i - block->i0;
+    size_t lo, hi;
+    if (task == 0) {
+      lo = block->j0 > k ? block->j0 - k : 0;
+    } else {
+      lo = block->j0 + task*block->tile + k;
+    }
+    if (task == block->ntiles-1) {
+      hi = min(block->j1 + k, ww);
+    } else {
+      hi = block->j0 + (task+1)*block->tile - k;
+    }
+    assert(hi > lo);
+    PS(compute_pathsum_row)(block->in, block->gray, block->result, block->dirs, i, lo,
+                            hi-lo, block->gaps);
+  }
+}
+
+static void PS(compute_pathsum_gap)(void *arg, size_t task) {
+  const PS(pathsum_block) *block = arg;
+
+  // the boundary between this tile and the next
+  size_t col = block->j0 + (task+1)*block->tile;
+
+  // there's no gap in the first row
+  for (size_t i = block->i0 + 1; i < block->i1; i++) {
+    size_t k = i - block->i0;
+    PS(compute_pathsum_row)(block->in, block->gray, block->result, block->dirs, i, col-k,
+                            2*k, block->gaps);
+  }
+}
+
+/**
+ * @brief Compute n values of row i of a pathsum, starting at column j0.
+ * @param gray the gray image to take forward energies from instead of in
+ * @param gaps seams marked as removed but still in the buffers, or NULL
+ */
+static void PS(compute_pathsum_row)(const energymap *in, const gray_image *gray,
+                                    PSMAP *result, pathsum_dirs *dirs, size_t i,
+                                    size_t j0, size_t n, const seam_gaps *gaps) {
+  if (gray) {
+    if (gaps && gaps->count > 0) {
+      PS(compute_forward_row_gaps)(gray, result, dirs, i, j0, n, gaps);
+    } else {
+      PS(compute_forward_row)(gray, result, dirs, i, j0, n);
+    }
+    return;
+  }
+
+  if (gaps && gaps->count > 0) {
+    PS(compute_pathsum_row_gaps)(in, result, dirs, i, j0, n, gaps);
+    return;
+  }
+
+  size_t ww = in->width;
+
+  size_t j = j0;
+
+  // the first row is just a copy
+  if (i == 0) {
+    for (; j < j0+n; j++) {
+      GET_PIXEL(result, i, j) = GET_PIXEL(in, i, j);
+    }
+    return;
+  }
+
+  // do the first value
+  if (j == 0) {
+    PSVAL cc = GET_PIXEL(result, i-1, j+0);
+    PSVAL rr = GET_PIXEL(result, i-1, j+1);
+    PSVAL minval;
+    if (cc <= rr) {
+      minval = cc;
+    } else {
+      minval = rr;
+    }
+    GET_PIXEL(result, i, 0) = (PSVAL)(GET_PIXEL(in, i, j) + minval);
+    if (dirs) GET_PIXEL(dirs, i, 0) = (uint8_t)(1 + min2idx(cc, rr));
+    j++;
+  }
+
+  // do the middle values, which have a neighbour on both sides
+  size_t j1 = min(j0+n, ww-1);
+  if (j1 > j) {
+    PS(compute_pathsum_span)(&GET_PIXEL(in, i, j), &GET_PIXEL(result, i-1, j),
+                             &GET_PIXEL(result, i, j),
+                             dirs ? &GET_PIXEL(dirs, i, j) : NULL, j1-j);
+    j = j1;
+  }
+
+  // do the last value
+  if (j < j0+n && j == ww-1) {
+    PSVAL ll = GET_PIXEL(result, i-1, j-1);
+    PSVAL cc = GET_PIXEL(result, i-1, j);
+    GET_PIXEL(result, i, j) = (PSVAL)(GET_PIXEL(in, i, j) + min3(ll, cc, cc));
+    if (dirs) GET_PIXEL(dirs, i, j) = (uint8_t)(1 + min3idx(ll, cc, cc));
+  }
+}
+
+/**
+ * @brief compute_pathsum_row for a pathsum with gaps in it.
+ *
+ * Between gaps, the row and the row above it are both contiguous, so the
+ * row is cut into spans at every gap of either row and the spans are done
+ * with the vector kernel. A gap in the row above also splits the three
+ * pixels above the one or two columns next to it, so those are looked up
+ * one at a time.
+ */
+static void PS(compute_pathsum_row_gaps)(const energymap *in, PSMAP *result,
+                                         pathsum_dirs *dirs, size_t i, size_t j0,
+                                         size_t n, const seam_gaps *gaps) {
+  const size_t ww = in->width;
+  const size_t j1 = min(j0+n, ww);
+
+  if (i == 0) {
+    for (size_t j = j0; j < j1; j++) {
+      size_t col = gaps_col(gaps, 0, j);
+      GET_PIXEL(result, 0, col) = GET_PIXEL(in, 0, col);
+    }
+    return;
+  }
+
+  // a gap at k in memory moves every column from k-(gaps before it) on
+  // one further right, so those are where the offsets into memory step up
+  const size_t *cur = GAPS_ROW(gaps, i);
+  const size_t *above = GAPS_ROW(gaps, i-1);
+  const size_t count = gaps->count;
+#define STEP(cols, k) ((cols)[k] - (k))
+
+  // steps in this row at or before j, and in the row above at or before j+1
+  size_t kc = 0;
+  size_t ka = 0;
+
+  size_t j = j0;
+  while (j < j1) {
+    for (; kc < count && STEP(cur, kc) <= j; kc++);
+    for (; ka < count && STEP(above, ka) <= j+1; ka++);
+
+    // columns in the row above of j-1, j and j+1 each step up separately
+    bool ragged = (ka > 0 && STEP(above, ka-1) >= j) || j == 0 || j == ww-1;
+    if (ragged) {
+      size_t kr = ka;
+      size_t km = ka;
+      for (; km > 0 && STEP(above, km-1) > j; km--);
+      size_t kl = km;
+      for (; kl > 0 && j > 0 && STEP(above, kl-1) > j-1; kl--);
+
+      PSVAL cc = GET_PIXEL(result, i-1, j + km);
+      PSVAL ll = j > 0 ? GET_PIXEL(result, i-1, j-1 + kl) : cc;
+      PSVAL rr = j < ww-1 ? GET_PIXEL(result, i-1, j+1 + kr) : cc;
+      GET_PIXEL(result, i, j + kc) = (PSVAL)(GET_PIXEL(in, i, j + kc) + min3(ll, cc, rr));
+      if (dirs) GET_PIXEL(dirs, i, j + kc) = (uint8_t)(1 + min3idx(ll, cc, rr));
+      j++;
+      continue;
+    }
+
+    // up to the next step in this row, or the next ragged column above
+    size_t end = min(j1, ww-1);
+    if (kc < count) end = min(end, STEP(cur, kc));
+    if (ka < count) end = min(end, STEP(above, ka) - 1);
+    assert(end > j);
+
+    PS(compute_pathsum_span)(&GET_PIXEL(in, i, j + kc), &GET_PIXEL(result, i-1, j + ka),
+                             &GET_PIXEL(result, i, j + kc),
+                             dirs ? &GET_PIXEL(dirs, i, j + kc) : NULL, end-j);
+    j = end;
+  }
+#undef STEP
+}
+
+/**
+ * @brief compute_pathsum_row for forward energies.
+ */
+static void PS(compute_forward_row)(const gray_image *gray, PSMAP *result,
+                                    pathsum_dirs *dirs, size_t i, size_t j0, size_t n) {
+  const size_t ww = result->width;
+  const size_t j1 = min(j0+n, ww);
+  const pixval *g = &GET_PIXEL(gray, i, 0);
+  PSVAL *res = &GET_PIXEL(result, i, 0);
+
+  // the first row only pays for closing up its neighbours
+  if (i == 0) {
+    for (size_t j = j0; j < j1; j++) {
+      uint32_t cl, cu, cr;
+      forward_costs(g[j > 0 ? j-1 : j], g[j < ww-1 ? j+1 : j], g[j], &cl, &cu, &cr);
+      res[j] = (PSVAL)cu;
+    }
+    return;
+  }
+
+  const pixval *up = &GET_PIXEL(gray, i-1, 0);
+  const PSVAL *prev = &GET_PIXEL(result, i-1, 0);
+  uint8_t *dir = &GET_PIXEL(dirs, i, 0);
+
+  size_t j = j0;
+  if (j == 0 && j < j1) {
+    PS(forward_pixel)(g[0], g[ww > 1 ? 1 : 0], up[0], NULL, prev[0],
+                      ww > 1 ? &prev[1] : NULL, &res[0], &dir[0]);
+    j++;
+  }
+
+  size_t end = min(j1, ww-1);
+  if (end > j) {
+    PS(compute_forward_span)(g+j, up+j, prev+j, res+j, dir+j, end-j);
+    j = end;
+  }
+
+  if (j < j1) {
+    PS(forward_pixel)(g[j-1], g[j], up[j], &prev[j-1], prev[j], NULL, &res[j], &dir[j]);
+  }
+}
+
+/**
+ * @brief compute_pathsum_row_gaps for forward energies.
+ *
+ * Besides the columns compute_pathsum_row_gaps does one at a time, the
+ * neighbours of a column on either side are split up by a gap next to it
+ * in its own row, so those columns are done one at a time as well.
+ */
+static void PS(compute_forward_row_gaps)(const gray_image *gray, PSMAP *result,
+                                         pathsum_dirs *dirs, size_t i, size_t j0,
+                                         size_t n, const seam_gaps *gaps) {
+  const size_t ww = result->width;
+  const size_t j1 = min(j0+n, ww);
+
+  if (i == 0) {
+    for (size_t j = j0; j < j1; j++) {
+      size_t col = gaps_col(gaps, 0, j);
+      pixval l = GET_PIXEL(gray, 0, j > 0 ? gaps_col(gaps, 0, j-1) : col);
+      pixval r = GET_PIXEL(gray, 0, j < ww-1 ? gaps_col(gaps, 0, j+1) : col);
+      uint32_t cl, cu, cr;
+      forward_costs(l, r, GET_PIXEL(gray, 0, col), &cl, &cu, &cr);
+      GET_PIXEL(result, 0, col) = (PSVAL)cu;
+    }
+    return;
+  }
+
+  const size_t *cur = GAPS_ROW(gaps, i);
+  const size_t *above = GAPS_ROW(gaps, i-1);
+  const size_t count = gaps->count;
+#define STEP(cols, k) ((cols)[k] - (k))
+
+  size_t kc = 0;
+  size_t ka = 0;
+
+  size_t j = j0;
+  while (j < j1) {
+    for (; kc < count && STEP(cur, kc) <= j; kc++);
+    for (; ka < count && STEP(above, ka) <= j+1; ka++);
+
+    bool ragged = (ka > 0 && STEP(above, ka-1) >= j) || j == 0 || j == ww-1
+        || (kc > 0 && STEP(cur, kc-1) == j) || (kc < count && STEP(cur, kc) == j+1);
+    if (ragged) {
+      // the steps at or before j-1, j and j+1 in both rows, counted from
+      // the ones already found rather than from the start of the row
+      size_t kr = ka;
+      size_t km = ka;
+      for (; km > 0 && STEP(above, km-1) > j; km--);
+      size_t kl = km;
+      for (; kl > 0 && j > 0 && STEP(above, kl-1) > j-1; kl--);
+      size_t kcl = kc;
+      for (; kcl > 0 && j > 0 && STEP(cur, kcl-1) > j-1; kcl--);
+      size_t kcr = kc;
+      for (; kcr < count && STEP(cur, kcr) <= j+1; kcr++);
+
+      size_t col = j + kc;
+      pixval l = GET_PIXEL(gray, i, j > 0 ? j-1 + kcl : col);
+      pixval r = GET_PIXEL(gray, i, j < ww-1 ? j+1 + kcr : col);
+      const PSVAL *above_l = j > 0 ? &GET_PIXEL(result, i-1, j-1 + kl) : NULL;
+      const PSVAL *above_r = j < ww-1 ? &GET_PIXEL(result, i-1, j+1 + kr) : NULL;
+      PS(forward_pixel)(l, r, GET_PIXEL(gray, i-1, j + km), above_l,
+                        GET_PIXEL(result, i-1, j + km), above_r,
+                        &GET_PIXEL(result, i, col), &GET_PIXEL(dirs, i, col));
+      j++;
+      continue;
+    }
+
+    // up to the column before the next step in either row
+    size_t end = min(j1, ww-1);
+    if (kc < count) end = min(end, STEP(cur, kc) - 1);
+    if (ka < count) end = min(end, STEP(above, ka) - 1);
+    assert(end > j);
+
+    PS(compute_forward_span)(&GET_PIXEL(gray, i, j + kc), &GET_PIXEL(gray, i-1, j + ka),
+                             &GET_PIXEL(result, i-1, j + ka), &GET_PIXEL(result, i, j + kc),
+                             &GET_PIXEL(dirs, i, j + kc), end-j);
+    j = end;
+  }
+#undef STEP
+}
+
+/**
+ * @brief Forward path sum of one pixel, given the gray values to its left
+ *        and right and above it, and the path sums above.
+ * @param above_l the path sum up and to the left, or NULL at the edge
+ * @param above_r the path sum up and to the right, or NULL at the edge
+ */
+static void PS(forward_pixel)(pixval l, pixval r, pixval u, const PSVAL *above_l,
+                              PSVAL above_c, const PSVAL *above_r, PSVAL *res, uint8_t *dir) {
+  uint32_t cl, cu, cr;
+  forward_costs(l, r, u, &cl, &cu, &cr);
+
+  uint32_t vl = above_l ? *above_l + cl : UINT32_MAX;
+  uint32_t vc = above_c + cu;
+  uint32_t vr = above_r ? *above_r + cr : UINT32_MAX;
+
+  // min3idx's order without its branches, which the ragged columns of a
+  // row with gaps hit in no predictable pattern
+  uint32_t side = vl <= vr ? vl : vr;
+  uint8_t code = vl <= vr ? 0 : 2;
+  *res = (PSVAL)(vc <= side ? vc : side);
+  *dir = vc <= side ? 1 : code;
+}
+
+/**
+ * @brief Path sums of a span of one row whose columns all have three
+ *        neighbours in the row above, with the widest vectors the cpu has.
+ *
+ * Computes res[k] = in[k] + min(prev[k-1], prev[k], prev[k+1]) for k in
+ * [0, n), so prev[-1] and prev[n] have to be real neighbours, and if dir
+ * isn't NULL, which of the three that was in dir[k]. The vector
+ * loads of the row above may run past the end of the span, into columns that
+ * may be written by another tile at the same time. Those lanes never make it
+ * into a result though, so that's harmless.
+ */
+static void PS(compute_pathsum_span)(const enval *in, const PSVAL *prev, PSVAL *res,
+                                     uint8_t *dir, size_t n) {
+  size_t j;
+  switch (simd_get_level()) {
+    case SIMD_AVX512: j = PS(compute_pathsum_span_avx512_)(in, prev, res, dir, n); break;
+    case SIMD_AVX2:   j = PS(compute_pathsum_span_avx2_)(in, prev, res, dir, n);   break;
+    case SIMD_SSE:    j = PS(compute_pathsum_span_sse_)(in, prev, res, dir, n);    break;
+    default:          j = 0;                                                       break;
+  }
+
+  // finish up the remaining elements
+  for (; j < n; j++) {
+    const PSVAL *above = &prev[j];
+    res[j] = (PSVAL)(in[j] + min3(above[-1], above[0], above[1]));
+    if (dir) dir[j] = (uint8_t)(1 + min3idx(above[-1], above[0], above[1]));
+  }
+}
+
+/**
+ * @brief PS(compute_pathsum_span) for forward energies.
+ *
+ * Computes res[k] from the path sums above plus the forward costs of
+ * in[k-1], in[k+1] and up[k] for k in [0, n), so in[-1] and in[n] have to be
+ * real neighbours as well.
+ */
+static void PS(compute_forward_span)(const pixval *in, const pixval *up, const PSVAL *prev,
+                                     PSVAL *res, uint8_t *dir, size_t n) {
+  size_t j;
+  switch (simd_get_level()) {
+    case SIMD_AVX512: j = PS(compute_forward_span_avx512_)(in, up, prev, res, dir, n); break;
+    case SIMD_AVX2:   j = PS(compute_forward_span_avx2_)(in, up, prev, res, dir, n);   break;
+    case SIMD_SSE:    j = PS(compute_forward_span_sse_)(in, up, prev, res, dir, n);    break;
+    default:          j = 0;                                                           break;
+  }
+
+  for (; j < n; j++) {
+    PS(forward_pixel)(in[j-1], in[j+1], up[j], &prev[j-1], prev[j], &prev[j+1],
+                      &res[j], &dir[j]);
+  }
+}
+
+static void PS(find_minseam)(const PSMAP *pathsum, const pathsum_dirs *dirs,
+                             size_t *result, const seam_gaps *gaps) {
+  assert(IS_IMAGE(pathsum));
+  assert(result);
+
+  if (gaps && gaps->count > 0) {
+    PS(find_minseam_gaps)(pathsum, dirs, result, gaps);
+    return;
+  }
+
+  size_t ww = pathsum->width;
+  size_t hh = pathsum->height;
+
+  result[hh-1] = PS(argmin_)(&GET_PIXEL(pathsum, hh-1, 0), ww);
+
+  if (dirs) {
+    trace_seam(dirs, result, NULL);
+    return;
+  }
+
+  for (size_t i = hh-2; i != SIZE_MAX; i--) {
+    size_t previdx = result[i+1];
+    PSVAL cc = GET_PIXEL(pathsum, i, previdx);
+    int delta;
+    if (previdx == 0) {
+      PSVAL rr = GET_PIXEL(pathsum, i, previdx+1);
+      delta = min2idx(cc, rr);
+    } else if (previdx == ww-1) {
+      PSVAL ll = GET_PIXEL(pathsum, i, previdx-1);
+      delta = -min2idx(cc, ll);
+    } else {
+      PSVAL ll = GET_PIXEL(pathsum, i, previdx-1);
+      PSVAL rr = GET_PIXEL(pathsum, i, previdx+1);
+      delta = min3idx(ll, cc, rr);
+    }
+    size_t col = (size_t)((int64_t)(previdx) + delta);
+    assert(col < ww);
+    result[i] = col;
+  }
+}
+
+static size_t PS(find_minseams)(const PSMAP *pathsum, const pathsum_dirs *dirs,
+                                size_t nseams, size_t *result, uint8_t *claimed,
+                                arena *a) {
+  assert(IS_IMAGE(pathsum));
+  assert(nseams > 0);
+  assert(result);
+  assert(claimed);
+
+  size_t ww = pathsum->width;
+  size_t hh = pathsum->height;
+
+  // the cheapest seam always makes it
+  PS(find_minseam)(pathsum, dirs, result, NULL);
+  if (nseams == 1) {
+    return 1;
+  }
+
+  arena_mark mark;
+  arena_get_mark(a, &mark);
+  seam_candidate *candidates = arena_alloc(a, sizeof(seam_candidate) * ww);
+  if (!candidates) {
+    return 1;
+  }
+
+  // try the other ends of the bottom row, cheapest first
+  for (size_t j = 0; j < ww; j++) {
+    candidates[j].val = GET_PIXEL(pathsum, hh-1, j);
+    candidates[j].col = j;
+  }
+  qsort(candidates, ww, sizeof(seam_candidate), compare_candidates);
+
+  for (size_t i = 0; i < hh; i++) {
+    claimed[i*ww + result[i]] = 1;
+  }
+
+  size_t found = 1;
+  size_t tries = CANDIDATES_PER_SEAM * nseams;
+  for (size_t c = 0; c < ww && c < tries && found < nseams; c++) {
+    size_t *seam = &result[found*hh];
+    if (PS(backtrack_seam)(pathsum, dirs, candidates[c].col, seam, claimed)) {
+      for (size_t i = 0; i < hh; i++) {
+        claimed[i*ww + seam[i]] = 1;
+      }
+      found++;
+    }
+  }
+
+  // leave the flags clear for next time
+  for (size_t k = 0; k < found; k++) {
+    for (size_t i = 0; i < hh; i++) {
+      claimed[i*ww + result[k*hh + i]] = 0;
+    }
+  }
+
+  arena_release(a, mark);
+
+  return found;
+}
+
+/**
+ * @brief PS(find_minseam) for a pathsum with gaps in it.
+ */
+static void PS(find_minseam_gaps)(const PSMAP *pathsum, const pathsum_dirs *dirs,
+                                  size_t *result, const seam_gaps *gaps) {
+  size_t ww = pathsum->width;
+  size_t hh = pathsum->height;
+
+  // the bottom row is contiguous between its gaps, so search each run
+  // between them and keep the first of the smallest
+  const size_t *bottom = GAPS_ROW(gaps, hh-1);
+  const PSVAL *row = &GET_PIXEL(pathsum, hh-1, 0);
+  PSVAL minval = 0;
+  size_t minidx = SIZE_MAX;
+  size_t col = 0;
+  size_t j = 0;
+  for (size_t k = 0; k <= gaps->count; k++) {
+    size_t end = k < gaps->count ? bottom[k] : ww + gaps->count;
+    if (end > col) {
+      size_t idx = PS(argmin_)(row + col, end - col);
+      if (minidx == SIZE_MAX || row[col + idx] < minval) {
+        minval = row[col + idx];
+        minidx = j + idx;
+      }
+      j += end - col;
+    }
+    col = end + 1;
+  }
+
+  result[hh-1] = minidx;
+
+  if (dirs) {
+    trace_seam(dirs, result, gaps);
+    return;
+  }
+
+  size_t cols[3];
+  for (size_t i = hh-2; i != SIZE_MAX; i--) {
+    size_t previdx = result[i+1];
+    int delta;
+    if (previdx == 0) {
+      gaps_span(gaps, i, previdx, 2, cols);
+      delta = min2idx(GET_PIXEL(pathsum, i, cols[0]), GET_PIXEL(pathsum, i, cols[1]));
+    } else if (previdx == ww-1) {
+      gaps_span(gaps, i, previdx-1, 2, cols);
+      delta = -min2idx(GET_PIXEL(pathsum, i, cols[1]), GET_PIXEL(pathsum, i, cols[0]));
+    } else {
+      gaps_span(gaps, i, previdx-1, 3, cols);
+      delta = min3idx(GET_PIXEL(pathsum, i, cols[0]), GET_PIXEL(pathsum, i, cols[1]),
+                      GET_PIXEL(pathsum, i, cols[2]));
+    }
+    size_t col_i = (size_t)((int64_t)(previdx) + delta);
+    assert(col_i < ww);
+    result[i] = col_i;
+  }
+}
+
+/**
+ * @brief Follow the least path up from a pixel in the bottom row.
+ * @return false if the path runs into or crosses a claimed pixel
+ */
+static bool PS(backtrack_seam)(const PSMAP *pathsum, const pathsum_dirs *dirs,
+                               size_t col, size_t *result, const uint8_t *claimed) {
+  size_t ww = pathsum->width;
+  size_t hh = pathsum->height;
+
+  if (claimed[(hh-1)*ww + col]) {
+    return false;
+  }
+  result[hh-1] = col;
+
+  for (size_t i = hh-2; i != SIZE_MAX; i--) {
+    size_t previdx = result[i+1];
+    int delta;
+    if (dirs) {
+      delta = GET_PIXEL(dirs, i+1, previdx) - 1;
+    } else {
+      PSVAL cc = GET_PIXEL(pathsum, i, previdx);
+      if (previdx == 0) {
+        PSVAL rr = GET_PIXEL(pathsum, i, previdx+1);
+        delta = min2idx(cc, rr);
+      } else if (previdx == ww-1) {
+        PSVAL ll = GET_PIXEL(pathsum, i, previdx-1);
+        delta = -min2idx(cc, ll);
+      } else {
+        PSVAL ll = GET_PIXEL(pathsum, i, previdx-1);
+        PSVAL rr = GET_PIXEL(pathsum, i, previdx+1);
+        delta = min3idx(ll, cc, rr);
+      }
+    }
+    size_t col_i = (size_t)((int64_t)(previdx) + delta);
+
+    // merging into another seam
+    if (claimed[i*ww + col_i]) {
+      return false;
+    }
+    // stepping diagonally past another seam
+    if (delta != 0 && claimed[i*ww + previdx] && claimed[(i+1)*ww + col_i]) {
+      return false;
+    }
+
+    result[i] = col_i;
+  }
+
+  return true;
+}
@@ -0,0 +1,108 @@
+/**
+ * @file perfctr.c
+ * @brief Counting hardware events with perf_event_open
+ *
+ * The counters are one group, so that they're all scheduled on the cpu at
+ * the same time and read with one system call.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <log.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perfctr.h"
+
+// the generic events for each counter, in the order of the enum
+static const uint64_t EVENTS[PERFCTR_COUNT] = {
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES,  // of the last level cache, on x86
+  PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int open_event(uint64_t config, int group);
+
+void perfctr_init(perfctr *pc) {
+  for (size_t k = 0; k < PERFCTR_COUNT; k++) {
+    pc->fds[k] = -1;
+  }
+  pc->unavailable = false;
+}
+
+bool perfctr_open(perfctr *pc) {
+  // the counts are of the thread that opened them
+  if (pc->fds[0] >= 0) {
+    if (pthread_equal(pc->thread, pthread_self())) {
+      return true;
+    }
+    perfctr_close(pc);
+  }
+  if (pc->unavailable) {
+    return false;
+  }
+
+  for (size_t k = 0; k < PERFCTR_COUNT; k++) {
+    pc->fds[k] = open_event(EVENTS[k], pc->fds[0]);
+    if (pc->fds[k] < 0) {
+      log_warn("Could not open the hardware counters: %s", strerror(errno));
+      perfctr_close(pc);
+      pc->unavailable = true;
+      return false;
+    }
+  }
+  if (ioctl(pc->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) != 0) {
+    log_warn("Could not start the hardware counters: %s", strerror(errno));
+    perfctr_close(pc);
+    pc->unavailable = true;
+    return false;
+  }
+  pc->thread = pthread_self();
+  return true;
+}
+
+void perfctr_close(perfctr *pc) {
+  for (size_t k = 0; k < PERFCTR_COUNT; k++) {
+    if (pc->fds[k] >= 0) {
+      close(pc->fds[k]);
+    }
+    pc->fds[k] = -1;
+  }
+}
+
+void perfctr_read(const perfctr *pc, uint64_t counts[PERFCTR_COUNT]) {
+  struct {
+    uint64_t nr;
+    uint64_t values[PERFCTR_COUNT];
+  } group;
+
+  if (pc->fds[0] < 0 || read(pc->fds[0], &group, sizeof(group)) != (ssize_t)sizeof(group)) {
+    memset(counts, 0, sizeof(uint64_t) * PERFCTR_COUNT);
+    return;
+  }
+  memcpy(counts, group.values, sizeof(uint64_t) * PERFCTR_COUNT);
+}
+
+/**
+ * @brief Open a counter of the calling thread, leading a new group if group
+ *        is -1, and disabled until its leader is enabled.
+ */
+static int open_event(uint64_t config, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.disabled = group < 0;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
@@ -0,0 +1,53 @@
+/**
+ * @file perfctr.h
+ * @brief Hardware performance counters of the calling thread
+ */
+
+#ifndef _PERFCTR_H_
+#define _PERFCTR_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// what's counted, in the order perfctr_read gives the counts
+enum {
+  PERFCTR_INSTRUCTIONS,
+  PERFCTR_LLC_MISSES,
+  PERFCTR_BRANCH_MISSES,
+  PERFCTR_COUNT,
+};
+
+typedef struct {
+  int fds[PERFCTR_COUNT];  // the group, the first one leading, -1 if not open
+  pthread_t thread;        // the thread they count
+  bool unavailable;        // opening them failed, so it isn't tried again
+} perfctr;
+
+/**
+ * @brief Set counters up closed.
+ */
+void perfctr_init(perfctr *pc);
+
+/**
+ * @brief Start counting the calling thread, in user space only, unless the
+ *        counters already are.
+ *
+ * The kernel has the last word on whether a process can count, through
+ * perf_event_paranoid, and virtual machines often have no counters to give.
+ * The first time the counters can't be opened says why, and after that
+ * they aren't tried again.
+ *
+ * @return whether the counters are counting
+ */
+bool perfctr_open(perfctr *pc);
+
+void perfctr_close(perfctr *pc);
+
+/**
+ * @brief Read every counter at once. The counts only mean anything as the
+ *        difference between two reads.
+ */
+void perfctr_read(const perfctr *pc, uint64_t counts[PERFCTR_COUNT]);
+
+#endif /* _PERFCTR_H_ */
@@ -0,0 +1,159 @@
+/**
+ * @file planar.c
+ * @brief Conversions between packed and planar rgb images
+ *
+ * Both directions work on 16 pixels at a time, which is 48 bytes of packed
+ * pixels or 16 bytes of each plane. Each output register is put together
+ * from three byte shuffles, one per input register, with the bytes that
+ * belong elsewhere zeroed and then or'ed away. The split can also produce
+ * the gray image on the way, from the planes while they're still in
+ * registers.
+ */
+
+#include <assert.h>
+#include <x86intrin.h>
+
+#include "arena.h"
+#include "car_internal.h"
+#include "planar.h"
+
+int planar_init(planar_image *img, size_t width, size_t height, arena *a) {
+  ARENA_IMAGE(&img->red, width, height, a);
+  ARENA_IMAGE(&img->green, width, height, a);
+  ARENA_IMAGE(&img->blue, width, height, a);
+  if (!img->red.data || !img->green.data || !img->blue.data) {
+    return 1;
+  }
+  return 0;
+}
+
+void rgb2planar(const rgb_image *in, planar_image *out) {
+  rgb2planar_rows(in, out, NULL, 0, in->height);
+}
+
+void rgb2planar_rows(const rgb_image *in, planar_image *out, gray_image *gray,
+                     size_t i0, size_t i1) {
+  assert(IS_IMAGE(in));
+  assert(IS_IMAGE(&out->red));
+  assert(in->width == out->red.width);
+  assert(in->height == out->red.height);
+  assert(!gray || (gray->width == in->width && gray->height == in->height));
+  assert(i0 <= i1 && i1 <= in->height);
+
+  const __m128i red0   = _mm_setr_epi8( 0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i red1   = _mm_setr_epi8(-1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14, -1, -1, -1, -1, -1);
+  const __m128i red2   = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  4,  7, 10, 13);
+  const __m128i green0 = _mm_setr_epi8( 1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i green1 = _mm_setr_epi8(-1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1);
+  const __m128i green2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14);
+  const __m128i blue0  = _mm_setr_epi8( 2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i blue1  = _mm_setr_epi8(-1, -1, -1, -1, -1,  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1);
+  const __m128i blue2  = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15);
+
+  // x/3 is (x*21846) >> 16 for every byte x
+  const __m128i third = _mm_set1_epi16(21846);
+
+  const size_t ww = in->width;
+  const size_t vec_width = 16;
+
+  for (size_t i = i0; i < i1; i++) {
+    const pixval *src = (const pixval *)&GET_PIXEL(in, i, 0);
+    pixval *red = &GET_PIXEL(&out->red, i, 0);
+    pixval *green = &GET_PIXEL(&out->green, i, 0);
+    pixval *blue = &GET_PIXEL(&out->blue, i, 0);
+
+    size_t j = 0;
+    for (; j + vec_width <= ww; j += vec_width) {
+      __m128i aa = _mm_loadu_si128((const __m128i *)(src + 3*j +  0));
+      __m128i bb = _mm_loadu_si128((const __m128i *)(src + 3*j + 16));
+      __m128i cc = _mm_loadu_si128((const __m128i *)(src + 3*j + 32));
+
+      __m128i rr = _mm_or_si128(_mm_or_si128(
+          _mm_shuffle_epi8(aa, red0), _mm_shuffle_epi8(bb, red1)), _mm_shuffle_epi8(cc, red2));
+      __m128i gg = _mm_or_si128(_mm_or_si128(
+          _mm_shuffle_epi8(aa, green0), _mm_shuffle_epi8(bb, green1)), _mm_shuffle_epi8(cc, green2));
+      __m128i bl = _mm_or_si128(_mm_or_si128(
+          _mm_shuffle_epi8(aa, blue0), _mm_shuffle_epi8(bb, blue1)), _mm_shuffle_epi8(cc, blue2));
+
+      _mm_storeu_si128((__m128i *)(red + j), rr);
+      _mm_storeu_si128((__m128i *)(green + j), gg);
+      _mm_storeu_si128((__m128i *)(blue + j), bl);
+
+      if (gray) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(
+            _mm_mulhi_epu16(_mm_unpacklo_epi8(rr, zero), third),
+            _mm_mulhi_epu16(_mm_unpacklo_epi8(gg, zero), third)),
+            _mm_mulhi_epu16(_mm_unpacklo_epi8(bl, zero), third));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(
+            _mm_mulhi_epu16(_mm_unpackhi_epi8(rr, zero), third),
+            _mm_mulhi_epu16(_mm_unpackhi_epi8(gg, zero), third)),
+            _mm_mulhi_epu16(_mm_unpackhi_epi8(bl, zero), third));
+        _mm_storeu_si128((__m128i *)&GET_PIXEL(gray, i, j), _mm_packus_epi16(lo, hi));
+      }
+    }
+
+    for (; j < ww; j++) {
+      const rgb_pixel *pix = &GET_PIXEL(in, i, j);
+      red[j] = pix->red;
+      green[j] = pix->green;
+      blue[j] = pix->blue;
+      if (gray) {
+        GET_PIXEL(gray, i, j) = (pixval)(pix->red/3 + pix->green/3 + pix->blue/3);
+      }
+    }
+  }
+}
+
+void planar2rgb(const planar_image *in, rgb_image *out) {
+  assert(IS_IMAGE(&in->red));
+  assert(IS_IMAGE(out));
+  assert(in->red.width == out->width);
+  assert(in->red.height == out->height);
+
+  const __m128i out0r = _mm_setr_epi8( 0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1,  5);
+  const __m128i out0g = _mm_setr_epi8(-1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1);
+  const __m128i out0b = _mm_setr_epi8(-1, -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1);
+  const __m128i out1r = _mm_setr_epi8(-1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10, -1);
+  const __m128i out1g = _mm_setr_epi8( 5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10);
+  const __m128i out1b = _mm_setr_epi8(-1,  5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1);
+  const __m128i out2r = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+  const __m128i out2g = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+  const __m128i out2b = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+
+  const size_t ww = out->width;
+  const size_t hh = out->height;
+  const size_t vec_width = 16;
+
+  for (size_t i = 0; i < hh; i++) {
+    const pixval *red = &GET_PIXEL(&in->red, i, 0);
+    const pixval *green = &GET_PIXEL(&in->green, i, 0);
+    const pixval *blue = &GET_PIXEL(&in->blue, i, 0);
+    pixval *dst = (pixval *)&GET_PIXEL(out, i, 0);
+
+    size_t j = 0;
+    for (; j + vec_width <= ww; j += vec_width) {
+      __m128i rr = _mm_loadu_si128((const __m128i *)(red + j));
+      __m128i gg = _mm_loadu_si128((const __m128i *)(green + j));
+      __m128i bl = _mm_loadu_si128((const __m128i *)(blue + j));
+
+      __m128i aa = _mm_or_si128(_mm_or_si128(
+          _mm_shuffle_epi8(rr, out0r), _mm_shuffle_epi8(gg, out0g)), _mm_shuffle_epi8(bl, out0b));
+      __m128i bb = _mm_or_si128(_mm_or_si128(
+          _mm_shuffle_epi8(rr, out1r), _mm_shuffle_epi8(gg, out1g)), _mm_shuffle_epi8(bl, out1b));
+      __m128i cc = _mm_or_si128(_mm_or_si128(
+          _mm_shuffle_epi8(rr, out2r), _mm_shuffle_epi8(gg, out2g)), _mm_shuffle_epi8(bl, out2b));
+
+      _mm_storeu_si128((__m128i *)(dst + 3*j +  0), aa);
+      _mm_storeu_si128((__m128i *)(dst + 3*j + 16), bb);
+      _mm_storeu_si128((__m128i *)(dst + 3*j + 32), cc);
+    }
+
+    for (; j < ww; j++) {
+      rgb_pixel *pix = &GET_PIXEL(out, i, j);
+      pix->red = red[j];
+      pix->green = green[j];
+      pix->blue = blue[j];
+    }
+  }
+}
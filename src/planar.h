@@ -0,0 +1,45 @@
+/**
+ * @file planar.h
+ * @brief Planar rgb images, one byte plane per channel
+ */
+
+#ifndef _PLANAR_H_
+#define _PLANAR_H_
+
+#include "arena.h"
+#include "car_internal.h"
+
+/**
+ * The channels of a rgb image stored as three separate planes, each laid
+ * out like a gray_image. The planes always have the same geometry.
+ */
+typedef struct {
+  gray_image red;
+  gray_image green;
+  gray_image blue;
+} planar_image;
+
+/**
+ * @brief Allocate the planes of a planar image out of an arena.
+ * @return 0 on success
+ */
+int planar_init(planar_image *img, size_t width, size_t height, arena *a);
+
+/**
+ * @brief Split a rgb image into its planes.
+ */
+void rgb2planar(const rgb_image *in, planar_image *out);
+
+/**
+ * @brief Split the rows [i0, i1) of a rgb image into its planes.
+ * @param gray if not NULL, also gets the gray version of the rows
+ */
+void rgb2planar_rows(const rgb_image *in, planar_image *out, gray_image *gray,
+                     size_t i0, size_t i1);
+
+/**
+ * @brief Interleave planes back into a rgb image.
+ */
+void planar2rgb(const planar_image *in, rgb_image *out);
+
+#endif /* _PLANAR_H_ */
@@ -0,0 +1,69 @@
+/**
+ * @file retarget.c
+ * @brief Narrow images to any width with the seams car_rank ranked
+ */
+
+#include <assert.h>
+#include <log.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <car.h>
+
+#include "car_internal.h"
+#include "retarget.h"
+
+int car_retarget(const car_ranks *ranks, const rgb_image *in, rgb_image *out) {
+  assert(ranks && ranks->data);
+  assert(IS_IMAGE(in));
+  assert(IS_IMAGE(out));
+  assert(ranks->width == in->width);
+  assert(ranks->height == in->height);
+  assert(out->buf_width == out->width);
+  assert(out->height == in->height);
+
+  if (out->width > in->width || in->width - out->width > ranks->seams) {
+    log_error("Can't retarget %zu wide to %zu wide with %zu seams", in->width, out->width,
+              ranks->seams);
+    return 1;
+  }
+
+  // the pixels the first nremove seams didn't take are the ones left
+  const uint32_t nremove = (uint32_t)(in->width - out->width);
+  const size_t hh = in->height;
+  const size_t ww = in->width;
+
+  for (size_t i = 0; i + 1 < hh; i++) {
+    retarget_row(&ranks->data[i*ww], &GET_PIXEL(in, i, 0), ww, nremove, &GET_PIXEL(out, i, 0));
+  }
+  retarget_row_last(&ranks->data[(hh-1)*ww], &GET_PIXEL(in, hh-1, 0), ww, nremove,
+                    &GET_PIXEL(out, hh-1, 0));
+
+  return 0;
+}
+
+/**
+ * Every pixel is stored, but only the kept ones move the output along, so
+ * a removed pixel is overwritten by the next kept one, and there's no
+ * branch to mispredict at every seam. Removed pixels at the end of the row
+ * land on the first pixel of the next output row, which hasn't been
+ * written yet.
+ */
+void retarget_row(const uint32_t *ranks, const rgb_pixel *in, size_t width,
+                  uint32_t nremove, rgb_pixel *out) {
+  size_t n = 0;
+  for (size_t j = 0; j < width; j++) {
+    out[n] = in[j];
+    n += ranks[j] >= nremove;
+  }
+}
+
+void retarget_row_last(const uint32_t *ranks, const rgb_pixel *in, size_t width,
+                       uint32_t nremove, rgb_pixel *out) {
+  size_t n = 0;
+  for (size_t j = 0; j < width; j++) {
+    if (ranks[j] >= nremove) {
+      out[n++] = in[j];
+    }
+  }
+}
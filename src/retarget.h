@@ -0,0 +1,30 @@
+/**
+ * @file retarget.h
+ * @brief Narrowing rows by the rank of the seam that removed each pixel
+ */
+
+#ifndef _RETARGET_H_
+#define _RETARGET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <car.h>
+
+/**
+ * @brief Keep the pixels of a row that rank at least nremove.
+ *
+ * Removed pixels at the end of the row are written past the kept ones, so
+ * out must have room for width pixels, such as the next row of an image
+ * that's as wide as its buffer.
+ */
+void retarget_row(const uint32_t *ranks, const rgb_pixel *in, size_t width,
+                  uint32_t nremove, rgb_pixel *out);
+
+/**
+ * @brief retarget_row for a row with nothing after it to spill into.
+ */
+void retarget_row_last(const uint32_t *ranks, const rgb_pixel *in, size_t width,
+                       uint32_t nremove, rgb_pixel *out);
+
+#endif /* _RETARGET_H_ */
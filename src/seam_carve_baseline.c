@@ -6,241 +6,1388 @@
 #include <assert.h>
 #include <log.h>
 #include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <car.h>
 
+#include "arena.h"
 #include "car_internal.h"
 #include "energy.h"
+#include "gaps.h"
 #include "pathsum.h"
+#include "perfctr.h"
+#include "planar.h"
+#include "simd.h"
+#include "threadpool.h"
+#include "transpose.h"
+#include "tsc.h"
 
-#define TIMING_INIT (memset(&__timing, 0, sizeof(__timing)))
-#define TIC (__timing.__start = GET_CYCLE_COUNT())
-#define TOC(attr) (__timing.attr += GET_CYCLE_COUNT() - __timing.__start)
+// time the stages of the carve of the car_context *ctx in scope, and add up
+// the bytes each one reads and writes
+#define TIC (stage_begin(ctx))
+#define TOC(attr) (stage_end(ctx, &ctx->stats.attr))
+#define BYTES(attr, nread, nwritten)                 \
+  do {                                               \
+    ctx->stats.attr.bytes_read += (nread);           \
+    ctx->stats.attr.bytes_written += (nwritten);     \
+  } while (0)
 
-static void log_timing(void);
-static void rgb2gray(const rgb_image *in, gray_image *out);
+static void stage_begin(car_context *ctx);
+static void stage_end(car_context *ctx, car_stage_stats *stage);
+static void log_stats(const car_context *ctx);
+static threadpool *get_pool(car_context *ctx, size_t nthreads);
+static bool size_fits(size_t from, size_t to);
+static int begin_carve(car_context *ctx, const rgb_image *in, const car_options *opts);
+static int split_input(car_context *ctx, const rgb_image *in, bool find_energy,
+                       planar_image *rgb, gray_image *gray, gray_image *bias,
+                       energymap *energy);
+static void split_image(car_context *ctx, const rgb_image *in, planar_image *rgb,
+                        gray_image *gray, gray_image *bias, energymap *energy);
+static void split_band(void *arg, size_t task);
+static void split_band_edges(void *arg, size_t task);
 static void __attribute__((unused)) gray2rgb(const gray_image *in, rgb_image *out);
-static void imgcpy(rgb_image *dst, const rgb_image *src);
-
-static struct {
-  uint64_t __start;
-  uint64_t grey;
-  uint64_t conv;
-  uint64_t convp;
-  uint64_t pathsum;
-  uint64_t minpath;
-  uint64_t rmpath;
-  uint64_t malloc;
-} __timing;
-
-#define remove_seam(img, to_remove)                                               \
-  do {                                                                            \
-    if (((to_remove)[0] + (to_remove)[(img)->height-1]) / 2 > (img)->width/2) {   \
-      for (size_t i = 0; i < (img)->height; i++) {                                \
-        void *src = &GET_PIXEL((img), i, (to_remove)[i] + 1);                     \
-        void *dst = &GET_PIXEL((img), i, (to_remove)[i] + 0);                     \
-        size_t n = sizeof((img)->data[0]) * ((img)->width - (to_remove)[i] - 1);  \
-        memmove(dst, src, n);                                                     \
-      }                                                                           \
-    } else {                                                                      \
-      for (size_t i = 0; i < (img)->height; i++) {                                \
-        void *src = &GET_PIXEL((img), i, 0);                                      \
-        void *dst = &GET_PIXEL((img), i, 1);                                      \
-        size_t n = sizeof((img)->data[0]) * (to_remove)[i];                       \
-        memmove(dst, src, n);                                                     \
-      }                                                                           \
-      (img)->buf_start++;                                                         \
-    }                                                                             \
-    (img)->width--;                                                               \
+static int resize_width(car_context *ctx, planar_image *rgb, gray_image *gray,
+                        gray_image *bias, size_t width, energymap *energy);
+static int carve_seams(car_context *ctx, planar_image *rgb, gray_image *gray,
+                       gray_image *bias, size_t width, uint32_t *seams, uint32_t *found,
+                       energymap *energy);
+static size_t pyramid_scale(const gray_image *gray);
+static int find_coarse_seams(car_context *ctx, const gray_image *gray, const gray_image *bias,
+                             size_t scale, size_t nseams, gray_image *coarse, uint32_t *found);
+static void shrink_gray(const gray_image *in, size_t scale, gray_image *out);
+static void guide_seam(const uint32_t *coarse_seam, size_t coarse_width,
+                       size_t coarse_height, size_t width, size_t height, size_t *guide);
+static int insert_seams(car_context *ctx, planar_image *rgb, gray_image *gray,
+                        gray_image *bias, size_t width, energymap *energy);
+static int transpose_planar(car_context *ctx, const planar_image *in, planar_image *out);
+static void expand_gray(const gray_image *in, gray_image *out, const uint32_t *cols);
+
+struct car_context {
+  // options for the carve in progress
+  car_options opts;
+  // energy function those options pick
+  const energy_func *energy;
+  // threads for the carve in progress, NULL to carve on this thread only
+  threadpool *pool;
+  // threads kept from one carve to the next, NULL until they're needed
+  threadpool *threads;
+  // every buffer of a carve, kept for the next one
+  arena scratch;
+  // what the carve has done so far, and the counts when the stage being
+  // timed began
+  car_stats stats;
+  uint64_t stage_start;
+  uint64_t stage_counts[PERFCTR_COUNT];
+  perfctr counters;
+  double best_conv_cpe;
+};
+
+// rows per task when a per-row loop is split between threads
+static const size_t BAND_HEIGHT = 32;
+
+// gaps are compacted early when they'd be closer together than this many
+// columns on average, since the kernels slow down on short runs between them
+static const size_t GAP_SPACING = 64;
+
+// images are halved for the pyramid search until they're this small
+static const size_t PYRAMID_PIXELS = 1 << 20;
+// but no smaller than this either way
+static const size_t PYRAMID_MIN_SIDE = 64;
+
+// maps each pixel of a working image back to its column in the original
+typedef struct {
+  uint32_t *data;
+  size_t width;
+  size_t height;
+  size_t buf_width;
+  size_t buf_height;
+  size_t buf_start;
+} index_map;
+
+// everything a seam has to be removed from
+typedef struct {
+  gray_image *gray;
+  planar_image *rgb;
+  gray_image *bias;
+  energymap *energy;
+  pathsum_map *pathsum;
+  index_map *cols;
+  const size_t *to_remove;
+  size_t nseams;
+  size_t *sorted;
+  bool shift_left;
+  const seam_gaps *gaps;
+  threadpool *pool;
+} seam_removal;
+
+static size_t remove_seam(seam_removal *removal);
+static size_t column_bytes(const seam_removal *removal);
+static void remove_seam_band(void *arg, size_t task);
+static void remove_seams_band(void *arg, size_t task);
+static void remove_gaps_band(void *arg, size_t task);
+static void shrink_width(seam_removal *removal, size_t n);
+
+// whether moving the pixels right of the seam is cheaper than the left ones
+#define SHIFT_LEFT(img, to_remove) \
+  (((to_remove)[0] + (to_remove)[(img)->height-1]) / 2 > (img)->width/2)
+
+// remove the seam at col from row i, moving whichever side shift_left says
+#define remove_seam_row(img, i, col, shift_left)                              \
+  do {                                                                        \
+    if (shift_left) {                                                         \
+      memmove(&GET_PIXEL((img), (i), (col) + 0),                              \
+              &GET_PIXEL((img), (i), (col) + 1),                              \
+              sizeof((img)->data[0]) * ((img)->width - (col) - 1));           \
+    } else {                                                                  \
+      memmove(&GET_PIXEL((img), (i), 1), &GET_PIXEL((img), (i), 0),           \
+              sizeof((img)->data[0]) * (col));                                \
+    }                                                                         \
   } while (0)
 
-uint8_t bigbuf[100*1024*1024];
+// remove several seams from row i, given their columns in increasing order,
+// where the row is row_width wide in memory
+#define remove_seams_row(img, i, cols, n, row_width)                          \
+  do {                                                                        \
+    size_t dst = (cols)[0];                                                   \
+    for (size_t k = 0; k < (n); k++) {                                        \
+      size_t src = (cols)[k] + 1;                                             \
+      size_t end = k+1 < (n) ? (cols)[k+1] : (row_width);                     \
+      memmove(&GET_PIXEL((img), (i), dst), &GET_PIXEL((img), (i), src),       \
+              sizeof((img)->data[0]) * (end - src));                          \
+      dst += end - src;                                                       \
+    }                                                                         \
+  } while (0)
+
+#define remove_seam_finish(img, shift_left) \
+  do {                                      \
+    if (!(shift_left)) (img)->buf_start++;  \
+    (img)->width--;                         \
+  } while (0)
+
+void car_default_options(car_options *opts) {
+  assert(opts);
+  opts->threads = 0;
+  opts->mt_threshold = 1 << 20;
+  opts->batch_seams = 1;
+  opts->compact_interval = 16;
+  opts->trace_dirs = false;
+  opts->pyramid_band = 0;
+  opts->forward_energy = false;
+  opts->energy = CAR_ENERGY_SOBEL;
+  opts->bias = NULL;
+  opts->counters = false;
+}
+
+car_context *car_context_create(void) {
+  car_context *ctx = calloc(1, sizeof(*ctx));
+  if (!ctx) {
+    return NULL;
+  }
+  car_default_options(&ctx->opts);
+  arena_init(&ctx->scratch);
+  perfctr_init(&ctx->counters);
+  return ctx;
+}
+
+void car_context_destroy(car_context *ctx) {
+  if (!ctx) {
+    return;
+  }
+  threadpool_destroy(ctx->threads);
+  arena_free(&ctx->scratch);
+  perfctr_close(&ctx->counters);
+  free(ctx);
+}
+
+void car_context_stats(const car_context *ctx, car_stats *stats) {
+  assert(ctx);
+  assert(stats);
+  *stats = ctx->stats;
+}
 
 int seam_carve_baseline(const rgb_image *in, rgb_image *out) {
+  car_options opts;
+  car_default_options(&opts);
+  return seam_carve(in, out, &opts);
+}
+
+int seam_carve(const rgb_image *in, rgb_image *out, const car_options *opts) {
+  car_context *ctx = car_context_create();
+  if (!ctx) {
+    log_fatal("malloc failed");
+    return 1;
+  }
+  int failed = car_carve(ctx, in, out, opts);
+  car_context_destroy(ctx);
+  return failed;
+}
+
+int car_carve(car_context *ctx, const rgb_image *in, rgb_image *out, const car_options *opts) {
+  assert(ctx);
   assert(IS_IMAGE(in));
   assert(IS_IMAGE(out));
-  assert(out->width <= in->width);
-  assert(out->height == in->height);
   assert(out->buf_width == out->width);
   assert(out->buf_height == out->height);
+  assert(opts);
+
+  if (!size_fits(in->width, out->width) || !size_fits(in->height, out->height)) {
+    log_error("Cannot carve %zux%zu to %zux%zu, the images must be at least %d pixels "
+              "wide and high, and more to be stretched", in->width, in->height,
+              out->width, out->height, CAR_MIN_SIZE);
+    return 1;
+  }
+  if (begin_carve(ctx, in, opts) != 0) {
+    return 1;
+  }
+
+  // the first energy map comes out of the same pass, if there are vertical
+  // seams to find in it
+  planar_image rgb_in_tmp;
+  gray_image in_tmp;
+  gray_image bias_tmp;
+  energymap img_en;
+  if (split_input(ctx, in, out->width != in->width, &rgb_in_tmp, &in_tmp, &bias_tmp,
+                  &img_en) != 0) {
+    return 1;
+  }
+  gray_image *bias = bias_tmp.data ? &bias_tmp : NULL;
+
+  // remove or insert the vertical seams
+  if (resize_width(ctx, &rgb_in_tmp, &in_tmp, bias, out->width,
+                   img_en.data ? &img_en : NULL) != 0) {
+    return 1;
+  }
 
-  log_info("Carving %d seams", in->width - out->width);
+  if (out->height == in->height) {
+    // finish up
+    TIC;
+    planar2rgb(&rgb_in_tmp, out);
+    BYTES(grey, 3 * out->width * out->height, 3 * out->width * out->height);
+    TOC(grey);
+  } else {
+    // horizontal seams are vertical seams of the transposed image, so carve
+    // a transposed copy rather than walking the buffers column by column
+    log_info("Resizing height from %zu to %zu", in->height, out->height);
 
-  TIMING_INIT;
+    TIC;
+    planar_image rgb_in_t;
+    gray_image in_t;
+    ARENA_IMAGE(&in_t, in_tmp.height, in_tmp.width, &ctx->scratch);
+    if (!in_t.data || transpose_planar(ctx, &rgb_in_tmp, &rgb_in_t) != 0) {
+      log_fatal("malloc failed");
+      return 1;
+    }
+    transpose_gray(&in_tmp, &in_t);
+    gray_image bias_t = { 0 };
+    if (bias) {
+      ARENA_IMAGE(&bias_t, bias->height, bias->width, &ctx->scratch);
+      if (!bias_t.data) {
+        log_fatal("malloc failed");
+        return 1;
+      }
+      transpose_gray(bias, &bias_t);
+    }
+    const size_t nplanes = bias ? 5 : 4;
+    BYTES(transpose, nplanes * in_tmp.width * in_tmp.height,
+          nplanes * in_tmp.width * in_tmp.height);
+    TOC(transpose);
 
-  // make a rgb copy to work on
+    if (resize_width(ctx, &rgb_in_t, &in_t, bias ? &bias_t : NULL, out->height, NULL) != 0) {
+      return 1;
+    }
+
+    TIC;
+    planar_image rgb_out;
+    if (transpose_planar(ctx, &rgb_in_t, &rgb_out) != 0) {
+      log_fatal("malloc failed");
+      return 1;
+    }
+    planar2rgb(&rgb_out, out);
+    BYTES(transpose, 6 * out->width * out->height, 6 * out->width * out->height);
+    TOC(transpose);
+  }
+
+  log_info("Seam carving completed");
+  log_stats(ctx);
+
+  return 0;
+}
+
+int car_rank(car_context *ctx, const rgb_image *in, size_t min_width, car_ranks *ranks,
+             const car_options *opts) {
+  assert(ctx);
+  assert(IS_IMAGE(in));
+  assert(min_width >= CAR_MIN_SIZE && min_width <= in->width);
+  assert(in->height >= CAR_MIN_SIZE);
+  assert(ranks && ranks->data);
+  assert(opts);
+
+  const size_t hh = in->height;
+  const size_t ww = in->width;
+  const size_t nseams = ww - min_width;
+  ranks->width = ww;
+  ranks->height = hh;
+  ranks->seams = nseams;
+
+  // pixels that no seam removes outrank every seam
+  for (size_t k = 0; k < ww * hh; k++) {
+    ranks->data[k] = (uint32_t)nseams;
+  }
+  if (nseams == 0) {
+    // nothing was carved, which the stats should say rather than keep the
+    // last carve's
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->stats.tsc_hz = tsc_hz();
+    return 0;
+  }
+
+  if (begin_carve(ctx, in, opts) != 0) {
+    return 1;
+  }
+
+  planar_image rgb_in_tmp;
+  gray_image in_tmp;
+  gray_image bias_tmp;
+  energymap img_en;
+  if (split_input(ctx, in, true, &rgb_in_tmp, &in_tmp, &bias_tmp, &img_en) != 0) {
+    return 1;
+  }
+
+  // only the gray image needs carving to find the seams
   TIC;
-  rgb_image rgb_in_tmp;
-  INITIALIZE_IMAGE(&rgb_in_tmp, in->width, in->height);
-  if (!rgb_in_tmp.data) {
+  uint32_t *seams = arena_alloc(&ctx->scratch, sizeof(uint32_t) * nseams * hh);
+  if (!seams) {
     log_fatal("malloc failed");
     return 1;
   }
-  memcpy(rgb_in_tmp.data, in->data, sizeof(rgb_pixel)*in->width*in->height);
   TOC(malloc);
+  log_info("Ranking %zu vertical seams", nseams);
+  if (carve_seams(ctx, NULL, &in_tmp, bias_tmp.data ? &bias_tmp : NULL, min_width, seams,
+                  NULL, img_en.data ? &img_en : NULL) != 0) {
+    return 1;
+  }
 
-  // make a grayscale copy to work on
   TIC;
-  gray_image in_tmp;
-  INITIALIZE_IMAGE(&in_tmp, in->width, in->height);
-  if (!in_tmp.data) {
+  for (size_t k = 0; k < nseams; k++) {
+    const uint32_t *seam = &seams[k * hh];
+    for (size_t i = 0; i < hh; i++) {
+      ranks->data[i*ww + seam[i]] = (uint32_t)k;
+    }
+  }
+  BYTES(rmpath, sizeof(uint32_t) * nseams * hh, sizeof(uint32_t) * nseams * hh);
+  TOC(rmpath);
+
+  log_info("Seam ranking completed");
+  log_stats(ctx);
+
+  return 0;
+}
+
+/**
+ * @brief Whether a side of from pixels can be carved or stretched to one of
+ *        to, stretching needing a side that can be carved.
+ */
+static bool size_fits(size_t from, size_t to) {
+  return from >= CAR_MIN_SIZE && to >= CAR_MIN_SIZE && (to <= from || from > CAR_MIN_SIZE);
+}
+
+/**
+ * @brief Set a context up for a carve of in with opts, and throw away
+ *        everything from its last carve.
+ */
+static int begin_carve(car_context *ctx, const rgb_image *in, const car_options *opts) {
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  ctx->stats.tsc_hz = tsc_hz();
+  ctx->stats.counters = opts->counters && perfctr_open(&ctx->counters);
+  ctx->opts = *opts;
+  ctx->energy = energy_func_get(opts->energy);
+  if (!ctx->energy) {
+    log_error("Unknown energy function %d", (int)opts->energy);
+    return 1;
+  }
+  ctx->best_conv_cpe = INFINITY;
+  log_info("Using %s kernels", simd_level_name(simd_get_level()));
+
+  // small images aren't worth the synchronization
+  ctx->pool = NULL;
+  if (in->width * in->height >= opts->mt_threshold) {
+    size_t nthreads = opts->threads ? opts->threads : threadpool_default_size();
+    if (nthreads > 1) {
+      TIC;
+      ctx->pool = get_pool(ctx, nthreads);
+      TOC(malloc);
+    }
+  }
+
+  // everything from the last carve is garbage now
+  arena_reset(&ctx->scratch);
+  return 0;
+}
+
+/**
+ * @brief Make the working copies of an image to carve.
+ *
+ * The planar rgb copy is the one carved, so that removing a seam moves
+ * whole bytes in each plane rather than unaligned 3 byte pixels, and the
+ * seams are found in the grayscale copy.
+ *
+ * @param find_energy whether to compute the energy map in the same pass
+ * @param bias receives the bias of the options offset by BIAS_ZERO, with a
+ *             NULL data if there's none or forward energy has no use for it
+ * @param energy receives the energy map, with a NULL data if there's none
+ */
+static int split_input(car_context *ctx, const rgb_image *in, bool find_energy,
+                       planar_image *rgb, gray_image *gray, gray_image *bias,
+                       energymap *energy) {
+  const bool forward = ctx->opts.forward_energy;
+
+  TIC;
+  ARENA_IMAGE(gray, in->width, in->height, &ctx->scratch);
+  if (planar_init(rgb, in->width, in->height, &ctx->scratch) != 0 || !gray->data) {
     log_fatal("malloc failed");
-    free(rgb_in_tmp.data);
     return 1;
   }
+  // the bias is carved and transposed along with the gray image
+  *bias = (gray_image) { 0 };
+  if (ctx->opts.bias && !forward) {
+    ARENA_IMAGE(bias, in->width, in->height, &ctx->scratch);
+    if (!bias->data) {
+      log_fatal("malloc failed");
+      return 1;
+    }
+  }
+  *energy = (energymap) { 0 };
+  if (find_energy && !forward) {
+    ARENA_IMAGE(energy, in->width, in->height, &ctx->scratch);
+    if (!energy->data) {
+      log_fatal("malloc failed");
+      return 1;
+    }
+  }
   TOC(malloc);
+
   TIC;
-  rgb2gray(in, &in_tmp);
+  split_image(ctx, in, rgb, gray, bias->data ? bias : NULL, energy->data ? energy : NULL);
+  const size_t npixels = in->width * in->height;
+  BYTES(grey, (bias->data ? 4 : 3) * npixels,
+        (bias->data ? 5 : 4) * npixels + (energy->data ? sizeof(enval) * npixels : 0));
   TOC(grey);
+  return 0;
+}
+
+/**
+ * @brief Remove or insert vertical seams until a pair of working images is
+ *        the given width.
+ * @param bias the bias of gray, resized along with it, or NULL
+ * @param energy the energy map of gray if it's already known, or NULL
+ */
+static int resize_width(car_context *ctx, planar_image *rgb, gray_image *gray,
+                        gray_image *bias, size_t width, energymap *energy) {
+  if (width < gray->width) {
+    log_info("Carving %zu vertical seams", gray->width - width);
+    return carve_seams(ctx, rgb, gray, bias, width, NULL, NULL, energy);
+  }
+  if (width > gray->width) {
+    log_info("Inserting %zu vertical seams", width - gray->width);
+    return insert_seams(ctx, rgb, gray, bias, width, energy);
+  }
+  return 0;
+}
+
+/**
+ * @brief Remove vertical seams from a pair of working images.
+ * @param rgb the color image, carved in place, or NULL to only carve gray
+ * @param gray grayscale version of rgb, carved in place alongside it
+ * @param bias added to the energy of gray, offset by BIAS_ZERO and carved in
+ *             place alongside it, or NULL
+ * @param width the width to carve both images down to
+ * @param seams if not NULL, receives the column in the original image of
+ *              every removed pixel, one row of height entries per seam
+ * @param found if not NULL, receives the column of every removed pixel in
+ *              the image its seam was found in, laid out like seams
+ * @param energy the energy map of gray if it's already known, or NULL. It's
+ *               carved along with everything else.
+ */
+static int carve_seams(car_context *ctx, planar_image *rgb, gray_image *gray,
+                       gray_image *bias, size_t width, uint32_t *seams, uint32_t *found,
+                       energymap *energy) {
+  assert(IS_IMAGE(gray));
+  assert(!bias || (bias->width == gray->width && bias->height == gray->height));
+  assert(!rgb || IS_IMAGE(&rgb->red));
+  assert(!rgb || rgb->red.width == gray->width);
+  assert(!rgb || rgb->red.height == gray->height);
+  assert(width < gray->width);
+
+  planar_image rgb_in_tmp = rgb ? *rgb : (planar_image) { 0 };
+  gray_image in_tmp = *gray;
+  gray_image bias_tmp = bias ? *bias : (gray_image) { 0 };
+  const gray_image *bias_in = bias ? &bias_tmp : NULL;
+
+  // everything allocated from here on is given back at the end
+  arena *scratch = &ctx->scratch;
+  arena_mark mark;
+  arena_get_mark(scratch, &mark);
 
-  // allocate the energy map
+  // on big images, find the seams on a smaller copy first, so that each
+  // seam only has to be looked for near its smaller one at full size
+  const size_t scale = ctx->opts.pyramid_band > 0 ? pyramid_scale(&in_tmp) : 1;
+  const bool pyramid = scale > 1;
+  const size_t ncarve = in_tmp.width - width;
+  gray_image coarse = { 0 };
+  uint32_t *coarse_seams = NULL;
+  size_t ncoarse = 0;
+  size_t *guide = NULL;
+  if (pyramid) {
+    ncoarse = (ncarve + scale - 1) / scale;
+    // the coarse copy can't be carved any narrower than the full size one
+    if (ncoarse > in_tmp.width / scale - CAR_MIN_SIZE) {
+      ncoarse = in_tmp.width / scale - CAR_MIN_SIZE;
+    }
+    log_info("Finding %zu seams at 1/%zu size first", ncoarse, scale);
+    coarse_seams = arena_alloc(scratch, sizeof(uint32_t) * ncoarse * (in_tmp.height / scale));
+    guide = arena_alloc(scratch, sizeof(size_t) * in_tmp.height);
+    if (!coarse_seams || !guide) {
+      log_fatal("malloc failed");
+      return 1;
+    }
+    if (find_coarse_seams(ctx, &in_tmp, bias_in, scale, ncoarse, &coarse,
+                          coarse_seams) != 0) {
+      return 1;
+    }
+  }
+
+  // keep track of where the remaining pixels started out
+  index_map cols = { 0 };
+  if (seams) {
+    TIC;
+    ARENA_IMAGE(&cols, in_tmp.width, in_tmp.height, scratch);
+    if (!cols.data) {
+      log_fatal("malloc failed");
+      return 1;
+    }
+    for (size_t i = 0; i < cols.height; i++) {
+      for (size_t j = 0; j < cols.width; j++) {
+        GET_PIXEL(&cols, i, j) = (uint32_t)j;
+      }
+    }
+    BYTES(malloc, 0, sizeof(uint32_t) * cols.width * cols.height);
+    TOC(malloc);
+  }
+
+  // allocate the energy map, which forward energy does without
   TIC;
-  energymap img_en;
-  INITIALIZE_IMAGE(&img_en, in->width, in->height);
-  if (!img_en.data) {
+  const bool forward = ctx->opts.forward_energy;
+  energymap img_en = { 0 };
+  if (energy) {
+    assert(energy->width == in_tmp.width && energy->height == in_tmp.height);
+    img_en = *energy;
+  } else if (!forward) {
+    ARENA_IMAGE(&img_en, in_tmp.width, in_tmp.height, scratch);
+  }
+  if (!forward && !img_en.data) {
     log_fatal("malloc_failed");
-    free(rgb_in_tmp.data);
-    free(in_tmp.data);
     return 1;
   }
   TOC(malloc);
 
-  // allocate the pathsum array
+  // allocate the pathsum array, which the pyramid search does without
   TIC;
-  energymap img_pathsum;
-  INITIALIZE_IMAGE(&img_pathsum, in->width, in->height);
-  if (!img_pathsum.data) {
+  pathsum_map img_pathsum;
+  if (pathsum_init(&img_pathsum, in_tmp.width, in_tmp.height,
+                   ctx->opts.trace_dirs || forward, pyramid ? NULL : scratch) != 0) {
     log_fatal("malloc failed");
-    free(rgb_in_tmp.data);
-    free(in_tmp.data);
-    free(img_en.data);
+    return 1;
   }
   TOC(malloc);
 
-  // allocate space for the current found seam to remove
+  // allocate space for the current found seams to remove
   TIC;
-  size_t *to_remove = malloc(sizeof(size_t) * in->height);
-  if (!to_remove) {
-    free(rgb_in_tmp.data);
-    free(in_tmp.data);
-    free(img_en.data);
-    free(img_pathsum.data);
+  const size_t batch = ctx->opts.batch_seams > 0 && !pyramid ? ctx->opts.batch_seams : 1;
+  size_t *to_remove = arena_alloc(scratch, sizeof(size_t) * in_tmp.height * batch);
+  size_t *sorted = NULL;
+  uint8_t *claimed = NULL;
+  if (batch > 1) {
+    sorted = arena_alloc(scratch, sizeof(size_t) * in_tmp.height * batch);
+    claimed = arena_alloc(scratch, sizeof(uint8_t) * in_tmp.width * in_tmp.height);
+    if (claimed) memset(claimed, 0, sizeof(uint8_t) * in_tmp.width * in_tmp.height);
+    BYTES(malloc, 0, sizeof(uint8_t) * in_tmp.width * in_tmp.height);
+  }
+
+  // with one seam per pass, seams are only marked as removed at first, and
+  // the buffers are compacted every so often instead of after every seam
+  const bool lazy = batch == 1 && ctx->opts.compact_interval > 1;
+  seam_gaps gaps = { 0 };
+  size_t *to_remove_mem = NULL;
+  if (lazy) {
+    gaps_init(&gaps, in_tmp.height, ctx->opts.compact_interval, scratch);
+    to_remove_mem = arena_alloc(scratch, sizeof(size_t) * in_tmp.height);
+  }
+
+  if (!to_remove || (batch > 1 && (!sorted || !claimed))
+      || (lazy && (!gaps.cols || !to_remove_mem))) {
     log_fatal("malloc failed");
     return 1;
   }
   TOC(malloc);
 
-  size_t pathsum_inout = 0;
-  static double best_conv_cpe = INFINITY;
+  seam_removal removal = {
+    .gray = &in_tmp,
+    .rgb = rgb ? &rgb_in_tmp : NULL,
+    .bias = bias ? &bias_tmp : NULL,
+    .energy = forward ? NULL : &img_en,
+    .pathsum = &img_pathsum,
+    .cols = seams ? &cols : NULL,
+    .to_remove = to_remove,
+    .sorted = sorted,
+    .pool = ctx->pool,
+  };
 
-  // remove one seam at a time until done
-  for (size_t ww = in->width-1; ww >= out->width; ww--) {
-    if (ww == in->width-1) {
-      // compute the initial energy map
-      TIC;
-      double cpe = compute_energymap(&in_tmp, &img_en);
-      TOC(conv);
-      if (cpe < best_conv_cpe) best_conv_cpe = cpe;
+  // bytes of the buffers each path sum or seam step reads and writes: its
+  // energy, or the gray pixels of forward energy, the path sum above it, and
+  // itself and its direction
+  const size_t psval = img_pathsum.narrow.data ? sizeof(uint16_t) : sizeof(uint32_t);
+  const size_t ps_read = (forward ? 2 : sizeof(enval)) + psval;
+  const size_t ps_written = psval + (img_pathsum.dirs.data ? 1 : 0);
+  const size_t step_read = img_pathsum.dirs.data ? 1 : 3 * psval;
+
+  // seams removed by the last pass, 0 before the first one
+  size_t removed_last = 0;
+  size_t nremoved = 0;
+
+  // remove one seam, or one batch of seams, at a time until done
+  while (in_tmp.width > width) {
+    if (removed_last != 1) {
+      assert(gaps.count == 0);
+      // compute the initial energy map, unless it came with the image
+      if (!forward && (nremoved > 0 || !energy)) {
+        TIC;
+        double cpe = compute_energymap(&in_tmp, &img_en, ctx->energy, bias_in, ctx->pool,
+                                       scratch);
+        BYTES(conv, (bias_in ? 2 : 1) * in_tmp.width * in_tmp.height,
+              sizeof(enval) * in_tmp.width * in_tmp.height);
+        TOC(conv);
+        if (cpe < ctx->best_conv_cpe) ctx->best_conv_cpe = cpe;
+      }
       // compute the initial path sum
-      TIC;
-      compute_pathsum(&img_en, &img_pathsum);
-      TOC(pathsum);
+      if (!pyramid) {
+        TIC;
+        if (forward) {
+          compute_pathsum_forward(&in_tmp, &img_pathsum, ctx->pool);
+        } else {
+          compute_pathsum(&img_en, &img_pathsum, ctx->pool);
+        }
+        BYTES(pathsum, ps_read * in_tmp.width * in_tmp.height,
+              ps_written * in_tmp.width * in_tmp.height);
+        TOC(pathsum);
+      }
     } else {
       // compute a partial energy map
-      TIC;
-      double cpe = compute_energymap_partial(&in_tmp, &img_en, to_remove);
-      TOC(convp);
-      if (cpe < best_conv_cpe) best_conv_cpe = cpe;
+      if (!forward) {
+        TIC;
+        double cpe = compute_energymap_partial(&in_tmp, &img_en, ctx->energy, bias_in,
+                                               to_remove, &gaps);
+        // the three gray rows around each row's span of energies
+        const size_t span = 2 * ENERGY_PARTIAL_REACH;
+        BYTES(convp, (bias_in ? 4 : 3) * (span + 2) * in_tmp.height,
+              sizeof(enval) * span * in_tmp.height);
+        TOC(convp);
+        if (cpe < ctx->best_conv_cpe) ctx->best_conv_cpe = cpe;
+      }
       // compute a partial path sum
-      TIC;
-      pathsum_inout += compute_pathsum_partial(&img_en, &img_pathsum, to_remove);
-      TOC(pathsum);
+      if (!pyramid) {
+        TIC;
+        pathsum_cone cone;
+        if (forward) {
+          compute_pathsum_forward_partial(&in_tmp, &img_pathsum, to_remove, &gaps, ctx->pool,
+                                          &cone);
+        } else {
+          compute_pathsum_partial(&img_en, &img_pathsum, to_remove, &gaps, ctx->pool, &cone);
+        }
+        BYTES(pathsum, ps_read * cone.values, ps_written * cone.values);
+        TOC(pathsum);
+        ctx->stats.partial_pathsums++;
+        ctx->stats.cone_values += cone.values;
+        ctx->stats.cone_rows += in_tmp.height;
+        if (cone.widest > ctx->stats.cone_widest) ctx->stats.cone_widest = cone.widest;
+      }
     }
 
-    // find the seam
+    // find the seams
     TIC;
-    find_minseam(&img_pathsum, to_remove);
+    size_t want = batch < in_tmp.width - width ? batch : in_tmp.width - width;
+    size_t nfound = 1;
+    ctx->stats.passes++;
+    if (pyramid) {
+      // the coarse seams are spread evenly over the seams to find
+      size_t k = nremoved * ncoarse / ncarve;
+      guide_seam(&coarse_seams[k * coarse.height], coarse.width - k, coarse.height,
+                 in_tmp.width, in_tmp.height, guide);
+      if (find_seam_in_band(forward ? NULL : &img_en, forward ? &in_tmp : NULL, guide,
+                            ctx->opts.pyramid_band, to_remove, &gaps, scratch) != 0) {
+        log_fatal("malloc failed");
+        return 1;
+      }
+      // the band's path sums stay in cache, but its directions don't
+      const size_t nband = (2*ctx->opts.pyramid_band + 1) * in_tmp.height;
+      BYTES(minpath, (forward ? 2 : sizeof(enval)) * nband,
+            nband + sizeof(size_t) * in_tmp.height);
+    } else if (want == 1) {
+      find_minseam(&img_pathsum, to_remove, &gaps);
+      BYTES(minpath, psval * in_tmp.width + step_read * in_tmp.height,
+            sizeof(size_t) * in_tmp.height);
+    } else {
+      nfound = find_minseams(&img_pathsum, want, to_remove, claimed, scratch);
+      BYTES(minpath, psval * in_tmp.width + (step_read + 1) * nfound * in_tmp.height,
+            (sizeof(size_t) + 1) * nfound * in_tmp.height);
+    }
     TOC(minpath);
 
-    // remove the seam from the grey
-    TIC;
-    remove_seam(&in_tmp, to_remove);
-    TOC(rmpath);
+    // where the seams are in the buffers, past any gaps
+    const size_t *found_mem = to_remove;
+    if (lazy) {
+      TIC;
+      for (size_t i = 0; i < in_tmp.height; i++) {
+        to_remove_mem[i] = gaps_col(&gaps, i, to_remove[i]);
+      }
+      found_mem = to_remove_mem;
+      BYTES(rmpath, sizeof(size_t) * (gaps.count + 1) * in_tmp.height,
+            sizeof(size_t) * in_tmp.height);
+      TOC(rmpath);
+    }
 
-    // remove the seam from the rgb
-    TIC;
-    remove_seam(&rgb_in_tmp, to_remove);
-    TOC(rmpath);
+    // record the seams as they were found
+    if (found) {
+      const size_t hh = in_tmp.height;
+      for (size_t k = 0; k < nfound * hh; k++) {
+        found[nremoved * hh + k] = (uint32_t)to_remove[k];
+      }
+    }
 
-    // remove the seam from the energymap
+    // record the seams in original columns
+    if (seams) {
+      TIC;
+      for (size_t k = 0; k < nfound; k++) {
+        uint32_t *seam = &seams[(nremoved + k) * cols.height];
+        const size_t *mem = &found_mem[k * cols.height];
+        for (size_t i = 0; i < cols.height; i++) {
+          seam[i] = GET_PIXEL(&cols, i, mem[i]);
+        }
+      }
+      BYTES(rmpath, (sizeof(size_t) + sizeof(uint32_t)) * nfound * cols.height,
+            sizeof(uint32_t) * nfound * cols.height);
+      TOC(rmpath);
+    }
+
+    // remove the seams from the grey, rgb, bias, energymap, pathsum and column map
     TIC;
-    remove_seam(&img_en, to_remove);
+    size_t moved = 0;
+    if (lazy) {
+      gaps_insert(&gaps, to_remove_mem);
+      shrink_width(&removal, 1);
+      if (gaps.count == gaps.capacity || gaps.count * GAP_SPACING >= in_tmp.width) {
+        removal.gaps = &gaps;
+        moved = remove_seam(&removal);
+        removal.gaps = NULL;
+        gaps.count = 0;
+      }
+    } else {
+      removal.nseams = nfound;
+      moved = remove_seam(&removal);
+    }
+    BYTES(rmpath, moved, moved);
     TOC(rmpath);
 
-    // remove the seam from the pathsum
+    nremoved += nfound;
+    ctx->stats.seams_removed += nfound;
+    removed_last = nfound;
+  }
+
+  // compact whatever is still only marked
+  if (gaps.count > 0) {
     TIC;
-    remove_seam(&img_pathsum, to_remove);
+    removal.gaps = &gaps;
+    size_t moved = remove_seam(&removal);
+    gaps.count = 0;
+    BYTES(rmpath, moved, moved);
     TOC(rmpath);
   }
 
-  assert(in_tmp.width == rgb_in_tmp.width);
-  assert(in_tmp.width == out->width);
+  assert(!rgb || in_tmp.width == rgb_in_tmp.red.width);
+  assert(in_tmp.width == width);
+
+  // hand the carved images back
+  if (rgb) *rgb = rgb_in_tmp;
+  if (bias) *bias = bias_tmp;
+  *gray = in_tmp;
+
+  arena_release(scratch, mark);
+
+  log_info("conv   : %f cpe", ctx->best_conv_cpe);
 
-  // finish up
+  return 0;
+}
+
+/**
+ * @brief How many times smaller to find seams on first, 1 for not at all.
+ */
+static size_t pyramid_scale(const gray_image *gray) {
+  size_t scale = 1;
+  while ((gray->width / scale) * (gray->height / scale) > PYRAMID_PIXELS
+         && gray->width / (2*scale) >= PYRAMID_MIN_SIDE
+         && gray->height / (2*scale) >= PYRAMID_MIN_SIDE) {
+    scale *= 2;
+  }
+  return scale;
+}
+
+/**
+ * @brief Carve seams from a copy of an image shrunk by a scale.
+ * @param bias the bias of gray, shrunk along with it, or NULL
+ * @param coarse receives the geometry of the shrunk copy, from before it was
+ *               carved, with its pixels in the arena
+ * @param found receives the seams, as carve_seams' found
+ */
+static int find_coarse_seams(car_context *ctx, const gray_image *gray, const gray_image *bias,
+                             size_t scale, size_t nseams, gray_image *coarse, uint32_t *found) {
   TIC;
-  imgcpy(out, &rgb_in_tmp);
-  free(rgb_in_tmp.data);
-  free(in_tmp.data);
-  free(img_en.data);
-  free(to_remove);
-  free(img_pathsum.data);
+  ARENA_IMAGE(coarse, gray->width / scale, gray->height / scale, &ctx->scratch);
+  gray_image coarse_bias = { 0 };
+  if (bias) {
+    ARENA_IMAGE(&coarse_bias, coarse->width, coarse->height, &ctx->scratch);
+  }
+  if (!coarse->data || (bias && !coarse_bias.data)) {
+    log_fatal("malloc failed");
+    return 1;
+  }
   TOC(malloc);
 
-  double gbps = ((double)(pathsum_inout) / 1024.0 / 1024.0 / 1024.0)
-      / ((double)(__timing.pathsum) / 3200000000.0);
-  log_info("pathsum: %f gb/s", gbps);
-  log_info("conv   : %f cpe", best_conv_cpe);
+  TIC;
+  shrink_gray(gray, scale, coarse);
+  if (bias) shrink_gray(bias, scale, &coarse_bias);
+  BYTES(grey, (bias ? 2 : 1) * coarse->width * coarse->height * scale * scale,
+        (bias ? 2 : 1) * coarse->width * coarse->height);
+  TOC(grey);
 
-  log_info("Seam carving completed");
-  log_timing();
+  gray_image carved = *coarse;
+  return carve_seams(ctx, NULL, &carved, bias ? &coarse_bias : NULL, coarse->width - nseams,
+                     NULL, found, NULL);
+}
 
-  return 0;
+/**
+ * @brief Shrink an image by a scale, averaging each scale x scale block.
+ * @param out the shrunk image, in->width / scale by in->height / scale
+ */
+static void shrink_gray(const gray_image *in, size_t scale, gray_image *out) {
+  const size_t area = scale * scale;
+  for (size_t i = 0; i < out->height; i++) {
+    for (size_t j = 0; j < out->width; j++) {
+      size_t sum = 0;
+      for (size_t di = 0; di < scale; di++) {
+        const pixval *row = &GET_PIXEL(in, i*scale + di, j*scale);
+        for (size_t dj = 0; dj < scale; dj++) {
+          sum += row[dj];
+        }
+      }
+      GET_PIXEL(out, i, j) = (pixval)((sum + area/2) / area);
+    }
+  }
 }
 
-static void imgcpy(rgb_image *dst, const rgb_image *src) {
-  assert(IS_IMAGE(dst));
-  assert(IS_IMAGE(src));
-  assert(dst->width == src->width);
-  assert(dst->height == src->height);
+/**
+ * @brief Scale a seam of a smaller image up to a guide for a bigger one.
+ *
+ * The rows in between the smaller image's are interpolated, so the guide
+ * moves smoothly rather than in steps of the scale.
+ *
+ * @param coarse_seam the seam's column in every row of the smaller image
+ * @param coarse_width the width of the smaller image when the seam was found
+ * @param width the bigger image's width now
+ * @param guide receives a column in every row of the bigger image
+ */
+static void guide_seam(const uint32_t *coarse_seam, size_t coarse_width,
+                       size_t coarse_height, size_t width, size_t height, size_t *guide) {
+  const double sx = (double)width / (double)coarse_width;
+  const double sy = (double)coarse_height / (double)height;
+
+  for (size_t i = 0; i < height; i++) {
+    // the row of the smaller image at the centre of this one
+    double y = ((double)i + 0.5) * sy - 0.5;
+    if (y < 0) y = 0;
+    size_t r0 = (size_t)y;
+    if (r0 > coarse_height-1) r0 = coarse_height-1;
+    size_t r1 = r0+1 < coarse_height ? r0+1 : r0;
+    double t = y - (double)r0;
+    if (t > 1) t = 1;
 
-  size_t ww = dst->width;
-  size_t hh = dst->height;
+    double x = ((1-t) * coarse_seam[r0] + t * coarse_seam[r1] + 0.5) * sx;
+    size_t col = (size_t)x;
+    guide[i] = col < width ? col : width-1;
+  }
+}
 
-  size_t row_size = ww * sizeof(*dst->data);
+/**
+ * @brief Insert vertical seams into a pair of working images.
+ *
+ * The seams to duplicate are found by carving a copy of the gray image with
+ * the usual machinery, which records each seam in original coordinates. All
+ * of them are then inserted in one expansion pass over each row, instead of
+ * shifting every row once per seam. Only up to half of the image is used
+ * for seams in a pass, so bigger enlargements are done in several passes.
+ *
+ * @param rgb the color image, replaced by the widened image
+ * @param gray grayscale version of rgb, replaced alongside it
+ * @param bias the bias of gray, widened along with it, or NULL
+ * @param width the width to widen both images to
+ * @param energy the energy map of gray if it's already known, or NULL
+ */
+static int insert_seams(car_context *ctx, planar_image *rgb, gray_image *gray,
+                        gray_image *bias, size_t width, energymap *energy) {
+  assert(IS_IMAGE(&rgb->red));
+  assert(IS_IMAGE(gray));
+  assert(rgb->red.width == gray->width);
+  assert(rgb->red.height == gray->height);
+  assert(gray->width > CAR_MIN_SIZE);
+  assert(width > gray->width);
 
-  for (size_t i = 0; i < hh; i++) {
-    memcpy(&GET_PIXEL(dst, i, 0), &GET_PIXEL(src, i, 0), row_size);
+  while (gray->width < width) {
+    const size_t hh = gray->height;
+    const size_t ww = gray->width;
+    size_t nseams = width - ww < ww/2 ? width - ww : ww/2;
+    // the copy the seams are found in can't be carved narrower than that
+    if (nseams > ww - CAR_MIN_SIZE) {
+      nseams = ww - CAR_MIN_SIZE;
+    }
+
+    // the widened images outlive the pass, but everything else goes back
+    // to the arena at the end of it
+    TIC;
+    planar_image rgb_out;
+    gray_image gray_out;
+    ARENA_IMAGE(&gray_out, ww + nseams, hh, &ctx->scratch);
+    int rgb_failed = planar_init(&rgb_out, ww + nseams, hh, &ctx->scratch);
+    gray_image bias_out = { 0 };
+    if (bias) {
+      ARENA_IMAGE(&bias_out, ww + nseams, hh, &ctx->scratch);
+    }
+    arena_mark mark;
+    arena_get_mark(&ctx->scratch, &mark);
+    gray_image search;
+    ARENA_IMAGE(&search, ww, hh, &ctx->scratch);
+    gray_image search_bias = { 0 };
+    if (bias) {
+      ARENA_IMAGE(&search_bias, ww, hh, &ctx->scratch);
+    }
+    uint32_t *seams = arena_alloc(&ctx->scratch, sizeof(uint32_t) * nseams * hh);
+    uint32_t *cols = arena_alloc(&ctx->scratch, sizeof(uint32_t) * nseams * hh);
+    uint8_t *marks = arena_alloc(&ctx->scratch, sizeof(uint8_t) * ww);
+    if (!search.data || rgb_failed || !gray_out.data || !seams || !cols || !marks
+        || (bias && (!bias_out.data || !search_bias.data))) {
+      log_fatal("malloc failed");
+      return 1;
+    }
+    for (size_t i = 0; i < hh; i++) {
+      memcpy(&GET_PIXEL(&search, i, 0), &GET_PIXEL(gray, i, 0), ww);
+      if (bias) memcpy(&GET_PIXEL(&search_bias, i, 0), &GET_PIXEL(bias, i, 0), ww);
+    }
+    BYTES(malloc, (bias ? 2 : 1) * ww * hh, (bias ? 2 : 1) * ww * hh);
+    TOC(malloc);
+
+    // find the seams on a throwaway copy, which only matches the energy map
+    // on the first pass
+    int failed = carve_seams(ctx, NULL, &search, bias ? &search_bias : NULL, ww - nseams,
+                             seams, NULL, energy);
+    energy = NULL;
+    if (failed) {
+      return 1;
+    }
+
+    // sort each row's seam columns by marking them off along the row
+    TIC;
+    for (size_t i = 0; i < hh; i++) {
+      memset(marks, 0, ww);
+      for (size_t k = 0; k < nseams; k++) {
+        marks[seams[k*hh + i]] = 1;
+      }
+      uint32_t *row_cols = &cols[i*nseams];
+      size_t n = 0;
+      for (size_t j = 0; j < ww; j++) {
+        if (marks[j]) row_cols[n++] = (uint32_t)j;
+      }
+      assert(n == nseams);
+    }
+
+    // and widen everything in one pass
+    expand_gray(&rgb->red, &rgb_out.red, cols);
+    expand_gray(&rgb->green, &rgb_out.green, cols);
+    expand_gray(&rgb->blue, &rgb_out.blue, cols);
+    expand_gray(gray, &gray_out, cols);
+    if (bias) expand_gray(bias, &bias_out, cols);
+    // the seams, sorted into rows, and every plane
+    const size_t nplanes = bias ? 5 : 4;
+    BYTES(insert, 2 * sizeof(uint32_t) * nseams * hh + nplanes * ww * hh,
+          sizeof(uint32_t) * nseams * hh + nplanes * (ww + nseams) * hh);
+    TOC(insert);
+    ctx->stats.seams_inserted += nseams;
+
+    arena_release(&ctx->scratch, mark);
+    *rgb = rgb_out;
+    *gray = gray_out;
+    if (bias) *bias = bias_out;
   }
+
+  return 0;
 }
 
-static void rgb2gray(const rgb_image *in, gray_image *out) {
+/**
+ * @brief Copy an image into a wider one, adding a pixel after each seam.
+ * @param cols sorted seam columns of each row, out->width - in->width per row
+ */
+static void expand_gray(const gray_image *in, gray_image *out, const uint32_t *cols) {
   assert(IS_IMAGE(in));
   assert(IS_IMAGE(out));
+  assert(in->height == out->height);
+  assert(out->width > in->width);
 
-  size_t hh = in->height;
-  size_t ww = in->width;
+  const size_t nseams = out->width - in->width;
+
+  for (size_t i = 0; i < in->height; i++) {
+    const uint32_t *row_cols = &cols[i*nseams];
+    pixval *dst = &GET_PIXEL(out, i, 0);
+    size_t j = 0;
+
+    for (size_t k = 0; k < nseams; k++) {
+      size_t col = row_cols[k];
+
+      memcpy(dst, &GET_PIXEL(in, i, j), col+1-j);
+      dst += col+1-j;
+      j = col+1;
+
+      pixval ll = GET_PIXEL(in, i, col);
+      pixval rr = GET_PIXEL(in, i, col+1 < in->width ? col+1 : col);
+      *dst++ = (pixval)((ll + rr + 1) / 2);
+    }
+
+    memcpy(dst, &GET_PIXEL(in, i, j), in->width-j);
+  }
+}
+
+/**
+ * @brief Allocate a transposed copy of a planar image.
+ */
+static int transpose_planar(car_context *ctx, const planar_image *in, planar_image *out) {
+  assert(IS_IMAGE(&in->red));
+
+  if (planar_init(out, in->red.height, in->red.width, &ctx->scratch) != 0) {
+    return 1;
+  }
+  transpose_gray(&in->red, &out->red);
+  transpose_gray(&in->green, &out->green);
+  transpose_gray(&in->blue, &out->blue);
+  return 0;
+}
+
+/**
+ * @brief Remove a seam from every working buffer.
+ *
+ * Rows are independent, so they're split into bands between the threads,
+ * and each band is removed from all of the buffers before moving on. If
+ * removal->gaps is set, the seams marked there are compacted out instead,
+ * and the widths are left alone since they already don't count them.
+ *
+ * @return the bytes moved, which are each read and written once
+ */
+static size_t remove_seam(seam_removal *removal) {
+  gray_image *gray = removal->gray;
+  size_t hh = gray->height;
+  size_t nbands = (hh + BAND_HEIGHT - 1) / BAND_HEIGHT;
 
-  assert(hh == out->height);
-  assert(ww == out->width);
+  // every column right of the first seam in a row moves, less the seams
+  size_t moved = 0;
 
+  if (removal->gaps) {
+    threadpool_run(removal->pool, nbands, remove_gaps_band, removal);
+    for (size_t i = 0; i < hh; i++) {
+      moved += gray->width - GAPS_ROW(removal->gaps, i)[0];
+    }
+    return moved * column_bytes(removal);
+  }
+
+  if (removal->nseams > 1) {
+    // several seams are compacted out of each row in one go
+    threadpool_run(removal->pool, nbands, remove_seams_band, removal);
+    const size_t n = removal->nseams;
+    for (size_t i = 0; i < hh; i++) {
+      moved += gray->width - removal->sorted[i*n] - n;
+    }
+    shrink_width(removal, n);
+    return moved * column_bytes(removal);
+  }
+
+  removal->shift_left = SHIFT_LEFT(gray, removal->to_remove);
+  threadpool_run(removal->pool, nbands, remove_seam_band, removal);
   for (size_t i = 0; i < hh; i++) {
-    for (size_t j = 0; j < ww; j++) {
-      rgb_pixel *pix = &GET_PIXEL(in, i, j);
-      GET_PIXEL(out, i, j) = (pixval)(pix->red/3 + pix->green/3 + pix->blue/3);
+    size_t col = removal->to_remove[i];
+    moved += removal->shift_left ? gray->width - col - 1 : col;
+  }
+
+  bool shift_left = removal->shift_left;
+  remove_seam_finish(removal->gray, shift_left);
+  if (removal->bias) remove_seam_finish(removal->bias, shift_left);
+  if (removal->energy) remove_seam_finish(removal->energy, shift_left);
+  remove_seam_finish(&removal->pathsum->narrow, shift_left);
+  remove_seam_finish(&removal->pathsum->wide, shift_left);
+  remove_seam_finish(&removal->pathsum->dirs, shift_left);
+  if (removal->rgb) {
+    remove_seam_finish(&removal->rgb->red, shift_left);
+    remove_seam_finish(&removal->rgb->green, shift_left);
+    remove_seam_finish(&removal->rgb->blue, shift_left);
+  }
+  if (removal->cols) remove_seam_finish(removal->cols, shift_left);
+  return moved * column_bytes(removal);
+}
+
+/**
+ * @brief The bytes of a column of every working buffer.
+ */
+static size_t column_bytes(const seam_removal *removal) {
+  size_t bytes = sizeof(pixval);
+  if (removal->bias) bytes += sizeof(pixval);
+  if (removal->energy) bytes += sizeof(enval);
+  if (removal->pathsum->narrow.data) {
+    bytes += sizeof(uint16_t);
+  } else if (removal->pathsum->wide.data) {
+    bytes += sizeof(uint32_t);
+  }
+  if (removal->pathsum->dirs.data) bytes += sizeof(uint8_t);
+  if (removal->rgb) bytes += 3 * sizeof(pixval);
+  if (removal->cols) bytes += sizeof(uint32_t);
+  return bytes;
+}
+
+/**
+ * @brief Take n columns off the width of every working buffer.
+ */
+static void shrink_width(seam_removal *removal, size_t n) {
+  removal->gray->width -= n;
+  if (removal->bias) removal->bias->width -= n;
+  if (removal->energy) removal->energy->width -= n;
+  removal->pathsum->narrow.width -= n;
+  removal->pathsum->wide.width -= n;
+  removal->pathsum->dirs.width -= n;
+  if (removal->rgb) {
+    removal->rgb->red.width -= n;
+    removal->rgb->green.width -= n;
+    removal->rgb->blue.width -= n;
+  }
+  if (removal->cols) removal->cols->width -= n;
+}
+
+static void remove_seams_band(void *arg, size_t task) {
+  const seam_removal *removal = arg;
+  const size_t n = removal->nseams;
+
+  size_t hh = removal->gray->height;
+  size_t i0 = task * BAND_HEIGHT;
+  size_t i1 = i0 + BAND_HEIGHT < hh ? i0 + BAND_HEIGHT : hh;
+
+  for (size_t i = i0; i < i1; i++) {
+    // the seams don't cross, but they're found in cost order, not left to
+    // right, so put this row's columns in order first
+    size_t *cols = &removal->sorted[i*n];
+    for (size_t k = 0; k < n; k++) {
+      size_t col = removal->to_remove[k*hh + i];
+      size_t kk = k;
+      for (; kk > 0 && cols[kk-1] > col; kk--) {
+        cols[kk] = cols[kk-1];
+      }
+      cols[kk] = col;
+    }
+
+    size_t ww = removal->gray->width;
+    remove_seams_row(removal->gray, i, cols, n, ww);
+    if (removal->bias) remove_seams_row(removal->bias, i, cols, n, ww);
+    if (removal->energy) remove_seams_row(removal->energy, i, cols, n, ww);
+    if (removal->pathsum->narrow.data) {
+      remove_seams_row(&removal->pathsum->narrow, i, cols, n, ww);
+    } else if (removal->pathsum->wide.data) {
+      remove_seams_row(&removal->pathsum->wide, i, cols, n, ww);
     }
+    if (removal->pathsum->dirs.data) {
+      remove_seams_row(&removal->pathsum->dirs, i, cols, n, ww);
+    }
+    if (removal->rgb) {
+      remove_seams_row(&removal->rgb->red, i, cols, n, ww);
+      remove_seams_row(&removal->rgb->green, i, cols, n, ww);
+      remove_seams_row(&removal->rgb->blue, i, cols, n, ww);
+    }
+    if (removal->cols) remove_seams_row(removal->cols, i, cols, n, ww);
+  }
+}
+
+static void remove_gaps_band(void *arg, size_t task) {
+  const seam_removal *removal = arg;
+  const seam_gaps *gaps = removal->gaps;
+  const size_t n = gaps->count;
+
+  size_t hh = removal->gray->height;
+  size_t i0 = task * BAND_HEIGHT;
+  size_t i1 = i0 + BAND_HEIGHT < hh ? i0 + BAND_HEIGHT : hh;
+
+  // the rows are still wide enough in memory to hold the gaps
+  size_t ww = removal->gray->width + n;
+
+  for (size_t i = i0; i < i1; i++) {
+    const size_t *cols = GAPS_ROW(gaps, i);
+    remove_seams_row(removal->gray, i, cols, n, ww);
+    if (removal->bias) remove_seams_row(removal->bias, i, cols, n, ww);
+    if (removal->energy) remove_seams_row(removal->energy, i, cols, n, ww);
+    if (removal->pathsum->narrow.data) {
+      remove_seams_row(&removal->pathsum->narrow, i, cols, n, ww);
+    } else if (removal->pathsum->wide.data) {
+      remove_seams_row(&removal->pathsum->wide, i, cols, n, ww);
+    }
+    if (removal->pathsum->dirs.data) {
+      remove_seams_row(&removal->pathsum->dirs, i, cols, n, ww);
+    }
+    if (removal->rgb) {
+      remove_seams_row(&removal->rgb->red, i, cols, n, ww);
+      remove_seams_row(&removal->rgb->green, i, cols, n, ww);
+      remove_seams_row(&removal->rgb->blue, i, cols, n, ww);
+    }
+    if (removal->cols) remove_seams_row(removal->cols, i, cols, n, ww);
+  }
+}
+
+static void remove_seam_band(void *arg, size_t task) {
+  const seam_removal *removal = arg;
+  const size_t *to_remove = removal->to_remove;
+  bool shift_left = removal->shift_left;
+
+  size_t hh = removal->gray->height;
+  size_t i0 = task * BAND_HEIGHT;
+  size_t i1 = i0 + BAND_HEIGHT < hh ? i0 + BAND_HEIGHT : hh;
+
+  // do every buffer for a row while its seam column is at hand, rather than
+  // walking the band once per buffer
+  for (size_t i = i0; i < i1; i++) {
+    size_t col = to_remove[i];
+    remove_seam_row(removal->gray, i, col, shift_left);
+    if (removal->bias) remove_seam_row(removal->bias, i, col, shift_left);
+    if (removal->energy) remove_seam_row(removal->energy, i, col, shift_left);
+    if (removal->pathsum->narrow.data) {
+      remove_seam_row(&removal->pathsum->narrow, i, col, shift_left);
+    } else if (removal->pathsum->wide.data) {
+      remove_seam_row(&removal->pathsum->wide, i, col, shift_left);
+    }
+    if (removal->pathsum->dirs.data) {
+      remove_seam_row(&removal->pathsum->dirs, i, col, shift_left);
+    }
+    if (removal->rgb) {
+      remove_seam_row(&removal->rgb->red, i, col, shift_left);
+      remove_seam_row(&removal->rgb->green, i, col, shift_left);
+      remove_seam_row(&removal->rgb->blue, i, col, shift_left);
+    }
+    if (removal->cols) remove_seam_row(removal->cols, i, col, shift_left);
+  }
+}
+
+/**
+ * @brief Get the context's pool of threads, restarting it if it's the
+ *        wrong size.
+ */
+static threadpool *get_pool(car_context *ctx, size_t nthreads) {
+  if (ctx->threads && threadpool_size(ctx->threads) != nthreads) {
+    threadpool_destroy(ctx->threads);
+    ctx->threads = NULL;
+  }
+  if (!ctx->threads) {
+    ctx->threads = threadpool_create(nthreads);
+    if (!ctx->threads) {
+      log_warn("Could not start threads, carving on one thread");
+    }
+  }
+
+  return ctx->threads;
+}
+
+typedef struct {
+  const rgb_image *in;
+  planar_image *rgb;
+  gray_image *gray;
+  const int8_t *bias_in;
+  gray_image *bias;
+  energymap *energy;
+  const energy_func *fn;
+} split_bands;
+
+/**
+ * @brief Split a rgb image into planes and gray, and the energy of the gray
+ *        image if energy isn't NULL, in one pass over the rows.
+ *
+ * If bias isn't NULL, the caller's bias is copied into it as well, offset
+ * by BIAS_ZERO, and added to the energy.
+ *
+ * Each band computes the energy of a row as soon as the gray row below it
+ * is done, while the three rows are still in cache. The first and last row
+ * of a band need a row from the bands next to it, so they're left until
+ * every band is done.
+ */
+static void split_image(car_context *ctx, const rgb_image *in, planar_image *rgb,
+                        gray_image *gray, gray_image *bias, energymap *energy) {
+  assert(IS_IMAGE(in));
+  assert(IS_IMAGE(gray));
+  assert(in->height == gray->height);
+  assert(in->width == gray->width);
+  assert(!bias || IS_IMAGE(bias));
+  assert(!energy || IS_IMAGE(energy));
+
+  split_bands bands = {
+    .in = in, .rgb = rgb, .gray = gray, .bias_in = ctx->opts.bias, .bias = bias,
+    .energy = energy, .fn = ctx->energy
+  };
+  size_t nbands = (in->height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+  threadpool_run(ctx->pool, nbands, split_band, &bands);
+  if (energy) {
+    threadpool_run(ctx->pool, nbands, split_band_edges, &bands);
+  }
+}
+
+static void split_band(void *arg, size_t task) {
+  const split_bands *bands = arg;
+
+  size_t hh = bands->in->height;
+  size_t i0 = task * BAND_HEIGHT;
+  size_t i1 = i0 + BAND_HEIGHT < hh ? i0 + BAND_HEIGHT : hh;
+
+  for (size_t i = i0; i < i1; i++) {
+    rgb2planar_rows(bands->in, bands->rgb, bands->gray, i, i+1);
+    if (bands->bias) {
+      const size_t ww = bands->in->width;
+      const int8_t *src = &bands->bias_in[i*ww];
+      pixval *dst = &GET_PIXEL(bands->bias, i, 0);
+      for (size_t j = 0; j < ww; j++) {
+        dst[j] = (pixval)(src[j] + BIAS_ZERO);
+      }
+    }
+    if (bands->energy && i >= i0 + 2) {
+      compute_energymap_rows(bands->gray, bands->energy, bands->fn, bands->bias, i-1, i);
+    }
+  }
+}
+
+static void split_band_edges(void *arg, size_t task) {
+  const split_bands *bands = arg;
+
+  size_t hh = bands->in->height;
+  size_t i0 = task * BAND_HEIGHT;
+  size_t i1 = i0 + BAND_HEIGHT < hh ? i0 + BAND_HEIGHT : hh;
+
+  compute_energymap_rows(bands->gray, bands->energy, bands->fn, bands->bias, i0, i0+1);
+  if (i1-1 > i0) {
+    compute_energymap_rows(bands->gray, bands->energy, bands->fn, bands->bias, i1-1, i1);
   }
 }
 
@@ -265,21 +1412,81 @@ static void gray2rgb(const gray_image *in, rgb_image *out) {
 }
 
 
-static void log_timing(void) {
-  uint64_t total =
-      __timing.grey
-    + __timing.conv
-    + __timing.convp
-    + __timing.pathsum
-    + __timing.minpath
-    + __timing.rmpath
-    + __timing.malloc;
-  log_info("grey   \t%llu\t%3.2f%%", 100.0 * (double) __timing.grey    / (double) total, __timing.grey   );
-  log_info("conv   \t%llu\t%3.2f%%", 100.0 * (double) __timing.conv    / (double) total, __timing.conv   );
-  log_info("convp  \t%llu\t%3.2f%%", 100.0 * (double) __timing.convp   / (double) total, __timing.convp  );
-  log_info("pathsum\t%llu\t%3.2f%%", 100.0 * (double) __timing.pathsum / (double) total, __timing.pathsum);
-  log_info("minpath\t%llu\t%3.2f%%", 100.0 * (double) __timing.minpath / (double) total, __timing.minpath);
-  log_info("rmpath \t%llu\t%3.2f%%", 100.0 * (double) __timing.rmpath  / (double) total, __timing.rmpath );
-  log_info("malloc \t%llu\t%3.2f%%", 100.0 * (double) __timing.malloc  / (double) total, __timing.malloc );
-  log_info("total  \t%llu", total);
+/**
+ * @brief Start timing a stage, and counting its events if the carve counts
+ *        them.
+ */
+static void stage_begin(car_context *ctx) {
+  if (ctx->stats.counters) {
+    perfctr_read(&ctx->counters, ctx->stage_counts);
+  }
+  ctx->stage_start = GET_CYCLE_COUNT();
+}
+
+/**
+ * @brief Add what the stage begun last cost to its stats. The counters are
+ *        read after the cycles, so their system calls aren't timed.
+ */
+static void stage_end(car_context *ctx, car_stage_stats *stage) {
+  stage->cycles += GET_CYCLE_COUNT() - ctx->stage_start;
+  stage->calls++;
+  if (ctx->stats.counters) {
+    uint64_t counts[PERFCTR_COUNT];
+    perfctr_read(&ctx->counters, counts);
+    stage->instructions += counts[PERFCTR_INSTRUCTIONS] - ctx->stage_counts[PERFCTR_INSTRUCTIONS];
+    stage->llc_misses += counts[PERFCTR_LLC_MISSES] - ctx->stage_counts[PERFCTR_LLC_MISSES];
+    stage->branch_misses += counts[PERFCTR_BRANCH_MISSES]
+                          - ctx->stage_counts[PERFCTR_BRANCH_MISSES];
+  }
+}
+
+static void log_stats(const car_context *ctx) {
+  const car_stats *st = &ctx->stats;
+  const struct {
+    const char *name;
+    const car_stage_stats *stage;
+  } stages[] = {
+    { "grey   ", &st->grey },
+    { "transp ", &st->transpose },
+    { "conv   ", &st->conv },
+    { "convp  ", &st->convp },
+    { "pathsum", &st->pathsum },
+    { "minpath", &st->minpath },
+    { "rmpath ", &st->rmpath },
+    { "insert ", &st->insert },
+    { "malloc ", &st->malloc },
+  };
+  const size_t nstages = sizeof(stages) / sizeof(stages[0]);
+
+  uint64_t total = 0;
+  for (size_t k = 0; k < nstages; k++) {
+    total += stages[k].stage->cycles;
+  }
+
+  // the bandwidth each stage needed, and with counters, how much of it
+  // missed the last level cache
+  for (size_t k = 0; k < nstages; k++) {
+    const car_stage_stats *stage = stages[k].stage;
+    double seconds = (double)stage->cycles / st->tsc_hz;
+    double bytes = (double)(stage->bytes_read + stage->bytes_written);
+    double gbps = seconds > 0 ? bytes / seconds / 1e9 : 0;
+    if (st->counters) {
+      log_info("%s\t%llu\t%3.2f%%\t%6.2f GB/s\t%llu instr\t%llu llc miss\t%llu br miss",
+               stages[k].name, (unsigned long long)stage->cycles,
+               100.0 * (double)stage->cycles / (double)total, gbps,
+               (unsigned long long)stage->instructions, (unsigned long long)stage->llc_misses,
+               (unsigned long long)stage->branch_misses);
+    } else {
+      log_info("%s\t%llu\t%3.2f%%\t%6.2f GB/s", stages[k].name,
+               (unsigned long long)stage->cycles,
+               100.0 * (double)stage->cycles / (double)total, gbps);
+    }
+  }
+  log_info("total  \t%llu", (unsigned long long)total);
+
+  if (st->partial_pathsums > 0) {
+    log_info("cones  \t%zu partial path sums, %.1f wide on average, %zu at the widest",
+             st->partial_pathsums, (double)st->cone_values / (double)st->cone_rows,
+             st->cone_widest);
+  }
 }
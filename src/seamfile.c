@@ -0,0 +1,357 @@
+/**
+ * @file seamfile.c
+ * @brief Saving ranks to a file and narrowing images straight from it
+ *
+ * A seam file is a header, the column of every seam in the first row as a
+ * uint32_t, and then for every other row the steps of all the seams from
+ * the row above, 2 bits each, four to a byte starting from the low bits and
+ * padded to a whole byte per row. A step is stored plus one, so 0 is a
+ * column left, 1 straight down and 2 a column right. Every number is little
+ * endian, as on the x86 cpus the library runs on.
+ *
+ * The columns are in the image the seams before each one left, which is
+ * what keeps the steps small. Turning them back into columns of the full
+ * image takes a count of the pixels still there, kept in a Fenwick tree
+ * over the row, so a row of n seams costs n log(width).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <fcntl.h>
+#include <log.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <car.h>
+
+#include "car_internal.h"
+#include "retarget.h"
+
+#define SEAM_FILE_MAGIC "CARS"
+#define SEAM_FILE_VERSION 1u
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t seams;
+  uint32_t reserved;  // 0
+} seam_file_header;
+
+struct car_seam_file {
+  const void *map;
+  size_t size;
+  const seam_file_header *header;
+  const uint32_t *first;  // every seam's column in row 0
+  const uint8_t *steps;   // height-1 rows of step_stride bytes
+  size_t step_stride;
+};
+
+static size_t step_stride(size_t seams);
+static size_t seam_file_size(size_t height, size_t seams);
+static size_t fenwick_size(size_t width);
+static void fenwick_fill(uint32_t *tree, size_t size);
+static size_t fenwick_count(const uint32_t *tree, size_t col);
+static size_t fenwick_find(const uint32_t *tree, size_t size, size_t n);
+static void fenwick_remove(uint32_t *tree, size_t size, size_t col);
+
+int car_ranks_save(const car_ranks *ranks, const char *path) {
+  assert(ranks && ranks->data);
+  assert(path);
+
+  const size_t ww = ranks->width;
+  const size_t hh = ranks->height;
+  const size_t nseams = ranks->seams;
+  if (ww > UINT32_MAX || hh > UINT32_MAX || nseams >= ww) {
+    log_error("Ranks of %zux%zu with %zu seams don't fit a seam file", ww, hh, nseams);
+    return 1;
+  }
+
+  // every seam's column in the full row, its column in the row the seams
+  // before it left, that column in the row above, and the tree of pixels
+  const size_t stride = step_stride(nseams);
+  const size_t tsize = fenwick_size(ww);
+  uint32_t *where = malloc(sizeof(uint32_t) * (3*nseams + tsize + 1));
+  uint8_t *steps = malloc(stride + 1);
+  if (!where || !steps) {
+    free(where);
+    free(steps);
+    log_fatal("malloc failed");
+    return 1;
+  }
+  uint32_t *cols = &where[nseams];
+  uint32_t *above = &where[2*nseams];
+  uint32_t *tree = &where[3*nseams];
+
+  FILE *fp = fopen(path, "wb");
+  if (!fp) {
+    free(where);
+    free(steps);
+    log_error("Could not open %s", path);
+    return 1;
+  }
+
+  seam_file_header header = {
+    .magic = SEAM_FILE_MAGIC,
+    .version = SEAM_FILE_VERSION,
+    .width = (uint32_t)ww,
+    .height = (uint32_t)hh,
+    .seams = (uint32_t)nseams,
+    .reserved = 0,
+  };
+  bool failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+
+  for (size_t i = 0; i < hh && !failed; i++) {
+    const uint32_t *row = &ranks->data[i*ww];
+    for (size_t j = 0; j < ww; j++) {
+      if (row[j] < nseams) {
+        where[row[j]] = (uint32_t)j;
+      }
+    }
+
+    fenwick_fill(tree, tsize);
+    for (size_t k = 0; k < nseams; k++) {
+      cols[k] = (uint32_t)fenwick_count(tree, where[k]);
+      fenwick_remove(tree, tsize, where[k]);
+    }
+
+    if (i == 0) {
+      failed = nseams > 0 && fwrite(cols, sizeof(uint32_t), nseams, fp) != nseams;
+    } else {
+      memset(steps, 0, stride);
+      for (size_t k = 0; k < nseams; k++) {
+        uint32_t step = cols[k] + 1 - above[k];
+        if (step > 2) {
+          log_error("Seam %zu moves %d columns at row %zu, so it can't be saved", k,
+                    (int)cols[k] - (int)above[k], i);
+          failed = true;
+          break;
+        }
+        steps[k/4] |= (uint8_t)(step << (2*(k%4)));
+      }
+      failed = failed || (stride > 0 && fwrite(steps, stride, 1, fp) != 1);
+    }
+
+    memcpy(above, cols, sizeof(uint32_t) * nseams);
+  }
+
+  failed = fclose(fp) != 0 || failed;
+  free(where);
+  free(steps);
+  if (failed) {
+    log_error("Could not save seams to %s", path);
+    remove(path);
+    return 1;
+  }
+  return 0;
+}
+
+car_seam_file *car_seam_file_open(const char *path) {
+  assert(path);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    log_error("Could not open %s", path);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(seam_file_header)) {
+    close(fd);
+    log_error("%s is not a seam file", path);
+    return NULL;
+  }
+  const size_t size = (size_t)st.st_size;
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    log_error("Could not map %s", path);
+    return NULL;
+  }
+
+  const seam_file_header *header = map;
+  if (memcmp(header->magic, SEAM_FILE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != SEAM_FILE_VERSION
+      || header->width == 0 || header->height == 0 || header->seams >= header->width
+      || size != seam_file_size(header->height, header->seams)) {
+    munmap(map, size);
+    log_error("%s is not a version %u seam file", path, SEAM_FILE_VERSION);
+    return NULL;
+  }
+
+  car_seam_file *file = malloc(sizeof(*file));
+  if (!file) {
+    munmap(map, size);
+    log_fatal("malloc failed");
+    return NULL;
+  }
+  file->map = map;
+  file->size = size;
+  file->header = header;
+  file->first = (const uint32_t *)(const void *)&header[1];
+  file->steps = (const uint8_t *)&file->first[header->seams];
+  file->step_stride = step_stride(header->seams);
+
+  // rows are read in order, and only once
+  posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+  return file;
+}
+
+void car_seam_file_close(car_seam_file *file) {
+  if (!file) {
+    return;
+  }
+  munmap((void *)(uintptr_t)file->map, file->size);
+  free(file);
+}
+
+void car_seam_file_size(const car_seam_file *file, size_t *width, size_t *height,
+                        size_t *seams) {
+  assert(file);
+  if (width) *width = file->header->width;
+  if (height) *height = file->header->height;
+  if (seams) *seams = file->header->seams;
+}
+
+int car_seam_file_retarget(const car_seam_file *file, const rgb_image *in, rgb_image *out) {
+  assert(file);
+  assert(IS_IMAGE(in));
+  assert(IS_IMAGE(out));
+  assert(in->width == file->header->width);
+  assert(in->height == file->header->height);
+  assert(out->buf_width == out->width);
+  assert(out->height == in->height);
+
+  const size_t ww = in->width;
+  const size_t hh = in->height;
+  if (out->width > ww || ww - out->width > file->header->seams) {
+    log_error("Can't retarget %zu wide to %zu wide with %u seams", ww, out->width,
+              file->header->seams);
+    return 1;
+  }
+  const size_t nremove = ww - out->width;
+
+  // the removed seams' columns in the row the seams before each left, the
+  // tree of pixels still there, and the row's ranks for retarget_row, where
+  // every pixel is either removed, rank 0, or kept, rank nremove
+  const size_t tsize = fenwick_size(ww);
+  uint32_t *cols = malloc(sizeof(uint32_t) * (nremove + tsize + 1 + ww));
+  if (!cols) {
+    log_fatal("malloc failed");
+    return 1;
+  }
+  uint32_t *tree = &cols[nremove];
+  uint32_t *ranks = &tree[tsize + 1];
+
+  memcpy(cols, file->first, sizeof(uint32_t) * nremove);
+  for (size_t i = 0; i < hh; i++) {
+    if (i > 0) {
+      const uint8_t *steps = &file->steps[(i-1) * file->step_stride];
+      for (size_t k = 0; k < nremove; k++) {
+        cols[k] += ((steps[k/4] >> (2*(k%4))) & 3u) - 1u;
+      }
+    }
+
+    fenwick_fill(tree, tsize);
+    for (size_t j = 0; j < ww; j++) {
+      ranks[j] = (uint32_t)nremove;
+    }
+    for (size_t k = 0; k < nremove; k++) {
+      // a step off either edge wraps to a column too large to be there
+      if (cols[k] >= ww - k) {
+        free(cols);
+        log_error("Seam %zu leaves the image at row %zu", k, i);
+        return 1;
+      }
+      size_t col = fenwick_find(tree, tsize, cols[k]);
+      fenwick_remove(tree, tsize, col);
+      ranks[col] = 0;
+    }
+
+    if (i + 1 < hh) {
+      retarget_row(ranks, &GET_PIXEL(in, i, 0), ww, (uint32_t)nremove, &GET_PIXEL(out, i, 0));
+    } else {
+      retarget_row_last(ranks, &GET_PIXEL(in, i, 0), ww, (uint32_t)nremove,
+                        &GET_PIXEL(out, i, 0));
+    }
+  }
+
+  free(cols);
+  return 0;
+}
+
+static size_t step_stride(size_t seams) {
+  return (seams + 3) / 4;
+}
+
+static size_t seam_file_size(size_t height, size_t seams) {
+  return sizeof(seam_file_header) + sizeof(uint32_t) * seams
+       + (height - 1) * step_stride(seams);
+}
+
+/**
+ * @brief Columns in a tree for a row, a power of two so that finding a
+ *        column takes the same steps every time. The columns past the row
+ *        are there, but come after every pixel that is looked for.
+ */
+static size_t fenwick_size(size_t width) {
+  size_t size = 1;
+  while (size < width) {
+    size *= 2;
+  }
+  return size;
+}
+
+/**
+ * @brief Set a tree up with every column there.
+ *
+ * Node n counts the n & -n columns ending at column n-1, which are all
+ * there, so there's nothing to add up.
+ */
+static void fenwick_fill(uint32_t *tree, size_t size) {
+  for (size_t n = 1; n <= size; n++) {
+    tree[n] = (uint32_t)(n & -n);
+  }
+}
+
+/**
+ * @brief Columns still there before a column.
+ */
+static size_t fenwick_count(const uint32_t *tree, size_t col) {
+  size_t count = 0;
+  for (size_t n = col; n > 0; n -= n & -n) {
+    count += tree[n];
+  }
+  return count;
+}
+
+/**
+ * @brief The column with n columns still there before it.
+ *
+ * Which half to look in next depends on a count just loaded, which a branch
+ * would mispredict half the time, so the steps are masked instead.
+ */
+static size_t fenwick_find(const uint32_t *tree, size_t size, size_t n) {
+  // the most columns with no more than n still there in them
+  size_t col = 0;
+  for (size_t step = size / 2; step > 0; step /= 2) {
+    size_t count = tree[col + step];
+    size_t fits = (size_t)0 - (count <= n);
+    col += step & fits;
+    n -= count & fits;
+  }
+  return col;
+}
+
+static void fenwick_remove(uint32_t *tree, size_t size, size_t col) {
+  for (size_t n = col + 1; n <= size; n += n & -n) {
+    tree[n]--;
+  }
+}
@@ -0,0 +1,64 @@
+/**
+ * @file simd.c
+ * @brief Pick the widest vector kernels the cpu can run
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simd.h"
+
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+static simd_level supported;
+static simd_level detected;
+
+static void detect(void);
+
+simd_level simd_get_level(void) {
+  pthread_once(&detect_once, detect);
+  return detected;
+}
+
+simd_level simd_set_level(simd_level level) {
+  pthread_once(&detect_once, detect);
+  detected = level < supported ? level : supported;
+  return detected;
+}
+
+const char *simd_level_name(simd_level level) {
+  switch (level) {
+    case SIMD_SSE:    return "sse";
+    case SIMD_AVX2:   return "avx2";
+    case SIMD_AVX512: return "avx512";
+    default:          return "unknown";
+  }
+}
+
+static void detect(void) {
+  __builtin_cpu_init();
+
+  simd_level level = SIMD_SSE;
+  if (__builtin_cpu_supports("avx2")) {
+    level = SIMD_AVX2;
+  }
+  // the kernels use the 128 and 256 bit forms of the masked instructions too
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+      && __builtin_cpu_supports("avx512vl")) {
+    level = SIMD_AVX512;
+  }
+
+  supported = level;
+
+  // only ever narrower than the cpu supports
+  const char *cap = getenv("CAR_SIMD");
+  if (cap) {
+    if (strcmp(cap, "sse") == 0) {
+      level = SIMD_SSE;
+    } else if (strcmp(cap, "avx2") == 0 && level > SIMD_AVX2) {
+      level = SIMD_AVX2;
+    }
+  }
+
+  detected = level;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file simd.h
+ * @brief Pick the widest vector kernels the cpu can run
+ */
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+typedef enum {
+  SIMD_SSE,     // x86-64-v2, which the whole program is built for
+  SIMD_AVX2,
+  SIMD_AVX512,  // avx512f, avx512bw and avx512vl
+} simd_level;
+
+/**
+ * @brief The vector instruction set the kernels should use.
+ *
+ * Found with cpuid the first time it's called. Setting CAR_SIMD to sse,
+ * avx2 or avx512 in the environment caps it, for testing the narrower
+ * kernels on a wider cpu.
+ */
+simd_level simd_get_level(void);
+
+/**
+ * @brief Use the kernels of a narrower level than the one found, or go back
+ *        up to it, so that tests and benchmarks can run every kernel in one
+ *        process. Not to be called while anything is carving.
+ * @return the level now in use, which is never wider than the cpu supports
+ */
+simd_level simd_set_level(simd_level level);
+
+const char *simd_level_name(simd_level level);
+
+#endif /* _SIMD_H_ */
@@ -0,0 +1,174 @@
+/**
+ * @file threadpool.c
+ * @brief A persistent pool of worker threads for data parallel loops
+ *
+ * The threads are started once and sleep between loops. Each loop bumps a
+ * generation counter to wake them, and tasks are claimed from a shared
+ * atomic counter by the workers and the calling thread alike.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <log.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+
+struct threadpool {
+  pthread_t *threads;
+  size_t nthreads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+
+  // the loop currently being run, guarded by lock
+  threadpool_fn fn;
+  void *arg;
+  size_t ntasks;
+  uint64_t generation;
+  size_t busy;
+  bool shutdown;
+
+  // next task to hand out in the current loop
+  atomic_size_t next;
+};
+
+static void *worker_main(void *arg);
+static void run_tasks(threadpool *pool, threadpool_fn fn, void *arg, size_t ntasks);
+
+threadpool *threadpool_create(size_t nthreads) {
+  assert(nthreads > 0);
+
+  threadpool *pool = calloc(1, sizeof(*pool));
+  if (!pool) {
+    return NULL;
+  }
+
+  pool->threads = calloc(nthreads, sizeof(*pool->threads));
+  if (!pool->threads) {
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+  atomic_init(&pool->next, 0);
+
+  // the caller of threadpool_run is the first thread
+  pool->nthreads = 1;
+  for (size_t k = 1; k < nthreads; k++) {
+    if (pthread_create(&pool->threads[k], NULL, worker_main, pool) != 0) {
+      log_warn("Could only start %zu of %zu threads", k, nthreads);
+      break;
+    }
+    pool->nthreads++;
+  }
+
+  return pool;
+}
+
+void threadpool_destroy(threadpool *pool) {
+  if (!pool) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t k = 1; k < pool->nthreads; k++) {
+    pthread_join(pool->threads[k], NULL);
+  }
+
+  pthread_cond_destroy(&pool->work_done);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+size_t threadpool_size(const threadpool *pool) {
+  return pool ? pool->nthreads : 1;
+}
+
+size_t threadpool_default_size(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (size_t)n : 1;
+}
+
+void threadpool_run(threadpool *pool, size_t ntasks, threadpool_fn fn, void *arg) {
+  assert(fn);
+
+  // not worth waking anyone up
+  if (!pool || pool->nthreads == 1 || ntasks <= 1) {
+    for (size_t t = 0; t < ntasks; t++) {
+      fn(arg, t);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->ntasks = ntasks;
+  pool->busy = pool->nthreads - 1;
+  pool->generation++;
+  atomic_store(&pool->next, 0);
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  run_tasks(pool, fn, arg, ntasks);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy > 0) {
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void run_tasks(threadpool *pool, threadpool_fn fn, void *arg, size_t ntasks) {
+  size_t t;
+  while ((t = atomic_fetch_add(&pool->next, 1)) < ntasks) {
+    fn(arg, t);
+  }
+}
+
+static void *worker_main(void *arg) {
+  threadpool *pool = arg;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->shutdown && pool->generation == seen) {
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    }
+    if (pool->shutdown) {
+      break;
+    }
+
+    seen = pool->generation;
+    threadpool_fn fn = pool->fn;
+    void *fn_arg = pool->arg;
+    size_t ntasks = pool->ntasks;
+    pthread_mutex_unlock(&pool->lock);
+
+    run_tasks(pool, fn, fn_arg, ntasks);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0) {
+      pthread_cond_signal(&pool->work_done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
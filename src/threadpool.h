@@ -0,0 +1,47 @@
+/**
+ * @file threadpool.h
+ * @brief A persistent pool of worker threads for data parallel loops
+ */
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <stddef.h>
+
+typedef struct threadpool threadpool;
+
+/**
+ * @brief One unit of work in a parallel loop.
+ * @param arg the argument given to threadpool_run
+ * @param task index of the task, from 0 to the task count
+ */
+typedef void (*threadpool_fn)(void *arg, size_t task);
+
+/**
+ * @brief Start a pool of threads.
+ * @param nthreads how many threads work on each loop, including the caller
+ *                 of threadpool_run, so 1 starts no threads at all
+ */
+threadpool *threadpool_create(size_t nthreads);
+
+void threadpool_destroy(threadpool *pool);
+
+/**
+ * @brief Number of threads that work on each loop, including the caller.
+ */
+size_t threadpool_size(const threadpool *pool);
+
+/**
+ * @brief Number of online cpus, for sizing a pool.
+ */
+size_t threadpool_default_size(void);
+
+/**
+ * @brief Run fn for every task in [0, ntasks) and wait for all of them.
+ *
+ * Tasks are handed out dynamically, so they don't need to be the same size.
+ * A NULL pool runs every task on the calling thread.
+ */
+void threadpool_run(threadpool *pool, size_t ntasks, threadpool_fn fn, void *arg);
+
+#endif /* _THREADPOOL_H_ */
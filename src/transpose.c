@@ -0,0 +1,115 @@
+/**
+ * @file transpose.c
+ * @brief Cache blocked image transposes
+ *
+ * The transpose walks the image in square tiles small enough that the
+ * source rows and destination rows of a tile stay in L1. Inside a tile the
+ * work is done on 16x16 register blocks with SIMD unpacks, and whatever
+ * doesn't fill a register block is done a pixel at a time. Color images are
+ * transposed one plane at a time.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <x86intrin.h>
+
+#include "car_internal.h"
+#include "transpose.h"
+
+// tile edge length, in pixels
+static const size_t TILE = 64;
+
+static void transpose_gray_block(const pixval *src, size_t src_stride,
+                                 pixval *dst, size_t dst_stride);
+static size_t min(size_t a, size_t b);
+
+void transpose_gray(const gray_image *in, gray_image *out) {
+  assert(IS_IMAGE(in));
+  assert(IS_IMAGE(out));
+  assert(in->width == out->height);
+  assert(in->height == out->width);
+
+  const size_t hh = in->height;
+  const size_t ww = in->width;
+  const size_t blk = 16;
+
+  for (size_t ti = 0; ti < hh; ti += TILE) {
+    for (size_t tj = 0; tj < ww; tj += TILE) {
+      size_t i1 = min(ti + TILE, hh);
+      size_t j1 = min(tj + TILE, ww);
+
+      size_t i = ti;
+      for (; i + blk <= i1; i += blk) {
+        size_t j = tj;
+        for (; j + blk <= j1; j += blk) {
+          transpose_gray_block(&GET_PIXEL(in, i, j), in->buf_width,
+                               &GET_PIXEL(out, j, i), out->buf_width);
+        }
+        // right edge of the tile
+        for (; j < j1; j++) {
+          for (size_t ii = i; ii < i+blk; ii++) {
+            GET_PIXEL(out, j, ii) = GET_PIXEL(in, ii, j);
+          }
+        }
+      }
+
+      // bottom edge of the tile
+      for (; i < i1; i++) {
+        for (size_t j = tj; j < j1; j++) {
+          GET_PIXEL(out, j, i) = GET_PIXEL(in, i, j);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Transpose a 16x16 block of bytes in registers.
+ *
+ * Four rounds of unpacks, each doubling the size of the element being
+ * interleaved (8, 16, 32, then 64 bits).
+ */
+static void transpose_gray_block(const pixval *src, size_t src_stride,
+                                 pixval *dst, size_t dst_stride) {
+  __m128i r[16];
+  __m128i t[16];
+
+  for (size_t k = 0; k < 16; k++) {
+    r[k] = _mm_loadu_si128((const __m128i *)(src + k*src_stride));
+  }
+
+  // pairs of rows
+  for (size_t k = 0; k < 8; k++) {
+    t[2*k+0] = _mm_unpacklo_epi8(r[2*k], r[2*k+1]);
+    t[2*k+1] = _mm_unpackhi_epi8(r[2*k], r[2*k+1]);
+  }
+
+  // groups of four rows
+  for (size_t k = 0; k < 4; k++) {
+    r[4*k+0] = _mm_unpacklo_epi16(t[4*k+0], t[4*k+2]);
+    r[4*k+1] = _mm_unpackhi_epi16(t[4*k+0], t[4*k+2]);
+    r[4*k+2] = _mm_unpacklo_epi16(t[4*k+1], t[4*k+3]);
+    r[4*k+3] = _mm_unpackhi_epi16(t[4*k+1], t[4*k+3]);
+  }
+
+  // groups of eight rows
+  for (size_t k = 0; k < 2; k++) {
+    for (size_t c = 0; c < 4; c++) {
+      t[8*k+2*c+0] = _mm_unpacklo_epi32(r[8*k+c], r[8*k+c+4]);
+      t[8*k+2*c+1] = _mm_unpackhi_epi32(r[8*k+c], r[8*k+c+4]);
+    }
+  }
+
+  // all sixteen rows, one output row per input column
+  for (size_t c = 0; c < 8; c++) {
+    __m128i lo = _mm_unpacklo_epi64(t[c], t[c+8]);
+    __m128i hi = _mm_unpackhi_epi64(t[c], t[c+8]);
+    _mm_storeu_si128((__m128i *)(dst + (2*c+0)*dst_stride), lo);
+    _mm_storeu_si128((__m128i *)(dst + (2*c+1)*dst_stride), hi);
+  }
+}
+
+static size_t min(size_t a, size_t b) {
+  if (a <= b) return a;
+  return b;
+}
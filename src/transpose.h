@@ -0,0 +1,18 @@
+/**
+ * @file transpose.h
+ * @brief Cache blocked image transposes, used to carve horizontal seams
+ */
+
+#ifndef _TRANSPOSE_H_
+#define _TRANSPOSE_H_
+
+#include "car_internal.h"
+
+/**
+ * @brief Transpose a grayscale image.
+ * @param in the image to transpose
+ * @param out destination, must be in->height wide and in->width tall
+ */
+void transpose_gray(const gray_image *in, gray_image *out);
+
+#endif /* _TRANSPOSE_H_ */
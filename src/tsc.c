@@ -0,0 +1,46 @@
+/**
+ * @file tsc.c
+ * @brief Calibrating the cycle counter against the monotonic clock
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "car_internal.h"
+#include "tsc.h"
+
+// how long to count cycles for, long enough that reading the clock at
+// either end is lost in the noise
+static const double CALIBRATE_SECONDS = 0.02;
+
+static pthread_once_t calibrated = PTHREAD_ONCE_INIT;
+static double hz;
+
+static void calibrate(void);
+static double now(void);
+
+double tsc_hz(void) {
+  pthread_once(&calibrated, calibrate);
+  return hz;
+}
+
+static void calibrate(void) {
+  double t0 = now();
+  uint64_t c0 = GET_CYCLE_COUNT();
+  double t1;
+  uint64_t c1;
+  do {
+    t1 = now();
+    c1 = GET_CYCLE_COUNT();
+  } while (t1 - t0 < CALIBRATE_SECONDS);
+  hz = (double)(c1 - c0) / (t1 - t0);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
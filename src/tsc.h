@@ -0,0 +1,19 @@
+/**
+ * @file tsc.h
+ * @brief The rate the cycle counter ticks at
+ */
+
+#ifndef _TSC_H_
+#define _TSC_H_
+
+/**
+ * @brief Ticks of GET_CYCLE_COUNT a second.
+ *
+ * Measured against the monotonic clock the first time it's asked for, which
+ * takes a few tens of milliseconds, and remembered after that. The counter
+ * ticks at the same rate whatever clock the cores run at, so this turns
+ * cycle counts into time, but not into cycles of the core.
+ */
+double tsc_hz(void);
+
+#endif /* _TSC_H_ */